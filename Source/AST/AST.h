@@ -122,6 +122,13 @@ namespace AST
 		}
 	};
 
+	// The location in a text file that an expression was parsed from.
+	struct ExpressionLocus
+	{
+		const UntypedExpression* expression;
+		Core::TextFileLocus locus;
+	};
+
 	struct Function
 	{
 		const char* name;
@@ -130,6 +137,10 @@ namespace AST
 		FunctionType type;
 		UntypedExpression* expression;
 
+		// The locations in the text file the function and its expressions were parsed from. These are only recorded by the text format parser.
+		Core::TextFileLocus locus;
+		std::vector<ExpressionLocus> expressionLoci;
+
 		Function(): name(nullptr), expression(nullptr) {}
 	};
 
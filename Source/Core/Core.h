@@ -33,7 +33,7 @@ namespace Core
 	struct Timer
 	{
 		Timer(): startTime(std::chrono::high_resolution_clock::now()), isStopped(false) {}
-		void stop() { endTime = std::chrono::high_resolution_clock::now(); }
+		void stop() { endTime = std::chrono::high_resolution_clock::now(); isStopped = true; }
 		uint64 getMicroseconds()
 		{
 			if(!isStopped) { stop(); }
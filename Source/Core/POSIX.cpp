@@ -6,6 +6,7 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 
 #include <iostream>
 #include <errno.h>
@@ -68,10 +69,20 @@ namespace Platform
 		return (uint8*)result;
 	}
 
-	bool commitVirtualPages(uint8* baseVirtualAddress,size_t numPages)
+	bool commitVirtualPages(uint8* baseVirtualAddress,size_t numPages,MemoryAccess access)
 	{
 		assert(isPageAligned(baseVirtualAddress));
-		return mprotect(baseVirtualAddress,numPages << getPreferredVirtualPageSizeLog2(),PROT_READ | PROT_WRITE) == 0;
+		const int protection = access == MemoryAccess::ReadWriteExecute ? PROT_READ | PROT_WRITE | PROT_EXEC : PROT_READ | PROT_WRITE;
+		return mprotect(baseVirtualAddress,numPages << getPreferredVirtualPageSizeLog2(),protection) == 0;
+	}
+
+	void adviseHugePages(uint8* baseVirtualAddress,size_t numPages)
+	{
+		assert(isPageAligned(baseVirtualAddress));
+		#ifdef MADV_HUGEPAGE
+			// This fails if the kernel doesn't support transparent huge pages, in which case the pages are just normal pages.
+			madvise(baseVirtualAddress,numPages << getPreferredVirtualPageSizeLog2(),MADV_HUGEPAGE);
+		#endif
 	}
 	
 	void decommitVirtualPages(uint8* baseVirtualAddress,size_t numPages)
@@ -87,6 +98,18 @@ namespace Platform
 		assert(isPageAligned(baseVirtualAddress));
 		if(munmap(baseVirtualAddress,numPages << getPreferredVirtualPageSizeLog2())) { throw; }
 	}
+
+	uint64 getPeakMemoryUsageBytes()
+	{
+		struct rusage usage;
+		if(getrusage(RUSAGE_SELF,&usage)) { return 0; }
+		#ifdef __APPLE__
+			return (uint64)usage.ru_maxrss;
+		#else
+			// Linux reports the maximum resident set size in kilobytes.
+			return (uint64)usage.ru_maxrss * 1024;
+		#endif
+	}
 }
 
 #endif
@@ -53,10 +53,21 @@ namespace Platform
 	// Returns the base virtual address of the allocated addresses, or nullptr if the virtual address space has been exhausted.
 	CORE_API uint8* allocateVirtualPages(size_t numPages);
 
+	// The access allowed to committed virtual pages.
+	enum class MemoryAccess
+	{
+		ReadWrite,
+		ReadWriteExecute
+	};
+
 	// Commits physical memory to the specified virtual pages.
 	// baseVirtualAddress must be a multiple of the preferred page size.
 	// Return true if successful, or false if physical memory has been exhausted.
-	CORE_API bool commitVirtualPages(uint8* baseVirtualAddress,size_t numPages);
+	CORE_API bool commitVirtualPages(uint8* baseVirtualAddress,size_t numPages,MemoryAccess access = MemoryAccess::ReadWrite);
+
+	// Hints that the specified virtual pages should be backed by huge pages if the OS supports it.
+	// baseVirtualAddress must be a multiple of the preferred page size.
+	CORE_API void adviseHugePages(uint8* baseVirtualAddress,size_t numPages);
 
 	// Decommits the physical memory that was committed to the specified virtual pages.
 	// baseVirtualAddress must be a multiple of the preferred page size.
@@ -65,4 +76,7 @@ namespace Platform
 	// Frees virtual addresses. Any physical memory committed to the addresses must have already been decommitted.
 	// baseVirtualAddress must be a multiple of the preferred page size.
 	CORE_API void freeVirtualPages(uint8* baseVirtualAddress,size_t numPages);
+
+	// Returns the peak physical memory used by the process so far, in bytes.
+	CORE_API uint64 getPeakMemoryUsageBytes();
 }
@@ -4,6 +4,7 @@
 #include "Platform.h"
 #include <Windows.h>
 #include <intrin.h>
+#include <Psapi.h>
 
 namespace Platform
 {
@@ -56,10 +57,16 @@ namespace Platform
 		return (uint8*)VirtualAlloc(nullptr,numPages << getPreferredVirtualPageSizeLog2(),MEM_RESERVE,PAGE_READWRITE);
 	}
 
-	bool commitVirtualPages(uint8* baseVirtualAddress,size_t numPages)
+	bool commitVirtualPages(uint8* baseVirtualAddress,size_t numPages,MemoryAccess access)
 	{
 		assert(isPageAligned(baseVirtualAddress));
-		return baseVirtualAddress == VirtualAlloc(baseVirtualAddress,numPages << getPreferredVirtualPageSizeLog2(),MEM_COMMIT,PAGE_READWRITE);
+		const DWORD protection = access == MemoryAccess::ReadWriteExecute ? PAGE_EXECUTE_READWRITE : PAGE_READWRITE;
+		return baseVirtualAddress == VirtualAlloc(baseVirtualAddress,numPages << getPreferredVirtualPageSizeLog2(),MEM_COMMIT,protection);
+	}
+
+	void adviseHugePages(uint8* baseVirtualAddress,size_t numPages)
+	{
+		// Windows only uses large pages for memory allocated with MEM_LARGE_PAGES, which requires a privilege most processes don't have.
 	}
 	
 	void decommitVirtualPages(uint8* baseVirtualAddress,size_t numPages)
@@ -75,6 +82,13 @@ namespace Platform
 		auto result = VirtualFree(baseVirtualAddress,0/*numPages << getPreferredVirtualPageSizeLog2()*/,MEM_RELEASE);
 		if(!result) { throw; }
 	}
+
+	uint64 getPeakMemoryUsageBytes()
+	{
+		PROCESS_MEMORY_COUNTERS counters;
+		if(!GetProcessMemoryInfo(GetCurrentProcess(),&counters,sizeof(counters))) { return 0; }
+		return counters.PeakWorkingSetSize;
+	}
 }
 
 #endif
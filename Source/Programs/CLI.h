@@ -3,9 +3,11 @@
 #include "Core/Core.h"
 #include "AST/AST.h"
 #include "WebAssembly/WebAssembly.h"
+#include "Runtime/Runtime.h"
 
 #include <iostream>
 #include <fstream>
+#include <cstdlib>
 
 inline std::vector<uint8> loadFile(const char* filename)
 {
@@ -23,7 +25,8 @@ inline std::vector<uint8> loadFile(const char* filename)
 	return data;
 }
 
-inline bool loadTextModule(const char* filename,WebAssemblyText::File& outFile)
+// Loads a WebAssembly text file. If outParseMilliseconds is non-null, it receives the time spent parsing the file.
+inline bool loadTextModule(const char* filename,WebAssemblyText::File& outFile,float64* outParseMilliseconds = nullptr)
 {
 	// Read the file into a string.
 	auto wastBytes = loadFile(filename);
@@ -44,11 +47,12 @@ inline bool loadTextModule(const char* filename,WebAssemblyText::File& outFile)
 		std::cerr << "WebAssembly text file didn't contain any modules!" << std::endl;
 		return false;
 	}
-	//std::cout << "Loaded in " << loadTimer.getMilliseconds() << "ms" << " (" << (wastString.size()/1024.0/1024.0 / loadTimer.getSeconds()) << " MB/s)" << std::endl;
+	if(outParseMilliseconds) { *outParseMilliseconds = loadTimer.getMilliseconds(); }
 	return true;
 }
 
-inline AST::Module* loadBinaryModule(const char* wasmFilename,const char* memFilename)
+// Loads a WebAssembly binary file. If outParseMilliseconds is non-null, it receives the time spent decoding the file.
+inline AST::Module* loadBinaryModule(const char* wasmFilename,const char* memFilename,float64* outParseMilliseconds = nullptr)
 {
 	// Read in packed .wasm file bytes.
 	auto wasmBytes = loadFile(wasmFilename);
@@ -68,7 +72,102 @@ inline AST::Module* loadBinaryModule(const char* wasmFilename,const char* memFil
 		for(auto error : errors) { std::cerr << error->message.c_str() << std::endl; }
 		return nullptr;
 	}
-	//std::cout << "Loaded in " << loadTimer.getMilliseconds() << "ms" << " (" << (wasmBytes.size()/1024.0/1024.0 / loadTimer.getSeconds()) << " MB/s)" << std::endl;
+	if(outParseMilliseconds) { *outParseMilliseconds = loadTimer.getMilliseconds(); }
 
 	return module;
 }
+
+// Options that control how the statistics of compiling a module are reported.
+struct CompileStatsOptions
+{
+	// If true, the statistics are printed to stderr.
+	bool print;
+
+	// If non-null, the statistics are appended to the file as a line of JSON.
+	const char* jsonPath;
+
+	CompileStatsOptions(): print(false), jsonPath(nullptr) {}
+};
+
+// Parses the runtime init and compile options at the start of a command-line, and removes them from argc/argv.
+inline void parseCompileOptions(int& argc,char**& argv,Runtime::InitOptions& outInitOptions,Runtime::CompileOptions& outOptions,CompileStatsOptions& outStatsOptions)
+{
+	while(argc > 1)
+	{
+		int numOptionArgs;
+		if(!strcmp(argv[1],"-stats")) { outStatsOptions.print = true; numOptionArgs = 1; }
+		else if(argc > 2 && !strcmp(argv[1],"-statsjson")) { outStatsOptions.jsonPath = argv[2]; numOptionArgs = 2; }
+		else if(argc > 2 && !strcmp(argv[1],"-cache")) { outOptions.objectCacheDirectory = argv[2]; numOptionArgs = 2; }
+		else if(argc > 2 && !strcmp(argv[1],"-cpu")) { outOptions.targetCPU = argv[2]; numOptionArgs = 2; }
+		else if(argc > 2 && !strcmp(argv[1],"-precompiled")) { outOptions.precompiledObjectPath = argv[2]; numOptionArgs = 2; }
+		else if(!strcmp(argv[1],"-tiered")) { outOptions.enableTieredCompilation = true; numOptionArgs = 1; }
+		else if(!strcmp(argv[1],"-lazy")) { outOptions.enableLazyCompilation = true; numOptionArgs = 1; }
+		else if(!strcmp(argv[1],"-instrument")) { outOptions.enableProfileInstrumentation = true; numOptionArgs = 1; }
+		else if(argc > 2 && !strcmp(argv[1],"-profile")) { outOptions.profileFilePath = argv[2]; numOptionArgs = 2; }
+		else if(!strcmp(argv[1],"-hugepages")) { outOptions.enableHugePageCodeMemory = true; numOptionArgs = 1; }
+		else if(!strcmp(argv[1],"-perfmap")) { outOptions.enablePerfMap = true; numOptionArgs = 1; }
+		else if(!strcmp(argv[1],"-jitdump")) { outOptions.enablePerfJITDump = true; numOptionArgs = 1; }
+		else if(!strcmp(argv[1],"-g")) { outOptions.enableDebugInfo = true; numOptionArgs = 1; }
+		else if(!strcmp(argv[1],"-boundschecks")) { outOptions.enableBoundsChecks = true; numOptionArgs = 1; }
+		else if(argc > 2 && !strcmp(argv[1],"-reserve")) { outInitOptions.instanceAddressSpaceMaxBytes = strtoull(argv[2],nullptr,10) * 1024 * 1024; numOptionArgs = 2; }
+		else
+		{
+			// Parse the optimization level flags: -O0, -O1, -O2, -O3, and -Os.
+			numOptionArgs = 0;
+			for(uintptr levelIndex = 0;levelIndex < (uintptr)Runtime::OptimizationLevel::num;++levelIndex)
+			{
+				auto level = (Runtime::OptimizationLevel)levelIndex;
+				if(argv[1][0] == '-' && !strcmp(argv[1] + 1,Runtime::describeOptimizationLevel(level)))
+				{
+					outOptions.optimizationLevel = level;
+					numOptionArgs = 1;
+				}
+			}
+			if(!numOptionArgs) { break; }
+		}
+
+		argv[numOptionArgs] = argv[0];
+		argv += numOptionArgs;
+		argc -= numOptionArgs;
+	}
+}
+
+// Prints the usage of the runtime compile options.
+inline void printCompileOptionsUsage()
+{
+	std::cerr << "Options:" << std::endl;
+	std::cerr << "  -O0, -O1, -O2, -O3  Optimize generated code at the given level (default: -O2)" << std::endl;
+	std::cerr << "  -Os                 Optimize generated code for size" << std::endl;
+	std::cerr << "  -cpu name           Generate code for the named CPU instead of the host CPU" << std::endl;
+	std::cerr << "  -cache directory    Cache generated machine code in the directory" << std::endl;
+	std::cerr << "  -precompiled file   Load machine code generated by the Compile program from the file" << std::endl;
+	std::cerr << "  -tiered             Run baseline code while optimized code is compiled in the background" << std::endl;
+	std::cerr << "  -lazy               Compile each function the first time it is called" << std::endl;
+	std::cerr << "  -instrument         Count executions of functions, branches, and loops to record a profile" << std::endl;
+	std::cerr << "  -profile file       Optimize using the profile in the file, or with -instrument, write the profile to it" << std::endl;
+	std::cerr << "  -hugepages          Allocate generated code from shared memory backed by huge pages" << std::endl;
+	std::cerr << "  -perfmap            Write the generated functions to /tmp/perf-<pid>.map for perf (Linux only)" << std::endl;
+	std::cerr << "  -jitdump            Write the generated functions and their code to /tmp/jit-<pid>.dump for perf (Linux only)" << std::endl;
+	std::cerr << "  -g                  Generate debug info that maps code to lines of the text file, and register it with GDB" << std::endl;
+	std::cerr << "  -boundschecks       Trap memory accesses beyond the allocated memory instead of masking their addresses" << std::endl;
+	std::cerr << "  -reserve megabytes  Reserve a power of two megabytes of address-space for each instance memory" << std::endl;
+	std::cerr << "  -stats              Print statistics about how each module was compiled" << std::endl;
+	std::cerr << "  -statsjson file     Append the statistics about how each module was compiled to the file as JSON" << std::endl;
+}
+
+// Reports the statistics of compiling a module as selected by the options.
+inline bool reportCompileStats(const CompileStatsOptions& statsOptions,const Runtime::CompileStats& stats)
+{
+	if(statsOptions.print) { std::cerr << Runtime::describeCompileStats(stats); }
+	if(statsOptions.jsonPath)
+	{
+		std::ofstream stream(statsOptions.jsonPath,std::ios::app);
+		if(!stream.is_open())
+		{
+			std::cerr << "Failed to open " << statsOptions.jsonPath << std::endl;
+			return false;
+		}
+		stream << Runtime::describeCompileStatsAsJSON(stats) << std::endl;
+	}
+	return true;
+}
\ No newline at end of file
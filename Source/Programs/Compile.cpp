@@ -0,0 +1,55 @@
+#include "Core/Core.h"
+#include "AST/AST.h"
+#include "Runtime/Runtime.h"
+
+#include "CLI.h"
+
+int main(int argc,char** argv)
+{
+	Runtime::InitOptions initOptions;
+	Runtime::CompileOptions compileOptions;
+	CompileStatsOptions statsOptions;
+	parseCompileOptions(argc,argv,initOptions,compileOptions,statsOptions);
+
+	AST::Module* module = nullptr;
+	float64 parseMilliseconds = 0.0;
+	const char* outputFilename;
+	if(argc == 4 && !strcmp(argv[1],"-text"))
+	{
+		WebAssemblyText::File wastFile;
+		if(loadTextModule(argv[2],wastFile,&parseMilliseconds)) { module = wastFile.modules[0]; }
+		else { return -1; }
+		outputFilename = argv[3];
+	}
+	else if(argc == 5 && !strcmp(argv[1],"-binary"))
+	{
+		module = loadBinaryModule(argv[2],argv[3],&parseMilliseconds);
+		outputFilename = argv[4];
+	}
+	else
+	{
+		std::cerr <<  "Usage: Compile [options] -binary in.wasm in.js.mem out.wavmobj" << std::endl;
+		std::cerr <<  "       Compile [options] -text in.wast out.wavmobj" << std::endl;
+		printCompileOptionsUsage();
+		return -1;
+	}
+	
+	if(!module) { return -1; }
+	compileOptions.sourcePath = argv[2];
+
+	// Initialize the runtime.
+	if(!Runtime::init(initOptions))
+	{
+		std::cerr << "Couldn't initialize runtime" << std::endl;
+		return -1;
+	}
+
+	Core::Timer compileTimer;
+	Runtime::CompileStats compileStats;
+	if(!Runtime::compileModuleToFile(module,compileOptions,outputFilename,&compileStats)) { return -1; }
+	std::cout << "Compiled module to " << outputFilename << " in " << compileTimer.getMilliseconds() << "ms" << std::endl;
+	compileStats.parseMilliseconds = parseMilliseconds;
+	if(!reportCompileStats(statsOptions,compileStats)) { return -1; }
+
+	return 0;
+}
@@ -8,37 +8,48 @@
 
 int main(int argc,char** argv)
 {
+	Runtime::InitOptions initOptions;
+	Runtime::CompileOptions compileOptions;
+	CompileStatsOptions statsOptions;
+	parseCompileOptions(argc,argv,initOptions,compileOptions,statsOptions);
+
 	AST::Module* module = nullptr;
+	float64 parseMilliseconds = 0.0;
 	const char* functionName;
 	if(argc == 4 && !strcmp(argv[1],"-text"))
 	{
 		WebAssemblyText::File wastFile;
-		if(loadTextModule(argv[2],wastFile)) { module = wastFile.modules[0]; }
+		if(loadTextModule(argv[2],wastFile,&parseMilliseconds)) { module = wastFile.modules[0]; }
 		else { return -1; }
 		functionName = argv[3];
 	}
 	else if(argc == 5 && !strcmp(argv[1],"-binary"))
 	{
-		module = loadBinaryModule(argv[2],argv[3]);
+		module = loadBinaryModule(argv[2],argv[3],&parseMilliseconds);
 		functionName = argv[4];
 	}
 	else
 	{
-		std::cerr <<  "Usage: Run -binary in.wasm in.js.mem functionname" << std::endl;
-		std::cerr <<  "       Run -text in.wast functionname" << std::endl;
+		std::cerr <<  "Usage: Run [options] -binary in.wasm in.js.mem functionname" << std::endl;
+		std::cerr <<  "       Run [options] -text in.wast functionname" << std::endl;
+		printCompileOptionsUsage();
 		return -1;
 	}
 	
 	if(!module) { return -1; }
+	compileOptions.sourcePath = argv[2];
 	
 	// Initialize the runtime.
-	if(!Runtime::init())
+	if(!Runtime::init(initOptions))
 	{
 		std::cerr << "Couldn't initialize runtime" << std::endl;
 		return false;
 	}
 
-	if(!Runtime::loadModule(module)) { return -1; }
+	Runtime::CompileStats compileStats;
+	if(!Runtime::loadModule(module,compileOptions,&compileStats)) { return -1; }
+	compileStats.parseMilliseconds = parseMilliseconds;
+	if(!reportCompileStats(statsOptions,compileStats)) { return -1; }
 	
 	// Initialize the Emscripten intrinsics.
 	auto iostreamInitExport = module->exportNameToFunctionIndexMap.find("__GLOBAL__sub_I_iostream_cpp");
@@ -88,5 +99,12 @@ int main(int argc,char** argv)
 
 	std::cout << "Execution time: " << executionTime.getMilliseconds() << "ms" << std::endl;
 
+	// Write the profile recorded by the instrumented code.
+	if(compileOptions.enableProfileInstrumentation && compileOptions.profileFilePath)
+	{
+		if(!Runtime::saveModuleProfile(module,compileOptions.profileFilePath)) { return -1; }
+		std::cout << "Wrote profile to " << compileOptions.profileFilePath << std::endl;
+	}
+
 	return 0;
 }
@@ -28,88 +28,151 @@ std::string describeRuntimeValue(const Runtime::Value& value)
 	}
 }
 
+// Evaluates a module's test statements, and returns the number that failed.
+uintptr runTestStatements(const char* filename,const AST::Module* module,const std::vector<TestStatement*>& testStatements)
+{
+	uintptr numTestsFailed = 0;
+	for(uintptr statementIndex = 0;statementIndex < testStatements.size();++statementIndex)
+	{
+		auto statement = testStatements[statementIndex];
+		auto statementLocus = filename + statement->locus.describe();
+		switch(statement->op)
+		{
+		case TestOp::Invoke:
+		{
+			auto invoke = (Invoke*)statement;
+			auto result = Runtime::invokeFunction(module,invoke->functionIndex,invoke->parameters.data());
+			if(result.type == Runtime::TypeId::Exception)
+			{
+				std::cerr << statementLocus << ": invoke unexpectedly trapped: " << Runtime::describeExceptionCause(result.exception->cause) << std::endl;
+				for(auto function : result.exception->callStack) { std::cerr << "  " << function << std::endl; }
+				++numTestsFailed;
+			}
+			break;
+		}
+		case TestOp::Assert:
+		{
+			auto assertStatement = (Assert*)statement;
+			auto invoke = assertStatement->invoke;
+			auto result = Runtime::invokeFunction(module,invoke->functionIndex,invoke->parameters.data());
+			if(describeRuntimeValue(result) != describeRuntimeValue(assertStatement->value))
+			{
+				std::cerr << statementLocus << ": assertion failure: expected "
+					<< describeRuntimeValue(assertStatement->value)
+					<< " but got " << describeRuntimeValue(result) << std::endl;
+				++numTestsFailed;
+			}
+			break;
+		}
+		case TestOp::AssertNaN:
+		{
+			auto assertStatement = (AssertNaN*)statement;
+			auto invoke = assertStatement->invoke;
+			auto result = Runtime::invokeFunction(module,invoke->functionIndex,invoke->parameters.data());
+			if(result.type != Runtime::TypeId::F32 && result.type != Runtime::TypeId::F64)
+			{
+				std::cerr << statementLocus << ": assertion failure: expected floating-point number but got " << describeRuntimeValue(result) << std::endl;
+				++numTestsFailed;
+			}
+			else if(	(result.type == Runtime::TypeId::F32 && (result.f32 == result.f32))
+			||		(result.type == Runtime::TypeId::F64 && (result.f64 == result.f64)))
+			{
+				std::cerr << statementLocus << ": assertion failure: expected NaN but got " << describeRuntimeValue(result) << std::endl;
+				++numTestsFailed;
+			}
+			break;
+		}
+		default: throw;
+		}
+	}
+	return numTestsFailed;
+}
+
 int main(int argc,char** argv)
 {
-	if(argc != 2)
+	Runtime::InitOptions initOptions;
+	initOptions.enableTestIntrinsics = true;
+	Runtime::CompileOptions compileOptions;
+	CompileStatsOptions statsOptions;
+	parseCompileOptions(argc,argv,initOptions,compileOptions,statsOptions);
+
+	// -repeat loads, tests, and unloads the modules the given number of times.
+	uintptr numRepetitions = 1;
+	if(argc > 2 && !strcmp(argv[1],"-repeat"))
+	{
+		numRepetitions = strtoul(argv[2],nullptr,10);
+		argv[2] = argv[0];
+		argv += 2;
+		argc -= 2;
+	}
+
+	if(argc != 2 || !numRepetitions)
 	{
-		std::cerr <<  "Usage: Test in.wast" << std::endl;
+		std::cerr <<  "Usage: Test [options] [-repeat count] in.wast" << std::endl;
+		printCompileOptionsUsage();
 		return -1;
 	}
 	
 	const char* filename = argv[1];
+	compileOptions.sourcePath = filename;
 	File wastFile;
 	if(!loadTextModule(filename,wastFile)) { return -1; }
 	
 	// Initialize the runtime.
-	if(!Runtime::init())
+	if(!Runtime::init(initOptions))
 	{
 		std::cerr << "Couldn't initialize runtime" << std::endl;
 		return false;
 	}
 	
 	uintptr numTestsFailed = 0;
-	for(uintptr moduleIndex = 0;moduleIndex < wastFile.modules.size();++moduleIndex)
+	uint64 firstRepetitionSharedMemoryBytes = 0;
+	for(uintptr repetitionIndex = 0;repetitionIndex < numRepetitions;++repetitionIndex)
 	{
-		auto module = wastFile.modules[moduleIndex];
-		auto& testStatements = wastFile.moduleTests[moduleIndex];
-		if(!testStatements.size()) { continue; }
+		for(uintptr moduleIndex = 0;moduleIndex < wastFile.modules.size();++moduleIndex)
+		{
+			auto module = wastFile.modules[moduleIndex];
+			auto& testStatements = wastFile.moduleTests[moduleIndex];
+			if(!testStatements.size()) { continue; }
 
-		// Initialize the module runtime environment.
-		if(!Runtime::loadModule(module)) { return -1; }
+			// Initialize the module runtime environment.
+			Runtime::CompileStats compileStats;
+			if(!Runtime::loadModule(module,compileOptions,&compileStats)) { return -1; }
+			if(!reportCompileStats(statsOptions,compileStats)) { return -1; }
 		
-		// Evaluate each test statement.
-		for(uintptr statementIndex = 0;statementIndex < testStatements.size();++statementIndex)
-		{
-			auto statement = testStatements[statementIndex];
-			auto statementLocus = filename + statement->locus.describe();
-			switch(statement->op)
-			{
-			case TestOp::Invoke:
-			{
-				auto invoke = (Invoke*)statement;
-				auto result = Runtime::invokeFunction(module,invoke->functionIndex,invoke->parameters.data());
-				if(result.type == Runtime::TypeId::Exception)
-				{
-					std::cerr << statementLocus << ": invoke unexpectedly trapped: " << Runtime::describeExceptionCause(result.exception->cause) << std::endl;
-					for(auto function : result.exception->callStack) { std::cerr << "  " << function << std::endl; }
-					++numTestsFailed;
-				}
-				break;
-			}
-			case TestOp::Assert:
-			{
-				auto assertStatement = (Assert*)statement;
-				auto invoke = assertStatement->invoke;
-				auto result = Runtime::invokeFunction(module,invoke->functionIndex,invoke->parameters.data());
-				if(describeRuntimeValue(result) != describeRuntimeValue(assertStatement->value))
-				{
-					std::cerr << statementLocus << ": assertion failure: expected "
-						<< describeRuntimeValue(assertStatement->value)
-						<< " but got " << describeRuntimeValue(result) << std::endl;
-					++numTestsFailed;
-				}
-				break;
-			}
-			case TestOp::AssertNaN:
+			// Evaluate each test statement.
+			numTestsFailed += runTestStatements(filename,module,testStatements);
+
+			// If the module is instrumented, write the profile its tests recorded if a profile file was given, and recompile the module
+			// with the profile. Then evaluate the test statements again with the recompiled code.
+			if(compileOptions.enableProfileInstrumentation)
 			{
-				auto assertStatement = (AssertNaN*)statement;
-				auto invoke = assertStatement->invoke;
-				auto result = Runtime::invokeFunction(module,invoke->functionIndex,invoke->parameters.data());
-				if(result.type != Runtime::TypeId::F32 && result.type != Runtime::TypeId::F64)
-				{
-					std::cerr << statementLocus << ": assertion failure: expected floating-point number but got " << describeRuntimeValue(result) << std::endl;
-					++numTestsFailed;
-				}
-				else if(	(result.type == Runtime::TypeId::F32 && (result.f32 == result.f32))
-				||		(result.type == Runtime::TypeId::F64 && (result.f64 == result.f64)))
-				{
-					std::cerr << statementLocus << ": assertion failure: expected NaN but got " << describeRuntimeValue(result) << std::endl;
-					++numTestsFailed;
-				}
-				break;
-			}
-			default: throw;
+				if(compileOptions.profileFilePath && !Runtime::saveModuleProfile(module,compileOptions.profileFilePath)) { return -1; }
+
+				Runtime::CompileStats recompileStats;
+				if(!Runtime::recompileModuleWithProfile(module,&recompileStats)) { return -1; }
+				if(!reportCompileStats(statsOptions,recompileStats)) { return -1; }
+				numTestsFailed += runTestStatements(filename,module,testStatements);
 			}
+
+			// Free the module's machine code before loading the next module.
+			if(!Runtime::unloadModule(module)) { return -1; }
+		}
+
+		// Check that the modules' code and data were freed when they were unloaded, and that the memory shared by modules loaded with
+		// -hugepages didn't grow after the first repetition, which would mean the freed memory wasn't reused.
+		const Runtime::CodeMemoryStats codeMemoryStats = Runtime::getCodeMemoryStats();
+		if(codeMemoryStats.numAllocatedBytes)
+		{
+			std::cerr << filename << ": " << codeMemoryStats.numAllocatedBytes << " bytes of code memory weren't freed when the modules were unloaded" << std::endl;
+			return -1;
+		}
+		if(!repetitionIndex) { firstRepetitionSharedMemoryBytes = codeMemoryStats.numSharedMemoryBytes; }
+		else if(codeMemoryStats.numSharedMemoryBytes > firstRepetitionSharedMemoryBytes)
+		{
+			std::cerr << filename << ": shared code memory grew from " << firstRepetitionSharedMemoryBytes << " to " << codeMemoryStats.numSharedMemoryBytes
+				<< " bytes when the modules were reloaded" << std::endl;
+			return -1;
 		}
 	}
 
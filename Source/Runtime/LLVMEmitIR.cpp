@@ -4,72 +4,215 @@ using namespace AST;
 
 namespace LLVMJIT
 {
-	// The global LLVM context.
-	llvm::LLVMContext& context = llvm::getGlobalContext();
-
-	// Maps a type ID to the corresponding LLVM type.
-	llvm::Type* llvmTypesByTypeId[(size_t)TypeId::num];
-
-	// Zero constants of each type.
-	llvm::Constant* typedZeroConstants[(size_t)TypeId::num];
-	
-	// A dummy constant to use as the unique value inhabiting the void type.
-	llvm::Constant* voidDummy;
-
 	// Converts an AST type to a LLVM type.
-	llvm::Type* asLLVMType(TypeId type) { return llvmTypesByTypeId[(uintptr)type]; }
+	llvm::Type* asLLVMType(EmitContext& emitContext,TypeId type) { return emitContext.llvmTypesByTypeId[(uintptr)type]; }
 	
 	// Converts an AST function type to a LLVM type.
-	llvm::FunctionType* asLLVMType(const FunctionType& functionType)
+	llvm::FunctionType* asLLVMType(EmitContext& emitContext,const FunctionType& functionType)
 	{
 		auto llvmArgTypes = (llvm::Type**)alloca(sizeof(llvm::Type*) * functionType.parameters.size());
 		for(uintptr argIndex = 0;argIndex < functionType.parameters.size();++argIndex)
 		{
-			llvmArgTypes[argIndex] = asLLVMType(functionType.parameters[argIndex]);
+			llvmArgTypes[argIndex] = asLLVMType(emitContext,functionType.parameters[argIndex]);
 		}
-		auto llvmReturnType = asLLVMType(functionType.returnType);
+		auto llvmReturnType = asLLVMType(emitContext,functionType.returnType);
 		return llvm::FunctionType::get(llvmReturnType,llvm::ArrayRef<llvm::Type*>(llvmArgTypes,functionType.parameters.size()),false);
 	}
-	
-	// Converts an AST name to a LLVM name. Ensures that the name is not-null, and prefixes it to ensure it doesn't conflict with export names.
-	llvm::Twine getLLVMName(const char* nullableName) { return nullableName ? (llvm::Twine('_') + llvm::Twine(nullableName)) : ""; }
+
+	// Converts the AST type of a function defined by a module to the LLVM type of its generated code, which takes a pointer to the
+	// instance memory as its first argument, followed by the function's parameters.
+	llvm::FunctionType* asLLVMDefinedFunctionType(EmitContext& emitContext,const FunctionType& functionType)
+	{
+		auto llvmArgTypes = (llvm::Type**)alloca(sizeof(llvm::Type*) * (functionType.parameters.size() + 1));
+		llvmArgTypes[0] = emitContext.instanceMemoryPointerType;
+		for(uintptr argIndex = 0;argIndex < functionType.parameters.size();++argIndex)
+		{
+			llvmArgTypes[argIndex + 1] = asLLVMType(emitContext,functionType.parameters[argIndex]);
+		}
+		auto llvmReturnType = asLLVMType(emitContext,functionType.returnType);
+		return llvm::FunctionType::get(llvmReturnType,llvm::ArrayRef<llvm::Type*>(llvmArgTypes,functionType.parameters.size() + 1),false);
+	}
 	
 	// Overloaded functions that compile a literal value to a LLVM constant of the right type.
-	inline llvm::ConstantInt* compileLiteral(uint8 value) { return (llvm::ConstantInt*)llvm::ConstantInt::get(asLLVMType(TypeId::I8),llvm::APInt(8,(uint64)value,false)); }
-	inline llvm::ConstantInt* compileLiteral(uint16 value) { return (llvm::ConstantInt*)llvm::ConstantInt::get(asLLVMType(TypeId::I16),llvm::APInt(16,(uint64)value,false)); }
-	inline llvm::ConstantInt* compileLiteral(uint32 value) { return (llvm::ConstantInt*)llvm::ConstantInt::get(asLLVMType(TypeId::I32),llvm::APInt(32,(uint64)value,false)); }
-	inline llvm::ConstantInt* compileLiteral(uint64 value) { return (llvm::ConstantInt*)llvm::ConstantInt::get(asLLVMType(TypeId::I64),llvm::APInt(64,(uint64)value,false)); }
-	inline llvm::Constant* compileLiteral(float32 value) { return llvm::ConstantFP::get(context,llvm::APFloat(value)); }
-	inline llvm::Constant* compileLiteral(float64 value) { return llvm::ConstantFP::get(context,llvm::APFloat(value)); }
-	inline llvm::Constant* compileLiteral(bool value) { return llvm::ConstantInt::get(asLLVMType(TypeId::Bool),llvm::APInt(1,value ? 1 : 0,false)); }
+	inline llvm::ConstantInt* compileLiteral(EmitContext& emitContext,uint8 value) { return (llvm::ConstantInt*)llvm::ConstantInt::get(asLLVMType(emitContext,TypeId::I8),llvm::APInt(8,(uint64)value,false)); }
+	inline llvm::ConstantInt* compileLiteral(EmitContext& emitContext,uint16 value) { return (llvm::ConstantInt*)llvm::ConstantInt::get(asLLVMType(emitContext,TypeId::I16),llvm::APInt(16,(uint64)value,false)); }
+	inline llvm::ConstantInt* compileLiteral(EmitContext& emitContext,uint32 value) { return (llvm::ConstantInt*)llvm::ConstantInt::get(asLLVMType(emitContext,TypeId::I32),llvm::APInt(32,(uint64)value,false)); }
+	inline llvm::ConstantInt* compileLiteral(EmitContext& emitContext,uint64 value) { return (llvm::ConstantInt*)llvm::ConstantInt::get(asLLVMType(emitContext,TypeId::I64),llvm::APInt(64,(uint64)value,false)); }
+	inline llvm::Constant* compileLiteral(EmitContext& emitContext,float32 value) { return llvm::ConstantFP::get(emitContext.llvmContext,llvm::APFloat(value)); }
+	inline llvm::Constant* compileLiteral(EmitContext& emitContext,float64 value) { return llvm::ConstantFP::get(emitContext.llvmContext,llvm::APFloat(value)); }
+	inline llvm::Constant* compileLiteral(EmitContext& emitContext,bool value) { return llvm::ConstantInt::get(asLLVMType(emitContext,TypeId::Bool),llvm::APInt(1,value ? 1 : 0,false)); }
 	
+	// Returns whether a function import is the memory_size intrinsic, which the emitter reads the instance memory's size for directly
+	// instead of calling.
+	static bool isMemorySizeImport(const FunctionImport& functionImport)
+	{
+		return !strcmp(functionImport.module,"wasm_intrinsics") && !strcmp(functionImport.name,"memory_size") && functionImport.type.parameters.size() == 0;
+	}
+
+	// Finds the memory accesses in a loop whose 32-bit addresses are a local plus a constant offset, which locals the loop sets, and
+	// whether it calls any function. Without calls, the instance memory can't change size within the loop, so the bounds of the accesses
+	// relative to locals that the loop doesn't set can be checked once before entering it.
+	struct LoopMemoryAccessVisitor : MapChildrenVisitor<LoopMemoryAccessVisitor&,TypedExpression>
+	{
+		// The range of byte offsets from a local's value that the loop accesses.
+		struct LocalAccessRange
+		{
+			uint64 offset;
+			uint64 endOffset;
+		};
+		std::map<uintptr,LocalAccessRange> localAccessRanges;
+
+		std::vector<bool> isLocalSet;
+		bool containsCall;
+
+		LoopMemoryAccessVisitor(Memory::Arena& inArena,const Module* inModule,Function* inFunction)
+		: MapChildrenVisitor(inArena,inModule,inFunction,*this), isLocalSet(inFunction->locals.size(),false), containsCall(false) {}
+
+		TypedExpression operator()(TypedExpression child) { return dispatch(*this,child); }
+
+		// Splits a 32-bit address into a base expression and a constant offset, if it adds a literal to the base.
+		static Expression<IntClass>* getAddressBase(Expression<IntClass>* address,uint32& outOffset)
+		{
+			outOffset = 0;
+			if(address->op() != IntOp::add || ((Binary<IntClass>*)address)->right->op() != IntOp::lit) { return address; }
+			outOffset = ((Literal<I32Type>*)((Binary<IntClass>*)address)->right)->value;
+			return ((Binary<IntClass>*)address)->left;
+		}
+
+		void addAccess(Expression<IntClass>* address,bool isFarAddress,TypeId memoryType)
+		{
+			uint32 offset;
+			auto base = getAddressBase(address,offset);
+			if(isFarAddress || base->op() != IntOp::getLocal) { return; }
+
+			const uint64 endOffset = uint64(offset) + getTypeByteWidth(memoryType);
+			auto rangeIt = localAccessRanges.find(((GetLocal*)base)->variableIndex);
+			if(rangeIt == localAccessRanges.end()) { localAccessRanges[((GetLocal*)base)->variableIndex] = {offset,endOffset}; }
+			else
+			{
+				rangeIt->second.offset = std::min(rangeIt->second.offset,(uint64)offset);
+				rangeIt->second.endOffset = std::max(rangeIt->second.endOffset,endOffset);
+			}
+		}
+
+		DispatchResult visitSetLocal(const SetLocal* setLocal)
+		{
+			isLocalSet[setLocal->variableIndex] = true;
+			return MapChildrenVisitor::visitSetLocal(setLocal);
+		}
+		template<typename Class,typename OpAsType>
+		DispatchResult visitLoad(TypeId type,const Load<Class>* load,OpAsType opAsType)
+		{
+			addAccess(load->address,load->isFarAddress,load->memoryType);
+			return MapChildrenVisitor::visitLoad(type,load,opAsType);
+		}
+		template<typename Class>
+		DispatchResult visitStore(const Store<Class>* store)
+		{
+			addAccess(store->address,store->isFarAddress,store->memoryType);
+			return MapChildrenVisitor::visitStore(store);
+		}
+		template<typename OpAsType>
+		DispatchResult visitCall(TypeId type,const Call* call,OpAsType opAsType)
+		{
+			if(call->op() != AnyOp::callImport || !isMemorySizeImport(module->functionImports[call->functionIndex])) { containsCall = true; }
+			return MapChildrenVisitor::visitCall(type,call,opAsType);
+		}
+		DispatchResult visitCallIndirect(TypeId type,const CallIndirect* callIndirect)
+		{
+			containsCall = true;
+			return MapChildrenVisitor::visitCallIndirect(type,callIndirect);
+		}
+	};
+
 	// The LLVM IR for a module.
 	struct ModuleIR
 	{
+		EmitContext& emitContext;
+		llvm::LLVMContext& context;
 		llvm::Module* llvmModule;
 		std::vector<llvm::Function*> functions;
-		std::vector<llvm::GlobalVariable*> functionImportPointers;
+		std::vector<llvm::Function*> functionImports;
 		std::vector<llvm::GlobalVariable*> functionTablePointers;
-		llvm::Value* instanceMemoryBase;
 		llvm::Value* instanceMemoryAddressMask;
 
-		ModuleIR()
-		:	llvmModule(new llvm::Module("",context))
-		,	instanceMemoryBase(nullptr)
+		// If the module calls its functions through its function pointer table, the table, which is an array of integer addresses. The
+		// function tables then hold the indices of the functions instead of their addresses.
+		llvm::GlobalVariable* functionPointers;
+
+		// Type-based alias analysis tags for accesses to the instance memory, and for loads of its size. They tell LLVM that stores to the
+		// instance memory don't change its size, so with bounds checks, loads of the size may be reused across stores and hoisted out of loops.
+		llvm::MDNode* memoryAccessTBAATag;
+		llvm::MDNode* memoryNumBytesTBAATag;
+
+		// For each function, the functions that its call_indirect sites call directly when the profile shows they usually call them.
+		std::vector<std::vector<uintptr>> speculatedCallees;
+
+		// The number of call_indirect sites in the module's defined functions that call their profiled targets directly.
+		uintptr numSpeculatedCallSites;
+
+		const EmitOptions& options;
+
+		// Functions whose profiled entry count is at least this are hinted to be inlined.
+		uint64 hotFunctionEntryCountThreshold;
+
+		// If the module is emitted with debug info, the builder for its debug info metadata, and the metadata shared by all its functions.
+		std::unique_ptr<llvm::DIBuilder> diBuilder;
+		llvm::DICompileUnit* diCompileUnit;
+		llvm::DIFile* diFile;
+		llvm::DISubroutineType* diFunctionType;
+
+		ModuleIR(EmitContext& inEmitContext,const EmitOptions& inOptions)
+		:	emitContext(inEmitContext)
+		,	context(inEmitContext.llvmContext)
+		,	llvmModule(new llvm::Module("",context))
 		,	instanceMemoryAddressMask(nullptr)
+		,	functionPointers(nullptr)
+		,	memoryAccessTBAATag(nullptr)
+		,	memoryNumBytesTBAATag(nullptr)
+		,	numSpeculatedCallSites(0)
+		,	options(inOptions)
+		,	hotFunctionEntryCountThreshold(UINT64_MAX)
+		,	diCompileUnit(nullptr)
+		,	diFile(nullptr)
+		,	diFunctionType(nullptr)
 		{}
+
+		// Returns the declaration of a function that is resolved by name when the module is linked, creating it if necessary. Calls to it
+		// are direct calls that the linker binds to the function's address.
+		llvm::Function* getImportedFunction(const std::string& decoratedName,const FunctionType& functionType)
+		{
+			auto function = llvmModule->getFunction(decoratedName);
+			if(!function) { function = llvm::Function::Create(asLLVMType(emitContext,functionType),llvm::Function::ExternalLinkage,decoratedName,llvmModule); }
+			return function;
+		}
 	};
 
 	// The context used by functions involved in JITing a single AST function.
 	struct EmitFunctionContext
 	{
 		ModuleIR& moduleIR;
+		EmitContext& emitContext;
+		llvm::LLVMContext& context;
 		const Module* astModule;
+		uintptr functionIndex;
 		Function* astFunction;
 		llvm::Function* llvmFunction;
 		llvm::IRBuilder<> irBuilder;
 
-		llvm::Value** localVariablePointers;
+		// The pointer to the instance memory the function is passed as its first argument, and the memory's base, which is loaded once when
+		// the function is entered.
+		llvm::Value* instanceMemory;
+		llvm::Value* instanceMemoryBase;
+
+		// The value of each local variable at the insert point. The emitter constructs SSA form directly instead of keeping the locals in
+		// allocas: where control flow joins, the values of the locals on each incoming edge are merged with phis.
+		llvm::Value** localValues;
+
+		// The phis created for locals at the start of loops that turned out not to change the local, mapped to the local's value on entry to
+		// the loop. The phis are replaced as soon as the loop has been emitted, but the values of the locals captured for branches out of
+		// the loop may still refer to them, so they are only deleted once the whole function has been emitted.
+		std::unordered_map<llvm::Value*,llvm::Value*> unchangedLoopLocalPHIs;
 
 		llvm::BasicBlock* unreachableBlock;
 		
@@ -81,6 +224,7 @@ namespace LLVMJIT
 		{
 			llvm::BasicBlock* incomingBlock;
 			llvm::Value* value;
+			llvm::Value** localValues;
 			BranchResult* next;
 		};
 
@@ -96,16 +240,65 @@ namespace LLVMJIT
 		// A linked list of in-scope branch targets.
 		BranchContext* branchContext;
 
-		EmitFunctionContext(ModuleIR& inModuleIR,const Module* inASTModule,uintptr functionIndex)
+		// The function's profile counters are allocated in the order the emitter visits the function's expressions, so they are numbered
+		// the same way for the instrumented code that records a profile and the code that is compiled using the profile.
+		uintptr numProfileCounters;
+		const std::vector<uint64>* functionProfile;
+
+		// If the module is instrumented, a placeholder for the function's profile counter array. It is replaced with the real array once
+		// the number of counters is known.
+		llvm::GlobalVariable* profileCountersPlaceholder;
+
+		// Blocks that raise a trap, shared by all the operations in the function that may cause it. They are created when first used.
+		llvm::BasicBlock* invalidFloatOperationTrapBlock;
+		llvm::BasicBlock* integerOverflowTrapBlock;
+		llvm::BasicBlock* accessViolationTrapBlock;
+
+		// With bounds checks, a range of byte offsets from a 32-bit base address that a dominating check found to be in bounds. If
+		// mayBeOutOfBounds is non-null, the range was checked before entering a loop, and it is only in bounds if mayBeOutOfBounds is false.
+		// The instance memory may shrink during a call, so a range is only valid while callGeneration is the same as when it was checked.
+		struct CheckedAddressRange
+		{
+			llvm::Value* base;
+			uint64 offset;
+			uint64 endOffset;
+			uintptr callGeneration;
+			llvm::Value* mayBeOutOfBounds;
+		};
+		std::vector<CheckedAddressRange> checkedAddressRanges;
+		uintptr callGeneration;
+
+		// If the module is emitted with debug info, the function's debug info, and the loci of its expressions.
+		llvm::DISubprogram* diSubprogram;
+		std::unordered_map<const UntypedExpression*,Core::TextFileLocus> expressionLoci;
+
+		EmitFunctionContext(ModuleIR& inModuleIR,const Module* inASTModule,uintptr inFunctionIndex)
 		: moduleIR(inModuleIR)
+		, emitContext(inModuleIR.emitContext)
+		, context(inModuleIR.context)
 		, astModule(inASTModule)
+		, functionIndex(inFunctionIndex)
 		, astFunction(astModule->functions[functionIndex])
 		, llvmFunction(inModuleIR.functions[functionIndex])
 		, irBuilder(context)
-		, localVariablePointers(nullptr)
+		, instanceMemory(nullptr)
+		, instanceMemoryBase(nullptr)
+		, localValues(nullptr)
 		, branchContext(nullptr)
+		, numProfileCounters(0)
+		, functionProfile(nullptr)
+		, profileCountersPlaceholder(nullptr)
+		, invalidFloatOperationTrapBlock(nullptr)
+		, integerOverflowTrapBlock(nullptr)
+		, accessViolationTrapBlock(nullptr)
+		, callGeneration(0)
+		, diSubprogram(nullptr)
 		{
 			unreachableBlock = llvm::BasicBlock::Create(context,"unreachable",llvmFunction);
+
+			if(moduleIR.options.profile && functionIndex < moduleIR.options.profile->functionCounters.size()
+			&& moduleIR.options.profile->functionCounters[functionIndex].size())
+			{ functionProfile = &moduleIR.options.profile->functionCounters[functionIndex]; }
 		}
 
 		void emit();
@@ -114,6 +307,30 @@ namespace LLVMJIT
 		// If the inner expression doesn't return control to the outer, then it will be null.
 		typedef llvm::Value* DispatchResult;
 		
+		// Returns the debug location for a locus in the module's source file.
+		llvm::DebugLoc getDebugLoc(const Core::TextFileLocus& locus)
+		{
+			return llvm::DebugLoc::get(locus.newlines + 1,locus.tabs * 4 + locus.characters + 1,diSubprogram);
+		}
+
+		static const UntypedExpression* getUntypedExpression(const UntypedExpression* expression) { return expression; }
+		static const UntypedExpression* getUntypedExpression(const TypedExpression& expression) { return expression.expression; }
+
+		// Emits the IR for a subexpression. If the module is emitted with debug info, the subexpression's IR gets the debug location
+		// of its locus, and the IR its parent emits afterward keeps the parent's debug location.
+		template<typename ExpressionArg,typename... TypeArgs>
+		DispatchResult emitExpression(ExpressionArg expression,TypeArgs... type)
+		{
+			if(!diSubprogram) { return dispatch(*this,expression,type...); }
+
+			const llvm::DebugLoc parentDebugLoc = irBuilder.getCurrentDebugLocation();
+			auto locusIt = expressionLoci.find(getUntypedExpression(expression));
+			if(locusIt != expressionLoci.end()) { irBuilder.SetCurrentDebugLocation(getDebugLoc(locusIt->second)); }
+			auto result = dispatch(*this,expression,type...);
+			irBuilder.SetCurrentDebugLocation(parentDebugLoc);
+			return result;
+		}
+
 		// Inserts a branch, and returns the old basic block.
 		llvm::BasicBlock* compileBranch(llvm::BasicBlock* dest)
 		{
@@ -137,34 +354,231 @@ namespace LLVMJIT
 				return exitBlock;
 			}
 		}
+
+		// Returns a copy of the current values of the locals.
+		llvm::Value** captureLocalValues()
+		{
+			auto capturedLocalValues = new(scopedArena) llvm::Value*[astFunction->locals.size()];
+			std::copy(localValues,localValues + astFunction->locals.size(),capturedLocalValues);
+			return capturedLocalValues;
+		}
+
+		// If a branch was inserted at the end of exitBlock, records the value it yields and the current values of the locals in a branch
+		// target's list of incoming edges. exitBlock is null if the branch wasn't inserted because the insert point was unreachable.
+		void addBranchResult(BranchResult*& results,llvm::BasicBlock* exitBlock,llvm::Value* value)
+		{
+			if(exitBlock) { results = new(scopedArena) BranchResult {exitBlock,value,captureLocalValues(),results}; }
+		}
+
+		// Returns the value that a loop phi that doesn't change its local was replaced by, or the value itself if it isn't such a phi.
+		llvm::Value* getReplacedLocalValue(llvm::Value* value) const
+		{
+			auto replacementIt = unchangedLoopLocalPHIs.find(value);
+			while(replacementIt != unchangedLoopLocalPHIs.end())
+			{
+				value = replacementIt->second;
+				replacementIt = unchangedLoopLocalPHIs.find(value);
+			}
+			return value;
+		}
+
+		// Sets the current values of the locals to the merge of their values on the incoming edges of the block at the insert point. A phi is
+		// only created for a local if it has different values on different edges. If there are no incoming edges, the block is unreachable,
+		// and the locals are undefined.
+		void mergeLocalValues(const BranchResult* incomingEdges)
+		{
+			uint32 numIncomingEdges = 0;
+			for(auto edge = incomingEdges;edge;edge = edge->next) { ++numIncomingEdges; }
+
+			for(uintptr localIndex = 0;localIndex < astFunction->locals.size();++localIndex)
+			{
+				auto localType = asLLVMType(emitContext,astFunction->locals[localIndex].type);
+				if(!numIncomingEdges) { localValues[localIndex] = llvm::UndefValue::get(localType); continue; }
+
+				llvm::Value* firstValue = getReplacedLocalValue(incomingEdges->localValues[localIndex]);
+				bool isSameOnAllEdges = true;
+				for(auto edge = incomingEdges->next;edge && isSameOnAllEdges;edge = edge->next)
+				{ isSameOnAllEdges = getReplacedLocalValue(edge->localValues[localIndex]) == firstValue; }
+
+				if(isSameOnAllEdges) { localValues[localIndex] = firstValue; }
+				else
+				{
+					auto phi = irBuilder.CreatePHI(localType,numIncomingEdges);
+					for(auto edge = incomingEdges;edge;edge = edge->next) { phi->addIncoming(edge->localValues[localIndex],edge->incomingBlock); }
+					localValues[localIndex] = phi;
+				}
+			}
+		}
+
+		// Merges the values yielded by the incoming edges of the block at the insert point with a phi.
+		llvm::Value* compileBranchResultPHI(TypeId type,const BranchResult* incomingEdges)
+		{
+			if(type == TypeId::Void) { return emitContext.voidDummy; }
+
+			uint32 numIncomingEdges = 0;
+			for(auto edge = incomingEdges;edge;edge = edge->next) { ++numIncomingEdges; }
+			auto phi = irBuilder.CreatePHI(asLLVMType(emitContext,type),numIncomingEdges);
+			for(auto edge = incomingEdges;edge;edge = edge->next) { phi->addIncoming(edge->value,edge->incomingBlock); }
+			return phi;
+		}
 		
+		// Allocates a number of consecutive profile counters for the function, and returns the index of the first.
+		uintptr allocateProfileCounters(uintptr numCounters)
+		{
+			const uintptr firstCounterIndex = numProfileCounters;
+			numProfileCounters += numCounters;
+			return firstCounterIndex;
+		}
+
+		// If the module is instrumented, increments a profile counter at the current insert point.
+		void compileProfileCounterIncrement(uintptr counterIndex)
+		{
+			if(!moduleIR.options.instrumentProfile || irBuilder.GetInsertBlock() == unreachableBlock) { return; }
+			auto counterPointer = getProfileCounterPointer(counterIndex);
+			irBuilder.CreateStore(irBuilder.CreateAdd(irBuilder.CreateLoad(counterPointer),compileLiteral(emitContext,(uint64)1)),counterPointer);
+		}
+
+		// Returns a pointer to one of the function's profile counters in instrumented code.
+		llvm::Value* getProfileCounterPointer(uintptr counterIndex)
+		{
+			if(!profileCountersPlaceholder)
+			{
+				auto placeholderType = llvm::ArrayType::get(llvm::Type::getInt64Ty(context),0);
+				profileCountersPlaceholder = new llvm::GlobalVariable(*moduleIR.llvmModule,placeholderType,false,llvm::GlobalValue::PrivateLinkage,nullptr);
+			}
+
+			// The first element of the counter array holds the number of counters, so the counters start at index 1.
+			llvm::Value* gepIndices[2] = {compileLiteral(emitContext,(uint32)0),compileLiteral(emitContext,(uint32)(counterIndex + 1))};
+			return irBuilder.CreateInBoundsGEP(profileCountersPlaceholder,gepIndices);
+		}
+
+		// Each call_indirect site has counters for the two table indices it calls most often: for each, the index plus one (zero if the slot
+		// is free) and a count, followed by a counter of all the site's calls.
+		static const uintptr numCallTargetSlots = 2;
+		static const uintptr numCallTargetProfileCounters = numCallTargetSlots * 2 + 1;
+
+		// If the module is instrumented, records the table index called by a call_indirect site in its counters. The slots are updated
+		// with the Misra-Gries frequent items algorithm: a call to an index in a slot increments its count, a call to another index takes a
+		// slot whose count is zero, or if there is none, decrements the counts of all the slots. Each slot's count is a lower bound of how
+		// often its index was called, and any index called by more than a third of the site's calls is in a slot.
+		void compileCallTargetProfileUpdate(uintptr firstCounterIndex,llvm::Value* tableIndex)
+		{
+			if(!moduleIR.options.instrumentProfile || irBuilder.GetInsertBlock() == unreachableBlock) { return; }
+
+			auto i64Type = llvm::Type::getInt64Ty(context);
+			auto target = irBuilder.CreateAdd(irBuilder.CreateZExt(tableIndex,i64Type),compileLiteral(emitContext,(uint64)1));
+			llvm::Value* slotPointers[numCallTargetSlots];
+			llvm::Value* countPointers[numCallTargetSlots];
+			llvm::Value* slots[numCallTargetSlots];
+			llvm::Value* counts[numCallTargetSlots];
+			llvm::Value* isMatch[numCallTargetSlots];
+			llvm::Value* isFree[numCallTargetSlots];
+			llvm::Value* isHit = irBuilder.getFalse();
+			llvm::Value* isAnyFree = irBuilder.getFalse();
+			for(uintptr slotIndex = 0;slotIndex < numCallTargetSlots;++slotIndex)
+			{
+				slotPointers[slotIndex] = getProfileCounterPointer(firstCounterIndex + slotIndex * 2);
+				countPointers[slotIndex] = getProfileCounterPointer(firstCounterIndex + slotIndex * 2 + 1);
+				slots[slotIndex] = irBuilder.CreateLoad(slotPointers[slotIndex]);
+				counts[slotIndex] = irBuilder.CreateLoad(countPointers[slotIndex]);
+				isMatch[slotIndex] = irBuilder.CreateICmpEQ(slots[slotIndex],target);
+				isFree[slotIndex] = irBuilder.CreateICmpEQ(counts[slotIndex],compileLiteral(emitContext,(uint64)0));
+				isHit = irBuilder.CreateOr(isHit,isMatch[slotIndex]);
+				isAnyFree = irBuilder.CreateOr(isAnyFree,isFree[slotIndex]);
+			}
+
+			// A miss takes the first free slot.
+			auto isMiss = irBuilder.CreateNot(isHit);
+			auto isEvicting = irBuilder.CreateAnd(isMiss,irBuilder.CreateNot(isAnyFree));
+			llvm::Value* isEarlierSlotFree = irBuilder.getFalse();
+			for(uintptr slotIndex = 0;slotIndex < numCallTargetSlots;++slotIndex)
+			{
+				auto isTaken = irBuilder.CreateAnd(isMiss,irBuilder.CreateAnd(isFree[slotIndex],irBuilder.CreateNot(isEarlierSlotFree)));
+				isEarlierSlotFree = irBuilder.CreateOr(isEarlierSlotFree,isFree[slotIndex]);
+				irBuilder.CreateStore(irBuilder.CreateSelect(isTaken,target,slots[slotIndex]),slotPointers[slotIndex]);
+				auto newCount = irBuilder.CreateAdd(counts[slotIndex],irBuilder.CreateZExt(irBuilder.CreateOr(isMatch[slotIndex],isTaken),i64Type));
+				irBuilder.CreateStore(irBuilder.CreateSub(newCount,irBuilder.CreateZExt(isEvicting,i64Type)),countPointers[slotIndex]);
+			}
+
+			compileProfileCounterIncrement(firstCounterIndex + numCallTargetSlots * 2);
+		}
+
+		// A table index that a call_indirect site calls directly when it is the called index, and its profiled count.
+		struct SpeculatedCallTarget
+		{
+			uint32 tableIndex;
+			uint64 count;
+		};
+
+		// Returns the table indices that a call_indirect site should call directly: those that the profile counted for at least a quarter
+		// of the site's calls, most frequent first.
+		std::vector<SpeculatedCallTarget> getSpeculatedCallTargets(uintptr firstCounterIndex,const FunctionTable& functionTable) const
+		{
+			std::vector<SpeculatedCallTarget> targets;
+			const uint64 totalCount = getProfileCount(firstCounterIndex + numCallTargetSlots * 2);
+			for(uintptr slotIndex = 0;slotIndex < numCallTargetSlots;++slotIndex)
+			{
+				const uint64 target = getProfileCount(firstCounterIndex + slotIndex * 2);
+				const uint64 count = getProfileCount(firstCounterIndex + slotIndex * 2 + 1);
+				if(target && target <= functionTable.numFunctions && count && count * 4 >= totalCount
+				&& astModule->functions[functionTable.functionIndices[target - 1]]->type == functionTable.type)
+				{ targets.push_back({(uint32)(target - 1),count}); }
+			}
+			std::sort(targets.begin(),targets.end(),[](const SpeculatedCallTarget& left,const SpeculatedCallTarget& right) { return left.count > right.count; });
+			return targets;
+		}
+
+		// Returns the profiled count for a counter, or 0 if the function doesn't have a profile.
+		uint64 getProfileCount(uintptr counterIndex) const
+		{
+			return functionProfile && counterIndex < functionProfile->size() ? (*functionProfile)[counterIndex] : 0;
+		}
+
+		// Creates branch weight metadata from the profiled counts of the counters for each successor of a branch, in successor order.
+		// Returns null if the function doesn't have a profile.
+		llvm::MDNode* getProfileBranchWeights(const std::vector<uintptr>& successorCounterIndices) const
+		{
+			if(!functionProfile) { return nullptr; }
+
+			// Scale the counts to fit in the 32-bit weights, and add one so no successor has a weight of zero.
+			uint64 maxCount = 0;
+			for(auto counterIndex : successorCounterIndices) { maxCount = std::max(maxCount,getProfileCount(counterIndex)); }
+			const uint64 scale = maxCount / UINT32_MAX + 1;
+			std::vector<uint32> weights;
+			for(auto counterIndex : successorCounterIndices) { weights.push_back((uint32)(getProfileCount(counterIndex) / scale + 1)); }
+			return llvm::MDBuilder(context).createBranchWeights(weights);
+		}
+
 		// Compiles an if-else expression using thunks to define the true and false branches.
 		template<typename TrueValueThunk,typename FalseValueThunk>
-		llvm::Value* compileIfElse(TypeId type,llvm::Value* condition,TrueValueThunk trueValueThunk,FalseValueThunk falseValueThunk)
+		llvm::Value* compileIfElse(TypeId type,llvm::Value* condition,TrueValueThunk trueValueThunk,FalseValueThunk falseValueThunk,llvm::MDNode* branchWeights = nullptr)
 		{
 			auto trueBlock = llvm::BasicBlock::Create(context,"ifThen",llvmFunction);
 			auto falseBlock = llvm::BasicBlock::Create(context,"ifElse",llvmFunction);
 			auto successorBlock = llvm::BasicBlock::Create(context,"ifSucc",llvmFunction);
 
-			compileCondBranch(condition,trueBlock,falseBlock);
+			auto conditionExitBlock = compileCondBranch(condition,trueBlock,falseBlock);
+			if(conditionExitBlock && branchWeights) { conditionExitBlock->getTerminator()->setMetadata(llvm::LLVMContext::MD_prof,branchWeights); }
+
+			// Both arms start with the values the locals have after the condition, and the address ranges checked before it.
+			auto conditionLocalValues = captureLocalValues();
+			const uintptr conditionNumCheckedAddressRanges = checkedAddressRanges.size();
+			BranchResult* successorResults = nullptr;
 
 			irBuilder.SetInsertPoint(trueBlock);
 			auto trueValue = trueValueThunk();
-			auto trueExitBlock = compileBranch(successorBlock);
+			addBranchResult(successorResults,compileBranch(successorBlock),trueValue);
 
 			irBuilder.SetInsertPoint(falseBlock);
+			std::copy(conditionLocalValues,conditionLocalValues + astFunction->locals.size(),localValues);
+			restoreCheckedAddressRanges(conditionNumCheckedAddressRanges);
 			auto falseValue = falseValueThunk();
-			auto falseExitBlock = compileBranch(successorBlock);
+			addBranchResult(successorResults,compileBranch(successorBlock),falseValue);
 
 			irBuilder.SetInsertPoint(successorBlock);
-			if(type == TypeId::Void) { return voidDummy; }
-			else
-			{
-				auto phi = irBuilder.CreatePHI(trueValue->getType(),2);
-				if(trueExitBlock) { phi->addIncoming(trueValue,trueExitBlock); }
-				if(falseExitBlock) { phi->addIncoming(falseValue,falseExitBlock); }
-				return phi;
-			}
+			mergeLocalValues(successorResults);
+			restoreCheckedAddressRanges(conditionNumCheckedAddressRanges);
+			return compileBranchResultPHI(type,successorResults);
 		}
 
 		// Returns a LLVM intrinsic with the given id and argument types.
@@ -175,37 +589,142 @@ namespace LLVMJIT
 
 		DispatchResult compileAddress(Expression<IntClass>* address,bool isFarAddress,TypeId memoryType)
 		{
+			if(moduleIR.options.checkBounds) { return compileCheckedAddress(address,isFarAddress,memoryType); }
+
 			// On a 64 bit runtime, if the address is 32-bits, zext it to 64-bits.
 			// This is crucial for security, as LLVM will otherwise implicitly sign extend it to 64-bits in the GEP below,
 			// interpreting it as a signed offset and allowing access to memory outside the sandboxed memory range.
 			// There are no 'far addresses' in a 32 bit runtime.
 			auto byteIndex =
-			  sizeof(uintptr) == 8 &&  isFarAddress ? dispatch(*this,address,TypeId::I64)
-			  : sizeof(uintptr) == 8 && !isFarAddress ? irBuilder.CreateZExt(dispatch(*this,address,TypeId::I32),llvm::Type::getInt64Ty(context))
-			  : sizeof(uintptr) == 4 &&  isFarAddress ? irBuilder.CreateTrunc(dispatch(*this,address,TypeId::I64),llvm::Type::getInt32Ty(context))
-			  : sizeof(uintptr) == 4 && !isFarAddress ? dispatch(*this,address,TypeId::I32)
+			  sizeof(uintptr) == 8 &&  isFarAddress ? emitExpression(address,TypeId::I64)
+			  : sizeof(uintptr) == 8 && !isFarAddress ? irBuilder.CreateZExt(emitExpression(address,TypeId::I32),llvm::Type::getInt64Ty(context))
+			  : sizeof(uintptr) == 4 &&  isFarAddress ? irBuilder.CreateTrunc(emitExpression(address,TypeId::I64),llvm::Type::getInt32Ty(context))
+			  : sizeof(uintptr) == 4 && !isFarAddress ? emitExpression(address,TypeId::I32)
 			  : nullptr;
 			assert(byteIndex);
 
-			// Mask the index to the address-space size.
+			// Mask the index to the address-space size. If at least 4GB is reserved, the mask has no effect on a zero-extended 32-bit index,
+			// and LLVM removes it, so it only costs an instruction for far addresses and smaller reservations.
 			auto maskedByteIndex = irBuilder.CreateAnd(byteIndex,moduleIR.instanceMemoryAddressMask);
 
 			// Cast the pointer to the appropriate type.
-			auto bytePointer = irBuilder.CreateInBoundsGEP(moduleIR.instanceMemoryBase,maskedByteIndex);
-			return irBuilder.CreatePointerCast(bytePointer,asLLVMType(memoryType)->getPointerTo());
+			auto bytePointer = irBuilder.CreateGEP(instanceMemoryBase,maskedByteIndex);
+			return irBuilder.CreatePointerCast(bytePointer,asLLVMType(emitContext,memoryType)->getPointerTo());
+		}
+
+		// Loads the number of bytes allocated in the instance memory.
+		llvm::Value* compileMemoryNumBytes()
+		{
+			auto numBytes = irBuilder.CreateLoad(irBuilder.CreateStructGEP(nullptr,instanceMemory,1));
+			numBytes->setMetadata(llvm::LLVMContext::MD_tbaa,moduleIR.memoryNumBytesTBAATag);
+			return numBytes;
 		}
 
-		DispatchResult compileCall(const FunctionType& functionType,llvm::Value* function,UntypedExpression** args)
+		// Tags a load or store of the instance memory for type-based alias analysis.
+		template<typename Instruction> Instruction* tagMemoryAccess(Instruction* instruction)
 		{
-			// Compile the parameter values for the call.
-			auto llvmArgs = (llvm::Value**)alloca(sizeof(llvm::Value*) * functionType.parameters.size());
+			instruction->setMetadata(llvm::LLVMContext::MD_tbaa,moduleIR.memoryAccessTBAATag);
+			return instruction;
+		}
+
+		// Returns whether accessing numAccessedBytes at a 64-bit byte index would access bytes beyond the instance memory's size. The byte
+		// index must be less than 2^32, so adding the number of accessed bytes can't overflow.
+		llvm::Value* compileIsOutOfBounds(llvm::Value* byteIndex,uint64 numAccessedBytes)
+		{
+			auto endByteIndex = irBuilder.CreateAdd(byteIndex,compileLiteral(emitContext,numAccessedBytes));
+			return irBuilder.CreateICmpUGT(endByteIndex,irBuilder.CreateZExt(compileMemoryNumBytes(),llvm::Type::getInt64Ty(context)));
+		}
+
+		// Finds a checked address range that contains the offsets [offset,endOffset) from a base address, preferring ranges that were
+		// checked unconditionally. Since a checked range is within the instance memory, which is less than 4GB, the offsets of the range
+		// from the base don't wrap around, and any offsets within them are also in bounds.
+		const CheckedAddressRange* findCheckedAddressRange(llvm::Value* base,uint64 offset,uint64 endOffset) const
+		{
+			const CheckedAddressRange* result = nullptr;
+			for(auto& range : checkedAddressRanges)
+			{
+				if(range.base == base && range.callGeneration == callGeneration && range.offset <= offset && endOffset <= range.endOffset)
+				{
+					result = &range;
+					if(!range.mayBeOutOfBounds) { break; }
+				}
+			}
+			return result;
+		}
+
+		// Discards the address ranges checked since there were numRanges checked ranges, at a point that may be reached without passing
+		// through the checks.
+		void restoreCheckedAddressRanges(uintptr numRanges)
+		{
+			if(checkedAddressRanges.size() > numRanges) { checkedAddressRanges.resize(numRanges); }
+		}
+
+		// Compiles an address that is compared against the instance memory's size, trapping if any of the accessed bytes are out of bounds.
+		// A 32-bit address that adds a literal offset to a base is checked as a range of offsets from the base, and the check is omitted if a
+		// dominating check of the same base contains the range. If the range was checked before entering the loop, the check is only made if
+		// the loop's check failed, which lets LLVM unswitch the loop on it.
+		DispatchResult compileCheckedAddress(Expression<IntClass>* address,bool isFarAddress,TypeId memoryType)
+		{
+			const uint64 numAccessedBytes = getTypeByteWidth(memoryType);
+			llvm::Value* byteIndex;
+			if(isFarAddress)
+			{
+				byteIndex = emitExpression(address,TypeId::I64);
+				auto isOutOfBounds = irBuilder.CreateOr(
+					irBuilder.CreateICmpUGT(byteIndex,compileLiteral(emitContext,(uint64)UINT32_MAX)),
+					compileIsOutOfBounds(byteIndex,numAccessedBytes)
+					);
+				compileTrapIf(isOutOfBounds,accessViolationTrapBlock,"wavmIntrinsics.accessViolationTrap");
+			}
+			else
+			{
+				uint32 offset;
+				auto baseExpression = LoopMemoryAccessVisitor::getAddressBase(address,offset);
+				auto base = emitExpression(baseExpression,TypeId::I32);
+				auto address32 = offset ? irBuilder.CreateAdd(base,compileLiteral(emitContext,offset)) : base;
+				byteIndex = irBuilder.CreateZExt(address32,llvm::Type::getInt64Ty(context));
+
+				const uint64 endOffset = uint64(offset) + numAccessedBytes;
+				auto checkedRange = findCheckedAddressRange(base,offset,endOffset);
+				if(!checkedRange || checkedRange->mayBeOutOfBounds)
+				{
+					auto isOutOfBounds = compileIsOutOfBounds(byteIndex,numAccessedBytes);
+					if(checkedRange) { isOutOfBounds = irBuilder.CreateAnd(checkedRange->mayBeOutOfBounds,isOutOfBounds); }
+					compileTrapIf(isOutOfBounds,accessViolationTrapBlock,"wavmIntrinsics.accessViolationTrap");
+					if(irBuilder.GetInsertBlock() != unreachableBlock) { checkedAddressRanges.push_back({base,offset,endOffset,callGeneration,nullptr}); }
+				}
+			}
+
+			auto bytePointer = irBuilder.CreateGEP(instanceMemoryBase,sizeof(uintptr) == 8 ? byteIndex : irBuilder.CreateTrunc(byteIndex,llvm::Type::getInt32Ty(context)));
+			return irBuilder.CreatePointerCast(bytePointer,asLLVMType(emitContext,memoryType)->getPointerTo());
+		}
+
+		// Compiles the arguments of a call. Functions defined by the module are passed the instance memory before their parameters, imports aren't.
+		llvm::ArrayRef<llvm::Value*> compileCallArgs(const FunctionType& functionType,UntypedExpression** args,bool passInstanceMemory)
+		{
+			const size_t numArgs = functionType.parameters.size() + (passInstanceMemory ? 1 : 0);
+			auto llvmArgs = new(scopedArena) llvm::Value*[numArgs];
+			if(passInstanceMemory) { llvmArgs[0] = instanceMemory; }
 			for(size_t argIndex = 0;argIndex < functionType.parameters.size();++argIndex)
-				{ llvmArgs[argIndex] = dispatch(*this,args[argIndex],functionType.parameters[argIndex]); }
-			// Create the call instruction.
-			return irBuilder.CreateCall(function,llvm::ArrayRef<llvm::Value*>(llvmArgs,functionType.parameters.size()));
+				{ llvmArgs[numArgs - functionType.parameters.size() + argIndex] = emitExpression(args[argIndex],functionType.parameters[argIndex]); }
+			return llvm::ArrayRef<llvm::Value*>(llvmArgs,numArgs);
+		}
+
+		// Creates a call instruction with compiled arguments.
+		DispatchResult compileCallInstruction(llvm::Value* function,llvm::ArrayRef<llvm::Value*> llvmArgs)
+		{
+			// The called function may shrink the instance memory, so the address ranges checked before the call may no longer be in bounds.
+			++callGeneration;
+			return irBuilder.CreateCall(function,llvmArgs);
+		}
+
+		// Compiles a call to a function.
+		DispatchResult compileCall(const FunctionType& functionType,llvm::Value* function,UntypedExpression** args,bool passInstanceMemory)
+		{
+			return compileCallInstruction(function,compileCallArgs(functionType,args,passInstanceMemory));
 		}
 		
-		template<typename Type> DispatchResult visitLiteral(const Literal<Type>* literal) { return compileLiteral(literal->value); }
+		template<typename Type> DispatchResult visitLiteral(const Literal<Type>* literal) { return compileLiteral(emitContext,literal->value); }
 
 		template<typename Class>
 		DispatchResult visitError(TypeId type,const Error<Class>* error)
@@ -219,13 +738,16 @@ namespace LLVMJIT
 		DispatchResult visitGetLocal(TypeId type,const GetLocal* getVariable)
 		{
 			assert(getVariable->variableIndex < astFunction->locals.size());
-			return irBuilder.CreateLoad(localVariablePointers[getVariable->variableIndex]);
+			return localValues[getVariable->variableIndex];
 		}
 		DispatchResult visitSetLocal(const SetLocal* setVariable)
 		{
 			assert(setVariable->variableIndex < astFunction->locals.size());
-			auto value = dispatch(*this,setVariable->value,astFunction->locals[setVariable->variableIndex].type);
-			irBuilder.CreateStore(value,localVariablePointers[setVariable->variableIndex]);
+			auto value = emitExpression(setVariable->value,astFunction->locals[setVariable->variableIndex].type);
+
+			// Values emitted in the unreachable block are deleted with it, so they must not become the value of the local. The value of the
+			// local doesn't matter in unreachable code, since it is never read by code that executes.
+			if(irBuilder.GetInsertBlock() != unreachableBlock) { localValues[setVariable->variableIndex] = value; }
 			return value;
 		}
 
@@ -234,48 +756,48 @@ namespace LLVMJIT
 		DispatchResult visitLoad(TypeId type,const Load<Class>* load,typename OpTypes<AnyClass>::load)
 		{
 			assert(type == load->memoryType);
-			auto llvmLoad = irBuilder.CreateLoad(compileAddress(load->address,load->isFarAddress,load->memoryType));
+			auto llvmLoad = tagMemoryAccess(irBuilder.CreateLoad(compileAddress(load->address,load->isFarAddress,load->memoryType)));
 			llvmLoad->setAlignment(1<<load->alignmentLog2);
 			return llvmLoad;
 		}
 		DispatchResult visitLoad(TypeId type,const Load<IntClass>* load,OpTypes<AnyClass>::load)
 		{
-			auto memoryValue = irBuilder.CreateLoad(compileAddress(load->address,load->isFarAddress,load->memoryType));
+			auto memoryValue = tagMemoryAccess(irBuilder.CreateLoad(compileAddress(load->address,load->isFarAddress,load->memoryType)));
 			memoryValue->setAlignment(1<<load->alignmentLog2);
 			assert(isTypeClass(load->memoryType,TypeClassId::Int));
 			return type == load->memoryType ? memoryValue
-				: irBuilder.CreateTrunc(memoryValue,asLLVMType(type));
+				: irBuilder.CreateTrunc(memoryValue,asLLVMType(emitContext,type));
 		}
 		DispatchResult visitLoad(TypeId type,const Load<IntClass>* load,OpTypes<IntClass>::loadZExt)
 		{
-			auto memoryValue = irBuilder.CreateLoad(compileAddress(load->address,load->isFarAddress,load->memoryType));
+			auto memoryValue = tagMemoryAccess(irBuilder.CreateLoad(compileAddress(load->address,load->isFarAddress,load->memoryType)));
 			memoryValue->setAlignment(1<<load->alignmentLog2);
-			return irBuilder.CreateZExt(memoryValue,asLLVMType(type));
+			return irBuilder.CreateZExt(memoryValue,asLLVMType(emitContext,type));
 		}
 		DispatchResult visitLoad(TypeId type,const Load<IntClass>* load,OpTypes<IntClass>::loadSExt)
 		{
-			auto memoryValue = irBuilder.CreateLoad(compileAddress(load->address,load->isFarAddress,load->memoryType));
+			auto memoryValue = tagMemoryAccess(irBuilder.CreateLoad(compileAddress(load->address,load->isFarAddress,load->memoryType)));
 			memoryValue->setAlignment(1<<load->alignmentLog2);
-			return irBuilder.CreateSExt(memoryValue,asLLVMType(type));
+			return irBuilder.CreateSExt(memoryValue,asLLVMType(emitContext,type));
 		}
 		template<typename Class>
 		DispatchResult visitStore(const Store<Class>* store)
 		{
-			auto value = dispatch(*this,store->value);
-			auto llvmStore = irBuilder.CreateStore(value,compileAddress(store->address,store->isFarAddress,store->memoryType));
+			auto value = emitExpression(store->value);
+			auto llvmStore = tagMemoryAccess(irBuilder.CreateStore(value,compileAddress(store->address,store->isFarAddress,store->memoryType)));
 			llvmStore->setAlignment(1<<store->alignmentLog2);
 			return value;
 		}
 		DispatchResult visitStore(const Store<IntClass>* store)
 		{
-			auto value = dispatch(*this,store->value);
+			auto value = emitExpression(store->value);
 			llvm::Value* memoryValue = value;
 			if(store->value.type != store->memoryType)
 			{
 				assert(isTypeClass(store->memoryType,TypeClassId::Int));
-				memoryValue = irBuilder.CreateTrunc(value,asLLVMType(store->memoryType));
+				memoryValue = irBuilder.CreateTrunc(value,asLLVMType(emitContext,store->memoryType));
 			}
-			irBuilder.CreateStore(memoryValue,compileAddress(store->address,store->isFarAddress,store->memoryType));
+			tagMemoryAccess(irBuilder.CreateStore(memoryValue,compileAddress(store->address,store->isFarAddress,store->memoryType)));
 			return value;
 		}
 
@@ -283,14 +805,18 @@ namespace LLVMJIT
 		{
 			auto calledFunction = astModule->functions[call->functionIndex];
 			assert(calledFunction->type.returnType == type);
-			return compileCall(calledFunction->type,moduleIR.functions[call->functionIndex],call->parameters);
+			return compileCall(calledFunction->type,getCalledFunction(call->functionIndex),call->parameters,true);
 		}
 		DispatchResult visitCall(TypeId type,const Call* call,OpTypes<AnyClass>::callImport)
 		{
 			auto astFunctionImport = astModule->functionImports[call->functionIndex];
 			assert(astFunctionImport.type.returnType == type);
-			auto function = moduleIR.functionImportPointers[call->functionIndex];
-			return compileCall(astFunctionImport.type,function,call->parameters);
+
+			// memory_size is called often enough by code that checks its own bounds that it's worth reading the memory size directly.
+			if(isMemorySizeImport(astFunctionImport)) { return compileMemoryNumBytes(); }
+
+			auto function = moduleIR.functionImports[call->functionIndex];
+			return compileCall(astFunctionImport.type,function,call->parameters,false);
 		}
 		DispatchResult visitCallIndirect(TypeId type,const CallIndirect* callIndirect)
 		{
@@ -301,22 +827,90 @@ namespace LLVMJIT
 			assert(astFunctionTable.numFunctions > 0);
 
 			// Compile the function index and mask it to be within the function table's bounds (which are already verified to be 2^N).
-			auto functionIndex = dispatch(*this,callIndirect->functionIndex,TypeId::I32);
-			auto functionIndexMask = compileLiteral((uint32)astFunctionTable.numFunctions-1);
+			auto functionIndex = emitExpression(callIndirect->functionIndex,TypeId::I32);
+			auto functionIndexMask = compileLiteral(emitContext,(uint32)astFunctionTable.numFunctions-1);
 			auto maskedFunctionIndex = irBuilder.CreateAnd(functionIndex,functionIndexMask);
+			auto llvmArgs = compileCallArgs(astFunctionTable.type,callIndirect->parameters,true);
+
+			// Profile which table indices the call calls, and if the profile found indices that the call usually calls, compare the index
+			// against them, and call their functions directly. The direct calls are predictable, and may be inlined.
+			const uintptr firstCallTargetCounterIndex = allocateProfileCounters(numCallTargetProfileCounters);
+			compileCallTargetProfileUpdate(firstCallTargetCounterIndex,maskedFunctionIndex);
+			auto speculatedTargets = getSpeculatedCallTargets(firstCallTargetCounterIndex,astFunctionTable);
+			if(!speculatedTargets.size() || irBuilder.GetInsertBlock() == unreachableBlock)
+			{
+				return compileIndirectCall(functionTablePointer,maskedFunctionIndex,astFunctionTable.type,llvmArgs);
+			}
+			++moduleIR.numSpeculatedCallSites;
 
-			// Get a pointer to the function pointer in the function table using the masked function index.
-			llvm::Value* gepIndices[2] = {compileLiteral((uint32)0),maskedFunctionIndex};
+			auto successorBlock = llvm::BasicBlock::Create(context,"callIndirectSucc",llvmFunction);
+			std::vector<std::pair<llvm::Value*,llvm::BasicBlock*>> results;
+			uint64 remainingCount = getProfileCount(firstCallTargetCounterIndex + numCallTargetSlots * 2);
+			for(auto& target : speculatedTargets)
+			{
+				// Weight the branch by the target's count, and the count of the calls that didn't go to it or an earlier target.
+				remainingCount -= std::min(remainingCount,target.count);
+				const uint64 scale = std::max(target.count,remainingCount) / UINT32_MAX + 1;
+				auto directBlock = llvm::BasicBlock::Create(context,"callDirect",llvmFunction);
+				auto nextBlock = llvm::BasicBlock::Create(context,"callIndirectElse",llvmFunction);
+				irBuilder.CreateCondBr(
+					irBuilder.CreateICmpEQ(maskedFunctionIndex,compileLiteral(emitContext,target.tableIndex)),
+					directBlock,nextBlock,
+					llvm::MDBuilder(context).createBranchWeights((uint32)(target.count / scale + 1),(uint32)(remainingCount / scale + 1))
+					);
+
+				irBuilder.SetInsertPoint(directBlock);
+				const uintptr calleeIndex = astFunctionTable.functionIndices[target.tableIndex];
+				results.push_back({compileCallInstruction(getCalledFunction(calleeIndex),llvmArgs),irBuilder.GetInsertBlock()});
+				irBuilder.CreateBr(successorBlock);
+				moduleIR.speculatedCallees[this->functionIndex].push_back(calleeIndex);
+
+				irBuilder.SetInsertPoint(nextBlock);
+			}
+			results.push_back({compileIndirectCall(functionTablePointer,maskedFunctionIndex,astFunctionTable.type,llvmArgs),irBuilder.GetInsertBlock()});
+			irBuilder.CreateBr(successorBlock);
 
-			// Load the function pointer from the table and call it.
-			auto function = irBuilder.CreateLoad(irBuilder.CreateInBoundsGEP(functionTablePointer,gepIndices));
-			return compileCall(astFunctionTable.type,function,callIndirect->parameters);
+			irBuilder.SetInsertPoint(successorBlock);
+			if(type == TypeId::Void) { return emitContext.voidDummy; }
+			auto phi = irBuilder.CreatePHI(asLLVMType(emitContext,type),(uint32)results.size());
+			for(auto& result : results) { phi->addIncoming(result.first,result.second); }
+			return phi;
+		}
+
+		// Loads a function pointer from a function table with a masked index, and calls it. If the module calls through its function pointer
+		// table, the function table holds a function index, and the function's address is loaded from the function pointer table.
+		DispatchResult compileIndirectCall(llvm::Value* functionTablePointer,llvm::Value* maskedFunctionIndex,const FunctionType& functionType,llvm::ArrayRef<llvm::Value*> llvmArgs)
+		{
+			llvm::Value* gepIndices[2] = {compileLiteral(emitContext,(uint32)0),maskedFunctionIndex};
+			llvm::Value* function = irBuilder.CreateLoad(irBuilder.CreateInBoundsGEP(functionTablePointer,gepIndices));
+			if(moduleIR.options.callThroughFunctionPointers) { function = loadFunctionPointer(function,asLLVMDefinedFunctionType(emitContext,functionType)->getPointerTo()); }
+			return compileCallInstruction(function,llvmArgs);
+		}
+
+		// Returns the function to call for a direct call to one of the module's functions. If the module calls through its function
+		// pointer table, this loads the function's current address from it.
+		llvm::Value* getCalledFunction(uintptr calleeIndex)
+		{
+			auto llvmFunction = moduleIR.functions[calleeIndex];
+			if(!moduleIR.options.callThroughFunctionPointers) { return llvmFunction; }
+			return loadFunctionPointer(compileLiteral(emitContext,(uint32)calleeIndex),llvmFunction->getType());
+		}
+
+		// Loads the address of a function from the module's function pointer table. The table is updated while the code runs when the
+		// optimized code replaces the baseline code, so the load is atomic, and acquires the stores of the optimized code.
+		llvm::Value* loadFunctionPointer(llvm::Value* calleeIndex,llvm::Type* llvmFunctionPointerType)
+		{
+			llvm::Value* gepIndices[2] = {compileLiteral(emitContext,(uint32)0),calleeIndex};
+			auto functionAddress = irBuilder.CreateLoad(irBuilder.CreateInBoundsGEP(moduleIR.functionPointers,gepIndices));
+			functionAddress->setAlignment(sizeof(uintptr));
+			functionAddress->setAtomic(llvm::Acquire);
+			return irBuilder.CreateIntToPtr(functionAddress,llvmFunctionPointerType);
 		}
 		
 		template<typename Class>
 		DispatchResult visitSwitch(TypeId type,const Switch<Class>* switchExpression)
 		{
-			auto value = dispatch(*this,switchExpression->key);		
+			auto value = emitExpression(switchExpression->key);		
 
 			// Create the basic blocks for each arm of the switch so they can be forward referenced by fallthrough branches.
 			auto armEntryBlocks = new(scopedArena) llvm::BasicBlock*[switchExpression->numArms];
@@ -330,11 +924,36 @@ namespace LLVMJIT
 			branchContext = &endBranchContext;
 			assert(switchExpression->endTarget->type == type);
 
+			// Count how often the switch dispatches to each arm. Since arms may also be entered by falling through from the previous arm,
+			// the counters are incremented on the edges from the switch, which requires a block for each edge in instrumented code.
+			const uintptr firstArmCounterIndex = allocateProfileCounters(switchExpression->numArms);
+			auto switchBlock = irBuilder.GetInsertBlock();
+			auto armDispatchBlocks = armEntryBlocks;
+			if(moduleIR.options.instrumentProfile)
+			{
+				armDispatchBlocks = new(scopedArena) llvm::BasicBlock*[switchExpression->numArms];
+				for(uint32 armIndex = 0;armIndex < switchExpression->numArms;++armIndex)
+				{
+					armDispatchBlocks[armIndex] = llvm::BasicBlock::Create(context,"switchDispatch",llvmFunction);
+					irBuilder.SetInsertPoint(armDispatchBlocks[armIndex]);
+					compileProfileCounterIncrement(firstArmCounterIndex + armIndex);
+					irBuilder.CreateBr(armEntryBlocks[armIndex]);
+				}
+				irBuilder.SetInsertPoint(switchBlock);
+			}
+
 			// Compile each arm of the switch.
 			assert(switchExpression->numArms > 0);
 			assert(switchExpression->defaultArmIndex < switchExpression->numArms);
-			auto defaultBlock = armEntryBlocks[switchExpression->defaultArmIndex];
+			auto defaultBlock = armDispatchBlocks[switchExpression->defaultArmIndex];
 			auto switchInstruction = irBuilder.CreateSwitch(value,defaultBlock,(uint32)switchExpression->numArms - 1);
+
+			// Each arm is entered from the switch, and from the previous arm falling through to it. The edges from the switch have the
+			// values the locals have after the key. The instrumented code's dispatch blocks have edges to the arms even if the switch is unreachable.
+			auto switchLocalValues = captureLocalValues();
+			const uintptr switchNumCheckedAddressRanges = checkedAddressRanges.size();
+			const bool isSwitchReachable = moduleIR.options.instrumentProfile || switchBlock != unreachableBlock;
+			BranchResult* fallthroughResults = nullptr;
 			for(uint32 armIndex = 0;armIndex < switchExpression->numArms;++armIndex)
 			{
 				const SwitchArm& arm = switchExpression->arms[armIndex];
@@ -343,55 +962,72 @@ namespace LLVMJIT
 					llvm::ConstantInt* armKey;
 					switch(switchExpression->key.type)
 					{
-					case TypeId::I8: armKey = compileLiteral((uint8)arm.key); break;
-					case TypeId::I16: armKey = compileLiteral((uint16)arm.key); break;
-					case TypeId::I32: armKey = compileLiteral((uint32)arm.key); break;
-					case TypeId::I64: armKey = compileLiteral((uint64)arm.key); break;
+					case TypeId::I8: armKey = compileLiteral(emitContext,(uint8)arm.key); break;
+					case TypeId::I16: armKey = compileLiteral(emitContext,(uint16)arm.key); break;
+					case TypeId::I32: armKey = compileLiteral(emitContext,(uint32)arm.key); break;
+					case TypeId::I64: armKey = compileLiteral(emitContext,(uint64)arm.key); break;
 					default: throw;
 					}
-					switchInstruction->addCase(armKey,armEntryBlocks[armIndex]);
+					switchInstruction->addCase(armKey,armDispatchBlocks[armIndex]);
 				}
 
 				irBuilder.SetInsertPoint(armEntryBlocks[armIndex]);
+				BranchResult dispatchResult = {moduleIR.options.instrumentProfile ? armDispatchBlocks[armIndex] : switchBlock,emitContext.voidDummy,switchLocalValues,fallthroughResults};
+				mergeLocalValues(isSwitchReachable ? &dispatchResult : fallthroughResults);
+				restoreCheckedAddressRanges(switchNumCheckedAddressRanges);
+				fallthroughResults = nullptr;
+
 				assert(arm.value);
 				if(armIndex + 1 == switchExpression->numArms)
 				{
 					// The final arm is an expression of the same type as the switch.
-					auto armValue = dispatch(*this,arm.value,type);
-					auto exitBlock = compileBranch(successorBlock);
-					if(type != TypeId::Void && exitBlock)
-					{ endBranchContext.results = new(scopedArena) BranchResult {exitBlock,armValue,endBranchContext.results}; }
+					auto armValue = emitExpression(arm.value,type);
+					addBranchResult(endBranchContext.results,compileBranch(successorBlock),armValue);
 				}
 				else
 				{
 					// The other arms yield void.
-					dispatch(*this,arm.value,TypeId::Void);
-					compileBranch(armEntryBlocks[armIndex + 1]);
+					emitExpression(arm.value,TypeId::Void);
+					addBranchResult(fallthroughResults,compileBranch(armEntryBlocks[armIndex + 1]),emitContext.voidDummy);
 				}
 			}
 
+			// Set the switch's branch weights from the profile. The weights are ordered the same as the switch's successors: the default first, then the cases.
+			if(functionProfile)
+			{
+				std::vector<uintptr> successorCounterIndices;
+				successorCounterIndices.push_back(firstArmCounterIndex + switchExpression->defaultArmIndex);
+				for(uint32 armIndex = 0;armIndex < switchExpression->numArms;++armIndex)
+				{
+					if(armIndex != switchExpression->defaultArmIndex) { successorCounterIndices.push_back(firstArmCounterIndex + armIndex); }
+				}
+				switchInstruction->setMetadata(llvm::LLVMContext::MD_prof,getProfileBranchWeights(successorCounterIndices));
+			}
+
 			// Remove the switch's branch target from the in-scope context list.
 			assert(branchContext == &endBranchContext);
 			branchContext = outerBranchContext;
 
+			// Merge the results and locals from all the branches out of the switch.
 			irBuilder.SetInsertPoint(successorBlock);
-			if(type == TypeId::Void) { return voidDummy; }
-			else
-			{
-				// Create a phi node that merges the results from all the branches out of the switch.
-				auto phi = irBuilder.CreatePHI(asLLVMType(type),(uint32)switchExpression->numArms);
-				for(auto result = endBranchContext.results;result;result = result->next) { phi->addIncoming(result->value,result->incomingBlock); }
-				return phi;
-			}
+			mergeLocalValues(endBranchContext.results);
+			restoreCheckedAddressRanges(switchNumCheckedAddressRanges);
+			return compileBranchResultPHI(type,endBranchContext.results);
 		}
 		template<typename Class>
 		DispatchResult visitIfElse(TypeId type,const IfElse<Class>* ifElse)
 		{
+			// Count how often each arm of the if-else is taken.
+			const uintptr thenCounterIndex = allocateProfileCounters(2);
+			const uintptr elseCounterIndex = thenCounterIndex + 1;
+			auto branchWeights = getProfileBranchWeights({thenCounterIndex,elseCounterIndex});
+
 			return compileIfElse(
 				type,
-				dispatch(*this,ifElse->condition,TypeId::Bool),
-				[&] { return dispatch(*this,ifElse->thenExpression,type); },
-				[&] { return dispatch(*this,ifElse->elseExpression,type); }
+				emitExpression(ifElse->condition,TypeId::Bool),
+				[&] { compileProfileCounterIncrement(thenCounterIndex); return emitExpression(ifElse->thenExpression,type); },
+				[&] { compileProfileCounterIncrement(elseCounterIndex); return emitExpression(ifElse->elseExpression,type); },
+				branchWeights
 				);
 		}
 		template<typename Class>
@@ -399,6 +1035,7 @@ namespace LLVMJIT
 		{
 			auto labelBlock = llvm::BasicBlock::Create(context,"label",llvmFunction);
 			auto successorBlock = llvm::BasicBlock::Create(context,"labelSucc",llvmFunction);
+			const uintptr numCheckedAddressRanges = checkedAddressRanges.size();
 			
 			compileBranch(labelBlock);
 			irBuilder.SetInsertPoint(labelBlock);
@@ -409,37 +1046,32 @@ namespace LLVMJIT
 			branchContext = &endBranchContext;
 			
 			// Compile the label's value.
-			auto value = dispatch(*this,label->expression,type);
+			auto value = emitExpression(label->expression,type);
 
 			// Remove the label's branch target from the in-scope context list.
 			assert(branchContext == &endBranchContext);
 			branchContext = outerBranchContext;
 
 			// Branch to the successor block.
-			auto exitBlock = compileBranch(successorBlock);
+			addBranchResult(endBranchContext.results,compileBranch(successorBlock),value);
 			irBuilder.SetInsertPoint(successorBlock);
 
-			// Create a phi node that merges all the possible values yielded by the label into one.
-			if(type == TypeId::Void) { return voidDummy; }
-			else
-			{
-				auto phi = irBuilder.CreatePHI(asLLVMType(type),2);
-				if(exitBlock) { phi->addIncoming(value,exitBlock); }
-				for(auto result = endBranchContext.results;result;result = result->next) { phi->addIncoming(result->value,result->incomingBlock); }
-				return phi;
-			}
+			// Merge all the possible values yielded by the label, and the values of the locals on each branch to it.
+			mergeLocalValues(endBranchContext.results);
+			restoreCheckedAddressRanges(numCheckedAddressRanges);
+			return compileBranchResultPHI(type,endBranchContext.results);
 		}
 		template<typename Class>
 		DispatchResult visitSequence(TypeId type,const Sequence<Class>* seq)
 		{
-			dispatch(*this,seq->voidExpression);
-			return dispatch(*this,seq->resultExpression,type);
+			emitExpression(seq->voidExpression);
+			return emitExpression(seq->resultExpression,type);
 		}
 		template<typename Class>
 		DispatchResult visitReturn(TypeId type,const Return<Class>* ret)
 		{
 			auto returnValue = astFunction->type.returnType == TypeId::Void ? nullptr
-				: dispatch(*this,ret->value,astFunction->type.returnType);
+				: emitExpression(ret->value,astFunction->type.returnType);
 
 			if(irBuilder.GetInsertBlock() != unreachableBlock)
 			{
@@ -450,7 +1082,7 @@ namespace LLVMJIT
 				irBuilder.SetInsertPoint(unreachableBlock);
 			}
 
-			return typedZeroConstants[(size_t)type];
+			return emitContext.typedZeroConstants[(size_t)type];
 		}
 		template<typename Class>
 		DispatchResult visitLoop(TypeId type,const Loop<Class>* loop)
@@ -463,25 +1095,113 @@ namespace LLVMJIT
 			BranchContext continueBranchContext = {loop->continueTarget,loopBlock,outerBranchContext,nullptr};
 			BranchContext breakBranchContext = {loop->breakTarget,successorBlock,&continueBranchContext,nullptr};
 			branchContext = &breakBranchContext;
-			
-			compileBranch(loopBlock);
 
+			// With bounds checks, check the ranges of addresses the loop accesses relative to locals it doesn't set before entering the loop.
+			// If the loop doesn't call any functions, the instance memory's size doesn't change within it either, so the accesses within the
+			// ranges are in bounds if the checks pass.
+			const uintptr numCheckedAddressRanges = checkedAddressRanges.size();
+			std::vector<std::pair<uintptr,CheckedAddressRange>> hoistedAddressRanges;
+			bool loopContainsCall = false;
+			if(moduleIR.options.checkBounds)
+			{
+				LoopMemoryAccessVisitor accessVisitor(scopedArena,astModule,astFunction);
+				accessVisitor(TypedExpression(loop->expression,TypeId::Void));
+				loopContainsCall = accessVisitor.containsCall;
+				if(!loopContainsCall && irBuilder.GetInsertBlock() != unreachableBlock)
+				{
+					for(auto& localRange : accessVisitor.localAccessRanges)
+					{
+						const uintptr localIndex = localRange.first;
+						const LoopMemoryAccessVisitor::LocalAccessRange& range = localRange.second;
+						if(accessVisitor.isLocalSet[localIndex]) { continue; }
+
+						// If a range that was checked before the loop contains the loop's range, the loop's range only needs to be
+						// checked if that range's check could have failed.
+						auto base = localValues[localIndex];
+						auto checkedRange = findCheckedAddressRange(base,range.offset,range.endOffset);
+						llvm::Value* mayBeOutOfBounds = nullptr;
+						if(!checkedRange || checkedRange->mayBeOutOfBounds)
+						{
+							auto address32 = range.offset ? irBuilder.CreateAdd(base,compileLiteral(emitContext,(uint32)range.offset)) : base;
+							mayBeOutOfBounds = compileIsOutOfBounds(irBuilder.CreateZExt(address32,llvm::Type::getInt64Ty(context)),range.endOffset - range.offset);
+							if(checkedRange) { mayBeOutOfBounds = irBuilder.CreateAnd(checkedRange->mayBeOutOfBounds,mayBeOutOfBounds); }
+						}
+						hoistedAddressRanges.push_back({localIndex,{nullptr,range.offset,range.endOffset,callGeneration,mayBeOutOfBounds}});
+					}
+				}
+			}
+			
+			auto entryBlock = compileBranch(loopBlock);
 			irBuilder.SetInsertPoint(loopBlock);
-			dispatch(*this,loop->expression);
-			compileBranch(loopBlock);
+
+			// The loop may change the locals before it continues, so create a phi for each local at the start of the loop.
+			const uintptr numLocals = astFunction->locals.size();
+			auto entryLocalValues = captureLocalValues();
+			auto loopPHIs = new(scopedArena) llvm::PHINode*[numLocals];
+			for(uintptr localIndex = 0;localIndex < numLocals;++localIndex)
+			{
+				loopPHIs[localIndex] = irBuilder.CreatePHI(asLLVMType(emitContext,astFunction->locals[localIndex].type),2);
+				if(entryBlock) { loopPHIs[localIndex]->addIncoming(entryLocalValues[localIndex],entryBlock); }
+				localValues[localIndex] = loopPHIs[localIndex];
+			}
+
+			// The address ranges checked before the loop are still in bounds at the start of each iteration, unless a call in the previous
+			// iteration shrank the instance memory. The ranges checked for the loop are relative to the loop's phis for their locals.
+			if(loopContainsCall) { ++callGeneration; }
+			for(auto& hoistedRange : hoistedAddressRanges)
+			{
+				hoistedRange.second.base = loopPHIs[hoistedRange.first];
+				checkedAddressRanges.push_back(hoistedRange.second);
+			}
+
+			// Count the loop's iterations.
+			compileProfileCounterIncrement(allocateProfileCounters(1));
+			emitExpression(loop->expression);
+			addBranchResult(continueBranchContext.results,compileBranch(loopBlock),emitContext.voidDummy);
 			
 			// Remove the loop's branch targets from the in-scope context list.
 			assert(branchContext == &breakBranchContext);
 			branchContext = outerBranchContext;
 
-			irBuilder.SetInsertPoint(successorBlock);
-			if(type == TypeId::Void) { return voidDummy; }
-			else
+			// Add the values of the locals on each edge that continues the loop to the phis.
+			for(auto result = continueBranchContext.results;result;result = result->next)
 			{
-				auto phi = irBuilder.CreatePHI(asLLVMType(type),1);
-				for(auto result = breakBranchContext.results;result;result = result->next) { phi->addIncoming(result->value,result->incomingBlock); }
-				return phi;
+				for(uintptr localIndex = 0;localIndex < numLocals;++localIndex)
+				{ loopPHIs[localIndex]->addIncoming(result->localValues[localIndex],result->incomingBlock); }
 			}
+
+			// Replace the phis for the locals that the loop doesn't change with the values the locals have on entry to the loop.
+			bool replacedAnyPHIs = false;
+			for(uintptr localIndex = 0;localIndex < numLocals;++localIndex)
+			{
+				auto phi = loopPHIs[localIndex];
+				auto entryValue = getReplacedLocalValue(entryLocalValues[localIndex]);
+				bool isUnchanged = true;
+				for(uint32 incomingIndex = 0;incomingIndex < phi->getNumIncomingValues() && isUnchanged;++incomingIndex)
+				{
+					auto incomingValue = getReplacedLocalValue(phi->getIncomingValue(incomingIndex));
+					isUnchanged = incomingValue == phi || incomingValue == entryValue;
+				}
+				if(isUnchanged)
+				{
+					phi->replaceAllUsesWith(entryValue);
+					unchangedLoopLocalPHIs[phi] = entryValue;
+					replacedAnyPHIs = true;
+				}
+			}
+			if(replacedAnyPHIs)
+			{
+				for(auto result = breakBranchContext.results;result;result = result->next)
+				{
+					for(uintptr localIndex = 0;localIndex < numLocals;++localIndex)
+					{ result->localValues[localIndex] = getReplacedLocalValue(result->localValues[localIndex]); }
+				}
+			}
+
+			irBuilder.SetInsertPoint(successorBlock);
+			mergeLocalValues(breakBranchContext.results);
+			restoreCheckedAddressRanges(numCheckedAddressRanges);
+			return compileBranchResultPHI(type,breakBranchContext.results);
 		}
 		template<typename Class>
 		DispatchResult visitBranch(TypeId type,const Branch<Class>* branch)
@@ -492,29 +1212,29 @@ namespace LLVMJIT
 			if(!targetContext) { throw; }
 			
 			// If the branch target has a non-void type, compile the branch's value.
-			auto value = branch->branchTarget->type == TypeId::Void ? voidDummy
-				: dispatch(*this,branch->value,targetContext->branchTarget->type);
+			auto value = branch->branchTarget->type == TypeId::Void ? emitContext.voidDummy
+				: emitExpression(branch->value,targetContext->branchTarget->type);
 			
 			// Insert the branch instruction.
 			auto exitBlock = compileBranch(targetContext->basicBlock);
 			
-			// Add the branch's value to the list of incoming values for the branch target.
-			if(exitBlock) { targetContext->results = new(scopedArena) BranchResult {exitBlock,value,targetContext->results}; }
+			// Add the branch's value and the values of the locals to the list of incoming edges for the branch target.
+			addBranchResult(targetContext->results,exitBlock,value);
 
 			// Set the insert point to the unreachable block.
 			irBuilder.SetInsertPoint(unreachableBlock);
 
-			return typedZeroConstants[(size_t)type];
+			return emitContext.typedZeroConstants[(size_t)type];
 		}
 
 		DispatchResult visitNop(const Nop*)
 		{
-			return voidDummy;
+			return emitContext.voidDummy;
 		}
 		DispatchResult visitDiscardResult(const DiscardResult* discardResult)
 		{
-			dispatch(*this,discardResult->expression);
-			return voidDummy;
+			emitExpression(discardResult->expression);
+			return emitContext.voidDummy;
 		}
 		
 		DispatchResult compileLLVMIntrinsic(llvm::Intrinsic::ID intrinsicId,llvm::Value* firstOperand)
@@ -529,17 +1249,76 @@ namespace LLVMJIT
 			return irBuilder.CreateCall(intrinsic,llvm::ArrayRef<llvm::Value*>({firstOperand,secondOperand}));
 		}
 
-		DispatchResult compileRuntimeIntrinsic(const char* intrinsicName,const FunctionType& functionType,const std::initializer_list<llvm::Value*>& args)
+		// Returns a block that calls a runtime intrinsic that raises a trap, creating it if necessary. The intrinsic doesn't return, and
+		// is marked as cold so the code that branches to the block is laid out as if it isn't taken.
+		llvm::BasicBlock* getTrapBlock(llvm::BasicBlock*& trapBlock,const char* trapIntrinsicName)
 		{
-			auto decoratedIntrinsicName = Intrinsics::getDecoratedFunctionName(intrinsicName,functionType);
-			auto intrinsic = moduleIR.llvmModule->getGlobalVariable(decoratedIntrinsicName);
-			if(!intrinsic)
+			if(!trapBlock)
 			{
-				intrinsic = new llvm::GlobalVariable(*moduleIR.llvmModule,asLLVMType(functionType),true,llvm::GlobalValue::ExternalLinkage,nullptr,decoratedIntrinsicName);
+				const FunctionType trapFunctionType(TypeId::Void,{});
+				auto trapFunction = moduleIR.getImportedFunction(Intrinsics::getDecoratedFunctionName(trapIntrinsicName,trapFunctionType),trapFunctionType);
+				trapFunction->addFnAttr(llvm::Attribute::NoReturn);
+				trapFunction->addFnAttr(llvm::Attribute::Cold);
+
+				trapBlock = llvm::BasicBlock::Create(context,"trap",llvmFunction);
+				llvm::IRBuilder<> trapIRBuilder(trapBlock);
+				trapIRBuilder.CreateCall(trapFunction);
+				trapIRBuilder.CreateUnreachable();
 			}
-			return irBuilder.CreateCall(intrinsic,llvm::ArrayRef<llvm::Value*>(args.begin(),args.end()));
+			return trapBlock;
 		}
-		
+
+		// Branches to a trap block if a condition is true, and continues emitting code in a new block if it is false.
+		void compileTrapIf(llvm::Value* condition,llvm::BasicBlock*& trapBlock,const char* trapIntrinsicName)
+		{
+			if(irBuilder.GetInsertBlock() == unreachableBlock) { return; }
+			auto continueBlock = llvm::BasicBlock::Create(context,"noTrap",llvmFunction);
+			irBuilder.CreateCondBr(condition,getTrapBlock(trapBlock,trapIntrinsicName),continueBlock,llvm::MDBuilder(context).createBranchWeights(1,UINT32_MAX));
+			irBuilder.SetInsertPoint(continueBlock);
+		}
+
+		// Computes the minimum or maximum of two floats. If either operand is a NaN, it is the result. Otherwise, if the operands
+		// compare equal, they are either identical or +0.0 and -0.0: ORing their bits gives the minimum, and ANDing gives the maximum.
+		llvm::Value* compileFloatMinMax(TypeId type,llvm::Value* left,llvm::Value* right,bool isMin)
+		{
+			auto intType = type == TypeId::F32 ? llvm::Type::getInt32Ty(context) : llvm::Type::getInt64Ty(context);
+			auto leftBits = irBuilder.CreateBitCast(left,intType);
+			auto rightBits = irBuilder.CreateBitCast(right,intType);
+			auto equalResult = irBuilder.CreateBitCast(isMin ? irBuilder.CreateOr(leftBits,rightBits) : irBuilder.CreateAnd(leftBits,rightBits),left->getType());
+			auto orderedResult = irBuilder.CreateSelect(
+				isMin ? irBuilder.CreateFCmpOLT(left,right) : irBuilder.CreateFCmpOGT(left,right),
+				left,
+				irBuilder.CreateSelect(isMin ? irBuilder.CreateFCmpOLT(right,left) : irBuilder.CreateFCmpOGT(right,left),right,equalResult)
+				);
+			return irBuilder.CreateSelect(
+				irBuilder.CreateFCmpUNO(left,left),
+				left,
+				irBuilder.CreateSelect(irBuilder.CreateFCmpUNO(right,right),right,orderedResult)
+				);
+		}
+
+		// Converts a float to an integer, trapping if the float is a NaN or is outside the range of the integer type.
+		llvm::Value* compileFloatToInt(TypeId destType,TypeId sourceType,llvm::Value* source,bool isSigned)
+		{
+			// A NaN is an invalid float operation.
+			compileTrapIf(irBuilder.CreateFCmpUNO(source,source),invalidFloatOperationTrapBlock,"wavmIntrinsics.invalidFloatOperationTrap");
+
+			// The bounds of the integer type are powers of two, so they are exactly representable by both float types. The lower bound
+			// of an unsigned type is exclusive: -1.0 traps, but -0.9 truncates to 0.
+			const float64 signedMinValue = destType == TypeId::I32 ? (float64)INT32_MIN : (float64)INT64_MIN;
+			const float64 minValue = isSigned ? signedMinValue : -1.0;
+			const float64 maxValue = isSigned ? -signedMinValue : -2.0 * signedMinValue;
+			auto minLiteral = sourceType == TypeId::F32 ? compileLiteral(emitContext,(float32)minValue) : compileLiteral(emitContext,minValue);
+			auto maxLiteral = sourceType == TypeId::F32 ? compileLiteral(emitContext,(float32)maxValue) : compileLiteral(emitContext,maxValue);
+			auto isOutOfRange = irBuilder.CreateOr(
+				irBuilder.CreateFCmpOGE(source,maxLiteral),
+				isSigned ? irBuilder.CreateFCmpOLT(source,minLiteral) : irBuilder.CreateFCmpOLE(source,minLiteral)
+				);
+			compileTrapIf(isOutOfRange,integerOverflowTrapBlock,"wavmIntrinsics.integerOverflowTrap");
+
+			return isSigned ? irBuilder.CreateFPToSI(source,asLLVMType(emitContext,destType)) : irBuilder.CreateFPToUI(source,asLLVMType(emitContext,destType));
+		}
+
 		llvm::Value* compileIntAbs(llvm::Value* operand)
 		{
 			auto mask = irBuilder.CreateAShr(operand,operand->getType()->getScalarSizeInBits() - 1);
@@ -552,9 +1331,9 @@ namespace LLVMJIT
 			// division would overflow a signed integer. To avoid this case, we just branch if the srem(INT_MAX,-1) case that overflows
 			// is detected.
 			
-			llvm::Value* intMin = type == TypeId::I32 ? compileLiteral((uint32)INT_MIN) : compileLiteral((uint64)INT64_MIN);
-			llvm::Value* negativeOne = type == TypeId::I32 ? compileLiteral((uint32)-1) : compileLiteral((uint64)-1);
-			llvm::Value* zero = typedZeroConstants[(size_t)type];
+			llvm::Value* intMin = type == TypeId::I32 ? compileLiteral(emitContext,(uint32)INT_MIN) : compileLiteral(emitContext,(uint64)INT64_MIN);
+			llvm::Value* negativeOne = type == TypeId::I32 ? compileLiteral(emitContext,(uint32)-1) : compileLiteral(emitContext,(uint64)-1);
+			llvm::Value* zero = emitContext.typedZeroConstants[(size_t)type];
 
 			return compileIfElse(
 				type,
@@ -572,13 +1351,13 @@ namespace LLVMJIT
 			// LLVM's shifts have undefined behavior where WebAssembly defines shifts >= the bit width of the integer
 			// to yield zero (or -1 for shr_s on a negative number). To handle this case, use a different value depending
 			// one whether the shift value is >= the bit width of the operands.
-			auto bits = irBuilder.CreateZExt(compileLiteral((uint8)getTypeBitWidth(type)),llvmTypesByTypeId[(size_t)type]);
+			auto bits = irBuilder.CreateZExt(compileLiteral(emitContext,(uint8)getTypeBitWidth(type)),emitContext.llvmTypesByTypeId[(size_t)type]);
 			return irBuilder.CreateSelect(irBuilder.CreateICmpULT(shiftBits,bits),smallShiftValue,largeShiftValue);
 		}
 
 		llvm::Value* compileShrSExt(TypeId type,llvm::Value* left,llvm::Value* right)
 		{
-			auto bitsMinusOne = irBuilder.CreateZExt(compileLiteral((uint8)(getTypeBitWidth(type) - 1)),llvmTypesByTypeId[(size_t)type]);
+			auto bitsMinusOne = irBuilder.CreateZExt(compileLiteral(emitContext,(uint8)(getTypeBitWidth(type) - 1)),emitContext.llvmTypesByTypeId[(size_t)type]);
 			return compileShift(type,right,irBuilder.CreateAShr(left,right),irBuilder.CreateAShr(left,bitsMinusOne));
 		}
 
@@ -589,36 +1368,36 @@ namespace LLVMJIT
 		#define IMPLEMENT_UNARY_OP(class,op,llvmOp) \
 			DispatchResult visitUnary(TypeId type,const Unary<class>* unary,OpTypes<class>::op) \
 			{ \
-				auto operand = dispatch(*this,unary->operand,type); \
+				auto operand = emitExpression(unary->operand,type); \
 				return llvmOp; \
 			}
 		#define IMPLEMENT_BINARY_OP(class,op,llvmOp) \
 			DispatchResult visitBinary(TypeId type,const Binary<class>* binary,OpTypes<class>::op) \
 			{ \
-				auto left = dispatch(*this,binary->left,type); \
-				auto right = dispatch(*this,binary->right,type); \
+				auto left = emitExpression(binary->left,type); \
+				auto right = emitExpression(binary->right,type); \
 				return llvmOp; \
 			}
 		#define IMPLEMENT_CAST_OP(class,op,llvmOp) \
 			DispatchResult visitCast(TypeId type,const Cast<class>* cast,OpTypes<class>::op) \
 			{ \
-				auto source = dispatch(*this,cast->source); \
-				auto destType = asLLVMType(type); while(!destType) {} \
+				auto source = emitExpression(cast->source); \
+				auto destType = asLLVMType(emitContext,type); while(!destType) {} \
 				return llvmOp; \
 			}
 		#define IMPLEMENT_COMPARE_OP(op,llvmOp) \
 			DispatchResult visitComparison(const Comparison* compare,OpTypes<BoolClass>::op) \
 			{ \
-				auto left = dispatch(*this,compare->left,compare->operandType); \
-				auto right = dispatch(*this,compare->right,compare->operandType); \
+				auto left = emitExpression(compare->left,compare->operandType); \
+				auto right = emitExpression(compare->right,compare->operandType); \
 				return llvmOp; \
 			}
 
 		IMPLEMENT_UNARY_OP(IntClass,neg,irBuilder.CreateNeg(operand))
 		IMPLEMENT_UNARY_OP(IntClass,abs,compileIntAbs(operand))
 		IMPLEMENT_UNARY_OP(IntClass,bitwiseNot,irBuilder.CreateNot(operand))
-		IMPLEMENT_UNARY_OP(IntClass,clz,irBuilder.CreateCall(getLLVMIntrinsic({operand->getType()},llvm::Intrinsic::ctlz),llvm::ArrayRef<llvm::Value*>({operand,compileLiteral(false)})))
-		IMPLEMENT_UNARY_OP(IntClass,ctz,irBuilder.CreateCall(getLLVMIntrinsic({operand->getType()},llvm::Intrinsic::cttz),llvm::ArrayRef<llvm::Value*>({operand,compileLiteral(false)})))
+		IMPLEMENT_UNARY_OP(IntClass,clz,irBuilder.CreateCall(getLLVMIntrinsic({operand->getType()},llvm::Intrinsic::ctlz),llvm::ArrayRef<llvm::Value*>({operand,compileLiteral(emitContext,false)})))
+		IMPLEMENT_UNARY_OP(IntClass,ctz,irBuilder.CreateCall(getLLVMIntrinsic({operand->getType()},llvm::Intrinsic::cttz),llvm::ArrayRef<llvm::Value*>({operand,compileLiteral(emitContext,false)})))
 		IMPLEMENT_UNARY_OP(IntClass,popcnt,compileLLVMIntrinsic(llvm::Intrinsic::ctpop,operand))
 		IMPLEMENT_BINARY_OP(IntClass,add,irBuilder.CreateAdd(left,right))
 		IMPLEMENT_BINARY_OP(IntClass,sub,irBuilder.CreateSub(left,right))
@@ -630,12 +1409,12 @@ namespace LLVMJIT
 		IMPLEMENT_BINARY_OP(IntClass,bitwiseAnd,irBuilder.CreateAnd(left,right))
 		IMPLEMENT_BINARY_OP(IntClass,bitwiseOr,irBuilder.CreateOr(left,right))
 		IMPLEMENT_BINARY_OP(IntClass,bitwiseXor,irBuilder.CreateXor(left,right))
-		IMPLEMENT_BINARY_OP(IntClass,shl,compileShift(type,right,irBuilder.CreateShl(left,right),typedZeroConstants[(size_t)type]))
+		IMPLEMENT_BINARY_OP(IntClass,shl,compileShift(type,right,irBuilder.CreateShl(left,right),emitContext.typedZeroConstants[(size_t)type]))
 		IMPLEMENT_BINARY_OP(IntClass,shrSExt,compileShrSExt(type,left,right))
-		IMPLEMENT_BINARY_OP(IntClass,shrZExt,compileShift(type,right,irBuilder.CreateLShr(left,right),typedZeroConstants[(size_t)type]))
+		IMPLEMENT_BINARY_OP(IntClass,shrZExt,compileShift(type,right,irBuilder.CreateLShr(left,right),emitContext.typedZeroConstants[(size_t)type]))
 		IMPLEMENT_CAST_OP(IntClass,wrap,irBuilder.CreateTrunc(source,destType))
-		IMPLEMENT_CAST_OP(IntClass,truncSignedFloat,compileRuntimeIntrinsic("wavmIntrinsics.floatToSignedInt",FunctionType(type,{cast->source.type}),{source}))
-		IMPLEMENT_CAST_OP(IntClass,truncUnsignedFloat,compileRuntimeIntrinsic("wavmIntrinsics.floatToUnsignedInt",FunctionType(type,{cast->source.type}),{source}))
+		IMPLEMENT_CAST_OP(IntClass,truncSignedFloat,compileFloatToInt(type,cast->source.type,source,true))
+		IMPLEMENT_CAST_OP(IntClass,truncUnsignedFloat,compileFloatToInt(type,cast->source.type,source,false))
 		IMPLEMENT_CAST_OP(IntClass,sext,irBuilder.CreateSExt(source,destType))
 		IMPLEMENT_CAST_OP(IntClass,zext,irBuilder.CreateZExt(source,destType))
 		IMPLEMENT_CAST_OP(IntClass,reinterpretFloat,irBuilder.CreateBitCast(source,destType))
@@ -653,8 +1432,8 @@ namespace LLVMJIT
 		IMPLEMENT_BINARY_OP(FloatClass,mul,irBuilder.CreateFMul(left,right))
 		IMPLEMENT_BINARY_OP(FloatClass,div,irBuilder.CreateFDiv(left,right))
 		IMPLEMENT_BINARY_OP(FloatClass,rem,irBuilder.CreateFRem(left,right))
-		IMPLEMENT_BINARY_OP(FloatClass,min,compileRuntimeIntrinsic("wavmIntrinsics.floatMin",FunctionType(type,{type,type}),{left,right}))
-		IMPLEMENT_BINARY_OP(FloatClass,max,compileRuntimeIntrinsic("wavmIntrinsics.floatMax",FunctionType(type,{type,type}),{left,right}))
+		IMPLEMENT_BINARY_OP(FloatClass,min,compileFloatMinMax(type,left,right,true))
+		IMPLEMENT_BINARY_OP(FloatClass,max,compileFloatMinMax(type,left,right,false))
 		IMPLEMENT_BINARY_OP(FloatClass,copySign,compileLLVMIntrinsic(llvm::Intrinsic::copysign,left,right))
 		IMPLEMENT_CAST_OP(FloatClass,convertSignedInt,irBuilder.CreateSIToFP(source,destType))
 		IMPLEMENT_CAST_OP(FloatClass,convertUnsignedInt,irBuilder.CreateUIToFP(source,destType))
@@ -689,29 +1468,65 @@ namespace LLVMJIT
 	
 	void EmitFunctionContext::emit()
 	{
+		// Create the function's debug info, and give the IR that isn't emitted for a specific expression the function's locus.
+		if(moduleIR.diBuilder)
+		{
+			const unsigned line = astFunction->locus.newlines + 1;
+			diSubprogram = moduleIR.diBuilder->createFunction(
+				moduleIR.diCompileUnit,astFunction->name ? llvm::StringRef(astFunction->name) : llvmFunction->getName(),llvmFunction->getName(),
+				moduleIR.diFile,line,moduleIR.diFunctionType,false,true,line,0,false,llvmFunction
+				);
+			for(auto& expressionLocus : astFunction->expressionLoci) { expressionLoci[expressionLocus.expression] = expressionLocus.locus; }
+			irBuilder.SetCurrentDebugLocation(getDebugLoc(astFunction->locus));
+		}
+
 		// Create an initial basic block for the function.
 		auto entryBasicBlock = llvm::BasicBlock::Create(context,"entry",llvmFunction);
 		irBuilder.SetInsertPoint(entryBasicBlock);
 
-		// Create allocas for all the locals and initialize them to zero.
-		localVariablePointers = new(scopedArena) llvm::Value*[astFunction->locals.size()];
+		// Initialize the locals to zero, and the parameters to the function's arguments.
+		localValues = new(scopedArena) llvm::Value*[astFunction->locals.size()];
 		for(uintptr localIndex = 0;localIndex < astFunction->locals.size();++localIndex)
+		{ localValues[localIndex] = emitContext.typedZeroConstants[(uintptr)astFunction->locals[localIndex].type]; }
+		auto llvmArgIt = llvmFunction->arg_begin();
+		instanceMemory = llvmArgIt++;
+		uintptr parameterIndex = 0;
+		for(;llvmArgIt != llvmFunction->arg_end();++parameterIndex,++llvmArgIt)
 		{
-			auto localVariable = astFunction->locals[localIndex];
-			localVariablePointers[localIndex] = irBuilder.CreateAlloca(asLLVMType(localVariable.type),nullptr,getLLVMName(localVariable.name));
-			irBuilder.CreateStore(typedZeroConstants[(uintptr)localVariable.type],localVariablePointers[localIndex]);
+			auto localIndex = astFunction->parameterLocalIndices[parameterIndex];
+			localValues[localIndex] = llvmArgIt;
 		}
 
-		// Move the function arguments into the corresponding local variable allocas.
-		uintptr parameterIndex = 0;
-		for(auto llvmArgIt = llvmFunction->arg_begin();llvmArgIt != llvmFunction->arg_end();++parameterIndex,++llvmArgIt)
+		// Load the base of the instance memory. It never changes once the memory is created, so the load is marked invariant, which lets
+		// LLVM reuse the base across calls, and share it with callers the function is inlined into.
+		auto instanceMemoryBaseLoad = irBuilder.CreateLoad(irBuilder.CreateStructGEP(nullptr,instanceMemory,0));
+		instanceMemoryBaseLoad->setMetadata(llvm::LLVMContext::MD_invariant_load,llvm::MDNode::get(context,llvm::None));
+		instanceMemoryBase = instanceMemoryBaseLoad;
+
+		// Count the function's entries, and use the profiled entry count to mark the function as hot or cold.
+		const uintptr entryCounterIndex = allocateProfileCounters(1);
+		compileProfileCounterIncrement(entryCounterIndex);
+		if(functionProfile)
 		{
-			auto localIndex = astFunction->parameterLocalIndices[parameterIndex];
-			irBuilder.CreateStore(llvmArgIt,localVariablePointers[localIndex]);
+			const uint64 entryCount = getProfileCount(entryCounterIndex);
+			llvmFunction->setEntryCount(entryCount);
+			if(entryCount == 0)
+			{
+				llvmFunction->addFnAttr(llvm::Attribute::Cold);
+				llvmFunction->addFnAttr(llvm::Attribute::OptimizeForSize);
+			}
+			else if(entryCount >= moduleIR.hotFunctionEntryCountThreshold)
+			{
+				llvmFunction->addFnAttr(llvm::Attribute::InlineHint);
+
+				// Put hot functions in their own section, so the memory manager can place them together. This is only done for ELF: the
+				// Windows SEH unwind info registration assumes all of an object's code is in one .text section.
+				if(llvm::Triple(llvm::sys::getProcessTriple()).isOSBinFormatELF()) { llvmFunction->setSection(hotCodeSectionName); }
+			}
 		}
 
 		// Traverse the function's expressions.
-		auto value = dispatch(*this,astFunction->expression,astFunction->type.returnType);
+		auto value = emitExpression(astFunction->expression,astFunction->type.returnType);
 
 		// If the final value of the function is reachable, return it.
 		if(irBuilder.GetInsertBlock() != unreachableBlock)
@@ -720,41 +1535,103 @@ namespace LLVMJIT
 			else { irBuilder.CreateRet(value); }
 		}
 
+		// Delete the loop phis that were replaced because the loop didn't change their local. Values captured for branches may have
+		// referred to them after they were replaced, so replace them again with the value they ultimately stand for.
+		for(auto& phiReplacement : unchangedLoopLocalPHIs) { phiReplacement.first->replaceAllUsesWith(getReplacedLocalValue(phiReplacement.first)); }
+		for(auto& phiReplacement : unchangedLoopLocalPHIs) { llvm::cast<llvm::PHINode>(phiReplacement.first)->eraseFromParent(); }
+		unchangedLoopLocalPHIs.clear();
+
 		// Delete the unreachable block.
 		unreachableBlock->eraseFromParent();
 		unreachableBlock = nullptr;
+
+		// Create the function's profile counter array now that the number of counters is known, and replace the placeholder with it.
+		// The first element holds the number of counters, so the runtime can read the counters without knowing how they were allocated.
+		if(profileCountersPlaceholder)
+		{
+			auto countersType = llvm::ArrayType::get(llvm::Type::getInt64Ty(context),numProfileCounters + 1);
+			std::vector<llvm::Constant*> initialCounters(numProfileCounters + 1,compileLiteral(emitContext,(uint64)0));
+			initialCounters[0] = compileLiteral(emitContext,(uint64)numProfileCounters);
+			auto profileCounters = new llvm::GlobalVariable(
+				*moduleIR.llvmModule,countersType,false,llvm::GlobalValue::ExternalLinkage,
+				llvm::ConstantArray::get(countersType,initialCounters),
+				getProfileCountersName(functionIndex)
+				);
+			profileCountersPlaceholder->replaceAllUsesWith(llvm::ConstantExpr::getBitCast(profileCounters,profileCountersPlaceholder->getType()));
+			profileCountersPlaceholder->eraseFromParent();
+			profileCountersPlaceholder = nullptr;
+		}
 	}
 
-	llvm::Module* emitModule(const Module* astModule)
+	llvm::Module* emitModule(EmitContext& emitContext,const Module* astModule,const std::vector<uintptr>& definedFunctionIndices,const EmitOptions& options,uintptr* outNumSpeculatedCallSites)
 	{
+		llvm::LLVMContext& context = emitContext.llvmContext;
+
 		// Create a JIT module.
-		Core::Timer emitTimer;
-		ModuleIR moduleIR;
+		ModuleIR moduleIR(emitContext,options);
 
-		// Create literals for the virtual memory base and mask.
-		llvm::APInt instanceMemoryBaseVal = llvm::APInt(sizeof(uintptr) == 8 ? 64 : 32,reinterpret_cast<uintptr>(Runtime::instanceMemoryBase));
-		moduleIR.instanceMemoryBase = llvm::Constant::getIntegerValue(llvm::Type::getInt8PtrTy(context),instanceMemoryBaseVal);
+		// Functions that are called at least 1% as often as the most frequently called function are considered hot.
+		if(options.profile)
+		{
+			uint64 maxEntryCount = 0;
+			for(auto& functionCounters : options.profile->functionCounters)
+			{ if(functionCounters.size()) { maxEntryCount = std::max(maxEntryCount,functionCounters[0]); } }
+			moduleIR.hotFunctionEntryCountThreshold = std::max((uint64)1,maxEntryCount / 100);
+		}
+
+		// Create the type-based alias analysis tags for the instance memory and its size, which are distinct scalar types.
+		llvm::MDBuilder mdBuilder(context);
+		auto tbaaRoot = mdBuilder.createTBAARoot("WAVM instance memory");
+		auto memoryAccessTBAAType = mdBuilder.createTBAAScalarTypeNode("memory",tbaaRoot);
+		auto memoryNumBytesTBAAType = mdBuilder.createTBAAScalarTypeNode("numBytes",tbaaRoot);
+		moduleIR.memoryAccessTBAATag = mdBuilder.createTBAAStructTagNode(memoryAccessTBAAType,memoryAccessTBAAType,0);
+		moduleIR.memoryNumBytesTBAATag = mdBuilder.createTBAAStructTagNode(memoryNumBytesTBAAType,memoryNumBytesTBAAType,0);
+
+		// Create a literal for the virtual memory address mask.
 		auto instanceMemoryAddressMask = Runtime::instanceAddressSpaceMaxBytes - 1;
-		moduleIR.instanceMemoryAddressMask = sizeof(uintptr) == 8 ? compileLiteral((uint64)instanceMemoryAddressMask) : compileLiteral((uint32)instanceMemoryAddressMask);
+		moduleIR.instanceMemoryAddressMask = sizeof(uintptr) == 8 ? compileLiteral(emitContext,(uint64)instanceMemoryAddressMask) : compileLiteral(emitContext,(uint32)instanceMemoryAddressMask);
+
+		// Create the debug info for the module's source file.
+		if(options.emitDebugInfo)
+		{
+			moduleIR.llvmModule->addModuleFlag(llvm::Module::Warning,"Debug Info Version",llvm::DEBUG_METADATA_VERSION);
+			moduleIR.diBuilder = llvm::make_unique<llvm::DIBuilder>(*moduleIR.llvmModule);
+			const std::string sourcePath = options.sourcePath.size() ? options.sourcePath : "module.wast";
+			const auto fileName = llvm::sys::path::filename(sourcePath);
+			const auto directory = llvm::sys::path::parent_path(sourcePath);
+			moduleIR.diCompileUnit = moduleIR.diBuilder->createCompileUnit(llvm::dwarf::DW_LANG_C,fileName,directory,"WAVM",false,"",0);
+			moduleIR.diFile = moduleIR.diBuilder->createFile(fileName,directory);
+			moduleIR.diFunctionType = moduleIR.diBuilder->createSubroutineType(moduleIR.diFile,moduleIR.diBuilder->getOrCreateTypeArray({}));
+		}
 
 		// Create the LLVM functions.
 		moduleIR.functions.resize(astModule->functions.size());
+		moduleIR.speculatedCallees.resize(astModule->functions.size());
 		for(uintptr functionIndex = 0;functionIndex < astModule->functions.size();++functionIndex)
 		{
 			auto astFunction = astModule->functions[functionIndex];
-			auto llvmFunctionType = asLLVMType(astFunction->type);
+			auto llvmFunctionType = asLLVMDefinedFunctionType(emitContext,astFunction->type);
 			auto externalName = getExternalFunctionName(functionIndex);
 			moduleIR.functions[functionIndex] = llvm::Function::Create(llvmFunctionType,llvm::Function::ExternalLinkage,externalName,moduleIR.llvmModule);
 		}
 
-		// Create the function import globals.
-		moduleIR.functionImportPointers.resize(astModule->functionImports.size());
-		for(uintptr importIndex = 0;importIndex < moduleIR.functionImportPointers.size();++importIndex)
+		// Declare the imported functions. They are called directly, and bound to the intrinsic functions by name when the module is linked.
+		moduleIR.functionImports.resize(astModule->functionImports.size());
+		for(uintptr importIndex = 0;importIndex < moduleIR.functionImports.size();++importIndex)
 		{
 			auto functionImport = astModule->functionImports[importIndex];
-			auto functionType = asLLVMType(functionImport.type);
 			auto functionName = Intrinsics::getDecoratedFunctionName((std::string(functionImport.module) + "." + functionImport.name).c_str(),functionImport.type);
-			moduleIR.functionImportPointers[importIndex] = new llvm::GlobalVariable(*moduleIR.llvmModule,functionType,true,llvm::GlobalValue::ExternalLinkage,nullptr,functionName);
+			moduleIR.functionImports[importIndex] = moduleIR.getImportedFunction(functionName,functionImport.type);
+		}
+
+		// Declare the module's function pointer table if the module calls its functions through it. The table is defined by the runtime.
+		if(options.callThroughFunctionPointers)
+		{
+			auto llvmIntPtrType = sizeof(uintptr) == 8 ? llvm::Type::getInt64Ty(context) : llvm::Type::getInt32Ty(context);
+			moduleIR.functionPointers = new llvm::GlobalVariable(
+				*moduleIR.llvmModule,llvm::ArrayType::get(llvmIntPtrType,astModule->functions.size()),false,llvm::GlobalValue::ExternalLinkage,
+				nullptr,functionPointersSymbolName
+				);
 		}
 
 		// Create the function table globals.
@@ -766,14 +1643,20 @@ namespace LLVMJIT
 			llvmFunctionTableElements.resize(astFunctionTable.numFunctions);
 			for(uint32 functionIndex = 0;functionIndex < astFunctionTable.numFunctions;++functionIndex)
 			{
-				assert(astFunctionTable.functionIndices[functionIndex] < moduleIR.functions.size());
-				llvmFunctionTableElements[functionIndex] = moduleIR.functions[astFunctionTable.functionIndices[functionIndex]];
+				const uintptr calleeIndex = astFunctionTable.functionIndices[functionIndex];
+				assert(calleeIndex < moduleIR.functions.size());
+				llvmFunctionTableElements[functionIndex] = options.callThroughFunctionPointers
+					? (llvm::Constant*)compileLiteral(emitContext,(uint32)calleeIndex)
+					: (llvm::Constant*)moduleIR.functions[calleeIndex];
 			}
 			// Verify that the number of elements is a power of two, so we can use bitwise and to prevent out-of-bounds accesses.
 			assert((astFunctionTable.numFunctions & (astFunctionTable.numFunctions-1)) == 0);
 
-			// Create a LLVM global variable that holds the array of function pointers.
-			auto llvmFunctionTablePointerType = llvm::ArrayType::get(asLLVMType(astFunctionTable.type)->getPointerTo(),llvmFunctionTableElements.size());
+			// Create a LLVM global variable that holds the array of function pointers, or function indices.
+			auto llvmFunctionTableElementType = options.callThroughFunctionPointers
+				? (llvm::Type*)llvm::Type::getInt32Ty(context)
+				: (llvm::Type*)asLLVMDefinedFunctionType(emitContext,astFunctionTable.type)->getPointerTo();
+			auto llvmFunctionTablePointerType = llvm::ArrayType::get(llvmFunctionTableElementType,llvmFunctionTableElements.size());
 			auto llvmFunctionTablePointer = new llvm::GlobalVariable(
 				*moduleIR.llvmModule,llvmFunctionTablePointerType,true,llvm::GlobalValue::PrivateLinkage,
 				llvm::ConstantArray::get(llvmFunctionTablePointerType,llvmFunctionTableElements)
@@ -781,46 +1664,181 @@ namespace LLVMJIT
 			moduleIR.functionTablePointers[tableIndex] = llvmFunctionTablePointer;
 		}
 
-		// Compile each function in the module.
-		for(uintptr functionIndex = 0;functionIndex < astModule->functions.size();++functionIndex)
+		// Compile each function that should be defined in this module. Any function that isn't compiled
+		// is left as a declaration, and will be resolved against the other modules it is linked with.
+		std::vector<bool> isFunctionEmitted(astModule->functions.size(),false);
+		for(auto functionIndex : definedFunctionIndices)
 		{
+			assert(functionIndex < astModule->functions.size());
 			EmitFunctionContext(moduleIR,astModule,functionIndex).emit();
+			isFunctionEmitted[functionIndex] = true;
 		}
-		std::cout << "Emitted LLVM IR for module in " << emitTimer.getMilliseconds() << "ms" << std::endl;
+		if(outNumSpeculatedCallSites) { *outNumSpeculatedCallSites = moduleIR.numSpeculatedCallSites; }
+
+		// Emit an available_externally copy of each inlined function that is called by a function in this module, so the LLVM inliner
+		// can inline it even if it's defined in another partition. Inlined functions may call other inlined functions, so this continues
+		// until the copies don't call any inlined function that hasn't been emitted. Small functions that a call_indirect site calls
+		// directly are also inlined into it.
+		std::vector<bool> isSpeculatedSmallCallee(astModule->functions.size(),false);
+		if(options.inliningPlan)
+		{
+			std::vector<uintptr> pendingFunctionIndices = definedFunctionIndices;
+			while(pendingFunctionIndices.size())
+			{
+				const uintptr callerIndex = pendingFunctionIndices.back();
+				pendingFunctionIndices.pop_back();
+				std::vector<uintptr> calleeIndices = options.inliningPlan->inlinedCallees[callerIndex];
+				for(auto calleeIndex : moduleIR.speculatedCallees[callerIndex])
+				{
+					if(options.inliningPlan->isSmallFunction[calleeIndex])
+					{
+						isSpeculatedSmallCallee[calleeIndex] = true;
+						calleeIndices.push_back(calleeIndex);
+					}
+				}
+				for(auto calleeIndex : calleeIndices)
+				{
+					if(!isFunctionEmitted[calleeIndex])
+					{
+						moduleIR.functions[calleeIndex]->setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+						EmitFunctionContext(moduleIR,astModule,calleeIndex).emit();
+						isFunctionEmitted[calleeIndex] = true;
+						pendingFunctionIndices.push_back(calleeIndex);
+					}
+				}
+			}
+
+			for(uintptr functionIndex = 0;functionIndex < astModule->functions.size();++functionIndex)
+			{
+				if(isFunctionEmitted[functionIndex] && (options.inliningPlan->isInlinedFunction[functionIndex] || isSpeculatedSmallCallee[functionIndex]))
+				{ moduleIR.functions[functionIndex]->addFnAttr(llvm::Attribute::AlwaysInline); }
+			}
+		}
+
+		if(moduleIR.diBuilder) { moduleIR.diBuilder->finalize(); }
 		
 		return moduleIR.llvmModule;
 	}
 	
-	void init()
+	llvm::Module* emitLazyStubModule(EmitContext& emitContext,const Module* astModule)
 	{
-		llvm::InitializeNativeTarget();
-		llvm::InitializeNativeTargetAsmPrinter();
-		llvm::InitializeNativeTargetAsmParser();
-		llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+		llvm::LLVMContext& context = emitContext.llvmContext;
+		auto llvmModule = new llvm::Module("",context);
+		auto llvmIntPtrType = sizeof(uintptr) == 8 ? llvm::Type::getInt64Ty(context) : llvm::Type::getInt32Ty(context);
+		auto llvmBytePointerType = llvm::Type::getInt8PtrTy(context);
+
+		// Declare the function that compiles a function on demand, and the symbol that identifies the module to it.
+		auto lazyCompileFunctionType = llvm::FunctionType::get(llvmBytePointerType,{llvmBytePointerType,llvmIntPtrType},false);
+		auto lazyCompileFunction = llvm::Function::Create(lazyCompileFunctionType,llvm::Function::ExternalLinkage,lazyCompileFunctionSymbolName,llvmModule);
+		auto lazyJITModule = new llvm::GlobalVariable(*llvmModule,llvm::Type::getInt8Ty(context),false,llvm::GlobalValue::ExternalLinkage,nullptr,lazyJITModuleSymbolName);
+
+		for(uintptr functionIndex = 0;functionIndex < astModule->functions.size();++functionIndex)
+		{
+			auto astFunction = astModule->functions[functionIndex];
+			auto llvmFunctionType = asLLVMDefinedFunctionType(emitContext,astFunction->type);
+			auto llvmFunctionPointerType = llvmFunctionType->getPointerTo();
+			auto llvmFunction = llvm::Function::Create(llvmFunctionType,llvm::Function::ExternalLinkage,getExternalFunctionName(functionIndex),llvmModule);
+
+			// Create a global that holds the address of the function's compiled code once it has been compiled. It may be written by one
+			// thread while others read it, so it's accessed atomically: the store releases the compiled code, and the load acquires it.
+			auto implPointer = new llvm::GlobalVariable(*llvmModule,llvmIntPtrType,false,llvm::GlobalValue::PrivateLinkage,llvm::ConstantInt::get(llvmIntPtrType,0));
+
+			auto entryBlock = llvm::BasicBlock::Create(context,"entry",llvmFunction);
+			auto compileBlock = llvm::BasicBlock::Create(context,"compile",llvmFunction);
+			auto callBlock = llvm::BasicBlock::Create(context,"call",llvmFunction);
+			llvm::IRBuilder<> irBuilder(entryBlock);
+
+			// If the function hasn't been compiled yet, compile it and save its address.
+			auto implAddress = irBuilder.CreateLoad(implPointer);
+			implAddress->setAlignment(sizeof(uintptr));
+			implAddress->setAtomic(llvm::Acquire);
+			auto impl = irBuilder.CreateIntToPtr(implAddress,llvmFunctionPointerType);
+			irBuilder.CreateCondBr(irBuilder.CreateIsNull(implAddress),compileBlock,callBlock);
+			irBuilder.SetInsertPoint(compileBlock);
+			auto compiledImplBytes = irBuilder.CreateCall(lazyCompileFunction,{lazyJITModule,llvm::ConstantInt::get(llvmIntPtrType,functionIndex)});
+			auto compiledImpl = irBuilder.CreatePointerCast(compiledImplBytes,llvmFunctionPointerType);
+			auto implStore = irBuilder.CreateStore(irBuilder.CreatePtrToInt(compiledImplBytes,llvmIntPtrType),implPointer);
+			implStore->setAlignment(sizeof(uintptr));
+			implStore->setAtomic(llvm::Release);
+			irBuilder.CreateBr(callBlock);
+
+			// Forward the arguments to the compiled function.
+			irBuilder.SetInsertPoint(callBlock);
+			auto implPHI = irBuilder.CreatePHI(llvmFunctionPointerType,2);
+			implPHI->addIncoming(impl,entryBlock);
+			implPHI->addIncoming(compiledImpl,compileBlock);
+			std::vector<llvm::Value*> args;
+			for(auto llvmArgIt = llvmFunction->arg_begin();llvmArgIt != llvmFunction->arg_end();++llvmArgIt) { args.push_back(llvmArgIt); }
+			auto call = irBuilder.CreateCall(implPHI,args);
+			call->setTailCall();
+			if(astFunction->type.returnType == TypeId::Void) { irBuilder.CreateRetVoid(); }
+			else { irBuilder.CreateRet(call); }
+		}
 
+		return llvmModule;
+	}
+	
+	EmitContext::EmitContext()
+	{
 		llvmTypesByTypeId[(size_t)TypeId::None] = nullptr;
-		llvmTypesByTypeId[(size_t)TypeId::I8] = llvm::Type::getInt8Ty(context);
-		llvmTypesByTypeId[(size_t)TypeId::I16] = llvm::Type::getInt16Ty(context);
-		llvmTypesByTypeId[(size_t)TypeId::I32] = llvm::Type::getInt32Ty(context);
-		llvmTypesByTypeId[(size_t)TypeId::I64] = llvm::Type::getInt64Ty(context);
-		llvmTypesByTypeId[(size_t)TypeId::F32] = llvm::Type::getFloatTy(context);
-		llvmTypesByTypeId[(size_t)TypeId::F64] = llvm::Type::getDoubleTy(context);
-		llvmTypesByTypeId[(size_t)TypeId::Bool] = llvm::Type::getInt1Ty(context);
-		llvmTypesByTypeId[(size_t)TypeId::Void] = llvm::Type::getVoidTy(context);
+		llvmTypesByTypeId[(size_t)TypeId::I8] = llvm::Type::getInt8Ty(llvmContext);
+		llvmTypesByTypeId[(size_t)TypeId::I16] = llvm::Type::getInt16Ty(llvmContext);
+		llvmTypesByTypeId[(size_t)TypeId::I32] = llvm::Type::getInt32Ty(llvmContext);
+		llvmTypesByTypeId[(size_t)TypeId::I64] = llvm::Type::getInt64Ty(llvmContext);
+		llvmTypesByTypeId[(size_t)TypeId::F32] = llvm::Type::getFloatTy(llvmContext);
+		llvmTypesByTypeId[(size_t)TypeId::F64] = llvm::Type::getDoubleTy(llvmContext);
+		llvmTypesByTypeId[(size_t)TypeId::Bool] = llvm::Type::getInt1Ty(llvmContext);
+		llvmTypesByTypeId[(size_t)TypeId::Void] = llvm::Type::getVoidTy(llvmContext);
 		
 		// Create a null pointer constant to use as the void dummy value.
 		llvm::APInt voidDummyVal = llvm::APInt(sizeof(uintptr) == 8 ? 64 : 32,0);
-		voidDummy = llvm::Constant::getIntegerValue(llvm::Type::getInt8Ty(context),voidDummyVal);
+		voidDummy = llvm::Constant::getIntegerValue(llvm::Type::getInt8Ty(llvmContext),voidDummyVal);
 		
 		// Create zero constants of each type.
 		typedZeroConstants[(size_t)TypeId::None] = nullptr;
-		typedZeroConstants[(size_t)TypeId::I8] = compileLiteral((uint8)0);
-		typedZeroConstants[(size_t)TypeId::I16] = compileLiteral((uint16)0);
-		typedZeroConstants[(size_t)TypeId::I32] = compileLiteral((uint32)0);
-		typedZeroConstants[(size_t)TypeId::I64] = compileLiteral((uint64)0);
-		typedZeroConstants[(size_t)TypeId::F32] = compileLiteral((float32)0.0f);
-		typedZeroConstants[(size_t)TypeId::F64] = compileLiteral((float64)0.0);
-		typedZeroConstants[(size_t)TypeId::Bool] = compileLiteral(false);
+		typedZeroConstants[(size_t)TypeId::I8] = compileLiteral(*this,(uint8)0);
+		typedZeroConstants[(size_t)TypeId::I16] = compileLiteral(*this,(uint16)0);
+		typedZeroConstants[(size_t)TypeId::I32] = compileLiteral(*this,(uint32)0);
+		typedZeroConstants[(size_t)TypeId::I64] = compileLiteral(*this,(uint64)0);
+		typedZeroConstants[(size_t)TypeId::F32] = compileLiteral(*this,(float32)0.0f);
+		typedZeroConstants[(size_t)TypeId::F64] = compileLiteral(*this,(float64)0.0);
+		typedZeroConstants[(size_t)TypeId::Bool] = compileLiteral(*this,false);
 		typedZeroConstants[(size_t)TypeId::Void] = voidDummy;
+
+		// Declare the members of Runtime::InstanceMemory that the generated code reads.
+		static_assert(offsetof(Runtime::InstanceMemory,base) == 0 && offsetof(Runtime::InstanceMemory,numBytes) == sizeof(uint8*),"Runtime::InstanceMemory doesn't match the LLVM type");
+		instanceMemoryPointerType = llvm::StructType::get(llvmContext,{llvm::Type::getInt8PtrTy(llvmContext),llvm::Type::getInt32Ty(llvmContext)})->getPointerTo();
+	}
+
+	// The emit contexts that aren't being used by any thread. Only accessed with idleEmitContextsMutex locked.
+	std::vector<std::unique_ptr<EmitContext>> idleEmitContexts;
+	Platform::Mutex idleEmitContextsMutex;
+
+	std::unique_ptr<EmitContext> acquireEmitContext()
+	{
+		{
+			Platform::Lock idleEmitContextsLock(idleEmitContextsMutex);
+			if(idleEmitContexts.size())
+			{
+				auto emitContext = std::move(idleEmitContexts.back());
+				idleEmitContexts.pop_back();
+				return emitContext;
+			}
+		}
+		return llvm::make_unique<EmitContext>();
+	}
+
+	void releaseEmitContext(std::unique_ptr<EmitContext>&& emitContext)
+	{
+		Platform::Lock idleEmitContextsLock(idleEmitContextsMutex);
+		idleEmitContexts.push_back(std::move(emitContext));
+	}
+
+	void init()
+	{
+		llvm::InitializeNativeTarget();
+		llvm::InitializeNativeTargetAsmPrinter();
+		llvm::InitializeNativeTargetAsmParser();
+		llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
 	}
-}
+}
\ No newline at end of file
@@ -0,0 +1,89 @@
+#include "LLVMJIT.h"
+
+using namespace AST;
+
+namespace LLVMJIT
+{
+	// Functions with at most this many AST nodes are inlined into all their callers.
+	static const uintptr maxSmallFunctionSize = 24;
+
+	// Functions that are only called from one call site are inlined into it if they have at most this many AST nodes.
+	static const uintptr maxSingleCallerFunctionSize = 400;
+
+	// Counts the AST nodes in a function, and records the functions it calls directly.
+	struct InliningVisitor : MapChildrenVisitor<InliningVisitor&,TypedExpression>
+	{
+		uintptr numNodes;
+		std::vector<uintptr> directCallees;
+
+		InliningVisitor(Memory::Arena& inArena,const Module* inModule,Function* inFunction)
+		: MapChildrenVisitor(inArena,inModule,inFunction,*this), numNodes(0) {}
+
+		TypedExpression operator()(TypedExpression child)
+		{
+			++numNodes;
+			return dispatch(*this,child);
+		}
+
+		template<typename OpAsType>
+		DispatchResult visitCall(TypeId type,const Call* call,OpAsType opAsType)
+		{
+			if(call->op() == AnyOp::callDirect) { directCallees.push_back(call->functionIndex); }
+			return MapChildrenVisitor::visitCall(type,call,opAsType);
+		}
+	};
+
+	InliningPlan planInlining(const Module* astModule)
+	{
+		InliningPlan plan;
+		plan.isInlinedFunction.resize(astModule->functions.size(),false);
+		plan.isSmallFunction.resize(astModule->functions.size(),false);
+		plan.inlinedCallees.resize(astModule->functions.size());
+		plan.numInlinedFunctions = 0;
+		plan.numInlinedCallSites = 0;
+
+		// Measure each function, and count the call sites that call it.
+		std::vector<uintptr> functionSizes(astModule->functions.size());
+		std::vector<std::vector<uintptr>> directCallees(astModule->functions.size());
+		std::vector<uintptr> numCallSites(astModule->functions.size(),0);
+		for(uintptr functionIndex = 0;functionIndex < astModule->functions.size();++functionIndex)
+		{
+			Memory::ScopedArena scopedArena;
+			auto astFunction = astModule->functions[functionIndex];
+			InliningVisitor visitor(scopedArena,astModule,astFunction);
+			visitor(TypedExpression(astFunction->expression,astFunction->type.returnType));
+			functionSizes[functionIndex] = visitor.numNodes;
+			directCallees[functionIndex] = std::move(visitor.directCallees);
+			for(auto calleeIndex : directCallees[functionIndex]) { ++numCallSites[calleeIndex]; }
+		}
+
+		// Inline small functions into all their callers, and larger functions into their only caller. Functions that call themselves
+		// aren't inlined, since that would just unroll the recursion.
+		for(uintptr functionIndex = 0;functionIndex < astModule->functions.size();++functionIndex)
+		{
+			const uintptr size = functionSizes[functionIndex];
+			const bool isRecursive = std::find(directCallees[functionIndex].begin(),directCallees[functionIndex].end(),functionIndex) != directCallees[functionIndex].end();
+			plan.isSmallFunction[functionIndex] = !isRecursive && size <= maxSmallFunctionSize;
+			if(!isRecursive && numCallSites[functionIndex]
+			&& (size <= maxSmallFunctionSize || (numCallSites[functionIndex] == 1 && size <= maxSingleCallerFunctionSize)))
+			{
+				plan.isInlinedFunction[functionIndex] = true;
+				++plan.numInlinedFunctions;
+				plan.numInlinedCallSites += numCallSites[functionIndex];
+			}
+		}
+
+		// Record the inlined functions each function calls, without duplicates.
+		for(uintptr functionIndex = 0;functionIndex < astModule->functions.size();++functionIndex)
+		{
+			auto& inlinedCallees = plan.inlinedCallees[functionIndex];
+			for(auto calleeIndex : directCallees[functionIndex])
+			{
+				if(plan.isInlinedFunction[calleeIndex] && std::find(inlinedCallees.begin(),inlinedCallees.end(),calleeIndex) == inlinedCallees.end())
+				{ inlinedCallees.push_back(calleeIndex); }
+			}
+		}
+
+		return plan;
+	}
+}
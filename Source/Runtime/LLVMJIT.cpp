@@ -25,13 +25,53 @@ namespace LLVMJIT
 		virtual llvm::RuntimeDyld::SymbolInfo findSymbolInLogicalDylib(const std::string& name) override;
 	};
 
+	// Used to resolve references in a module's object sets: references to the module's function pointer table, references from lazy
+	// compilation stubs to the function that compiles a function on demand, and references to the module's functions from an object set
+	// that doesn't define them, which are resolved to the functions' current addresses. Other references are resolved to intrinsics.
+	struct ModuleResolver : llvm::RuntimeDyld::SymbolResolver
+	{
+		struct JITModule* jitModule;
+
+		ModuleResolver(struct JITModule* inJITModule): jitModule(inJITModule) {}
+
+		void* getSymbolAddress(const std::string& name) const;
+
+		virtual llvm::RuntimeDyld::SymbolInfo findSymbol(const std::string& name) override;
+		virtual llvm::RuntimeDyld::SymbolInfo findSymbolInLogicalDylib(const std::string& name) override;
+	};
+
 	struct JITFunction
 	{
 		std::string name;
 		uintptr baseAddress;
 		size_t size;
+		Runtime::OptimizationLevel optimizationLevel;
 	};
 
+	// An immutable index of the address ranges of all JIT functions, sorted by base address. When code is loaded, a new code map is created
+	// and atomically published, so the current code map may be read without locking. That makes lookups safe from signal handlers.
+	struct CodeMap
+	{
+		struct Entry
+		{
+			uintptr baseAddress;
+			uintptr endAddress;
+			const JITFunction* function;
+			struct JITModule* jitModule;
+
+			bool operator<(const Entry& right) const { return baseAddress < right.baseAddress; }
+		};
+		std::vector<Entry> entries;
+	};
+
+	// The current code map. Each code map that replaces it starts a new epoch, and readers are counted separately for even and odd
+	// epochs, so a replaced code map can be deleted once the readers that started in its epoch have finished. Readers that start
+	// afterward count toward the other epoch, so a stream of readers can't keep the replaced code map alive.
+	std::atomic<const CodeMap*> currentCodeMap(nullptr);
+	std::atomic<uintptr> codeMapEpoch(0);
+	std::atomic<uintptr> numCodeMapReadersByEpochParity[2];
+	Platform::Mutex codeMapUpdateMutex;
+
 	struct JITModule
 	{
 		const AST::Module* astModule;
@@ -39,19 +79,77 @@ namespace LLVMJIT
 		typedef llvm::orc::ObjectLinkingLayer<NotifyLoadedFunctor> ObjectLayer;
 		std::unique_ptr<ObjectLayer> objectLayer;
 
-		typedef llvm::orc::IRCompileLayer<ObjectLayer> CompileLayer;
-		std::unique_ptr<CompileLayer> compileLayer;
+		// The object set that holds the module's current code. If the module is compiled with tiered compilation, this is
+		// replaced with the optimized code when it is ready. The baseline code is kept until the module is unloaded: there's no way
+		// to tell when no thread is executing it anymore, since a call to a baseline function may run for the life of the process.
+		ObjectLayer::ObjSetHandleT handle;
+
+		// The functions that have been loaded for the module. This is a deque so the code map may keep pointers to its elements.
+		std::deque<JITFunction> functions;
+
+		// The address of each of the module's functions, indexed by the function's index in the AST module. This is written when the
+		// module is linked and when tiered compilation replaces the module's code, and is read without locking the module. It is also
+		// the function pointer table that code emitted with EmitOptions::callThroughFunctionPointers loads the functions' addresses from.
+		std::vector<std::atomic<void*>> functionPointers;
+
+		// Synchronizes access to the object layer, handle, and functions between the thread that loaded the module and the tier-up thread.
+		Platform::Mutex mutex;
+
+		// The thread that compiles the optimized code for the module if it was compiled with tiered compilation.
+		std::thread tierUpThread;
+
+		// Resolves the references in the module's object sets.
+		std::unique_ptr<ModuleResolver> resolver;
+
+		// If the module is compiled lazily, the object set in handle contains the lazy compilation stubs, and this holds the
+		// addresses of the functions that have been compiled on demand.
+		std::vector<void*> lazyFunctionAddresses;
+
+		// The optimization level the module's code is compiled at. With tiered compilation, this is the level of the optimized tier.
+		Runtime::OptimizationLevel optimizationLevel;
 
-		CompileLayer::ModuleSetHandleT handle;
+		// The optimization level of the code in the object set that is being added to the object layer. NotifyLoadedFunctor records it
+		// for the object set's functions.
+		Runtime::OptimizationLevel loadingOptimizationLevel;
 
-		std::vector<JITFunction> functions;
+		// The CPU the module's code is generated for. If empty, the code is generated for the host CPU.
+		std::string targetCPU;
+
+		// The options the module's LLVM IR is emitted with. If the module is instrumented, profileCounters holds the address of each function's
+		// profile counter array, or null if the function hasn't been compiled yet.
+		EmitOptions emitOptions;
+		std::vector<const uint64*> profileCounters;
+
+		// Whether the module's code and data are allocated from the memory shared by all modules that is backed by huge pages.
+		bool useHugePageCodeMemory;
+
+		// Whether the module's functions are written to the perf map and jitdump files. Functions are written once the object set they
+		// are in is finalized, so the jitdump file gets their relocated code; until then, they are kept in unwrittenPerfFunctions.
+		bool enablePerfMap;
+		bool enablePerfJITDump;
+		std::vector<const JITFunction*> unwrittenPerfFunctions;
+
+		// If the module has debug info, the object files that were registered with GDB's JIT interface. GDB identifies the objects by
+		// their buffers, so they are kept to deregister them when the module is unloaded.
+		std::vector<std::unique_ptr<llvm::object::ObjectFile>> gdbRegisteredObjects;
+
+		#ifdef _WIN32
+			// The SEH unwind info registered for the module's code.
+			std::vector<void*> sehUnwindInfos;
+		#endif
 		
-		JITModule(const AST::Module* inASTModule) : astModule(inASTModule) {}
+		JITModule(const AST::Module* inASTModule) : astModule(inASTModule), functionPointers(inASTModule->functions.size()), optimizationLevel(Runtime::OptimizationLevel::O2), loadingOptimizationLevel(Runtime::OptimizationLevel::O2), useHugePageCodeMemory(false), enablePerfMap(false), enablePerfJITDump(false) {}
 	};
 
 	// All the modules that have been JITted.
 	std::vector<JITModule*> jitModules;
 
+	// Maps an AST module to the JITModule that was compiled from it.
+	std::unordered_map<const AST::Module*,JITModule*> astModuleToJITModuleMap;
+
+	// Synchronizes access to jitModules and astModuleToJITModuleMap between threads that load and unload modules concurrently.
+	Platform::Mutex jitModulesMutex;
+
 	IntrinsicResolver IntrinsicResolver::singleton;
 	void* IntrinsicResolver::getSymbolAddress(const std::string& name) const
 	{
@@ -74,7 +172,147 @@ namespace LLVMJIT
 	{
 		return llvm::RuntimeDyld::SymbolInfo(reinterpret_cast<uint64>(getSymbolAddress(name)),llvm::JITSymbolFlags::None);
 	}
+
+	void* compileFunctionOnDemand(JITModule* jitModule,uintptr functionIndex);
+
+	// The function pointer table is read by the generated code as an array of addresses.
+	static_assert(sizeof(std::atomic<void*>) == sizeof(uintptr),"std::atomic<void*> doesn't have the layout of an address");
+
+	void* ModuleResolver::getSymbolAddress(const std::string& name) const
+	{
+		if(name == functionPointersSymbolName) { return jitModule->functionPointers.data(); }
+		if(name == lazyJITModuleSymbolName) { return jitModule; }
+		if(name == lazyCompileFunctionSymbolName) { return (void*)&compileFunctionOnDemand; }
+
+		uintptr_t functionIndex;
+		if(getFunctionIndexFromExternalName(name.c_str(),functionIndex))
+		{
+			assert(functionIndex < jitModule->functionPointers.size());
+			return jitModule->functionPointers[functionIndex].load(std::memory_order_acquire);
+		}
+
+		return IntrinsicResolver::singleton.getSymbolAddress(name);
+	}
+
+	llvm::RuntimeDyld::SymbolInfo ModuleResolver::findSymbol(const std::string& name)
+	{
+		return llvm::RuntimeDyld::SymbolInfo(reinterpret_cast<uint64>(getSymbolAddress(name)),llvm::JITSymbolFlags::None);
+	}
+
+	llvm::RuntimeDyld::SymbolInfo ModuleResolver::findSymbolInLogicalDylib(const std::string& name)
+	{
+		return llvm::RuntimeDyld::SymbolInfo(reinterpret_cast<uint64>(getSymbolAddress(name)),llvm::JITSymbolFlags::None);
+	}
 	
+	// Returns the name of a JIT function for profilers and stack traces: the name of the WebAssembly function it was compiled from
+	// if it has one, or otherwise its symbol name.
+	std::string getJITFunctionDisplayName(const JITModule* jitModule,const JITFunction& function)
+	{
+		uintptr functionIndex;
+		if(getFunctionIndexFromExternalName(function.name.c_str(),functionIndex) && functionIndex < jitModule->astModule->functions.size())
+		{
+			auto astFunction = jitModule->astModule->functions[functionIndex];
+			if(astFunction->name) { return astFunction->name; }
+		}
+		return function.name;
+	}
+
+	// Publishes a new code map, and deletes the code map it replaces once no reader can be using it. Must be called with codeMapUpdateMutex locked.
+	void replaceCodeMap(const CodeMap* newCodeMap)
+	{
+		auto oldCodeMap = currentCodeMap.load();
+		currentCodeMap.store(newCodeMap);
+
+		// Start a new epoch, and wait for the readers that started in the old epoch, which may have loaded the old code map. Readers
+		// that start in the new epoch load the new code map, and readers only hold a code map while looking up an instruction pointer,
+		// so this doesn't wait long.
+		const uintptr oldEpoch = codeMapEpoch.load();
+		codeMapEpoch.store(oldEpoch + 1);
+		while(numCodeMapReadersByEpochParity[oldEpoch & 1].load() != 0) { std::this_thread::yield(); }
+		delete oldCodeMap;
+	}
+
+	// Adds a set of newly loaded functions to the code map, and publishes the new code map.
+	void addToCodeMap(JITModule* jitModule,const std::vector<const JITFunction*>& newFunctions)
+	{
+		// Sort the entries for the new functions, and merge them with the old code map's sorted entries into a new code map.
+		std::vector<CodeMap::Entry> newEntries;
+		for(auto function : newFunctions)
+		{
+			CodeMap::Entry entry;
+			entry.baseAddress = function->baseAddress;
+			entry.endAddress = function->baseAddress + function->size;
+			entry.function = function;
+			entry.jitModule = jitModule;
+			newEntries.push_back(entry);
+		}
+		std::sort(newEntries.begin(),newEntries.end());
+
+		Platform::Lock updateLock(codeMapUpdateMutex);
+		auto oldCodeMap = currentCodeMap.load();
+		auto newCodeMap = new CodeMap();
+		if(!oldCodeMap) { newCodeMap->entries = std::move(newEntries); }
+		else
+		{
+			newCodeMap->entries.reserve(oldCodeMap->entries.size() + newEntries.size());
+			std::merge(oldCodeMap->entries.begin(),oldCodeMap->entries.end(),newEntries.begin(),newEntries.end(),std::back_inserter(newCodeMap->entries));
+		}
+		replaceCodeMap(newCodeMap);
+	}
+
+	// Removes a module's functions from the code map, and publishes the new code map. When this returns, no reader is using a code map
+	// that contains the module's functions, so they may be freed.
+	void removeFromCodeMap(JITModule* jitModule)
+	{
+		Platform::Lock updateLock(codeMapUpdateMutex);
+		auto oldCodeMap = currentCodeMap.load();
+		if(!oldCodeMap) { return; }
+		auto newCodeMap = new CodeMap();
+		for(auto& entry : oldCodeMap->entries) { if(entry.jitModule != jitModule) { newCodeMap->entries.push_back(entry); } }
+		replaceCodeMap(newCodeMap);
+	}
+
+	// Code map entries may only be read while a CodeMapReadScope exists, which ensures the code map they are in isn't deleted. It counts
+	// the reader toward the current epoch. If the epoch changes while it's being counted, it counts the reader toward the new epoch instead,
+	// since the writer that started the new epoch may not have seen it.
+	struct CodeMapReadScope
+	{
+		uintptr epoch;
+
+		CodeMapReadScope()
+		{
+			while(true)
+			{
+				epoch = codeMapEpoch.load();
+				++numCodeMapReadersByEpochParity[epoch & 1];
+				if(codeMapEpoch.load() == epoch) { break; }
+				--numCodeMapReadersByEpochParity[epoch & 1];
+			}
+		}
+		~CodeMapReadScope() { --numCodeMapReadersByEpochParity[epoch & 1]; }
+	};
+
+	// Finds the code map entry for the function containing an instruction pointer. This doesn't allocate memory or lock, so it may be
+	// called from a signal handler. The CodeMapReadScope parameter ensures the caller keeps the code map alive while using the entry.
+	const CodeMap::Entry* findCodeMapEntry(const CodeMapReadScope&,uintptr ip)
+	{
+		auto codeMap = currentCodeMap.load();
+		if(!codeMap || !codeMap->entries.size()) { return nullptr; }
+
+		// Find the last entry with a base address <= ip.
+		uintptr minIndex = 0;
+		uintptr maxIndex = codeMap->entries.size();
+		while(maxIndex - minIndex > 1)
+		{
+			const uintptr midIndex = minIndex + (maxIndex - minIndex) / 2;
+			if(codeMap->entries[midIndex].baseAddress <= ip) { minIndex = midIndex; }
+			else { maxIndex = midIndex; }
+		}
+
+		const CodeMap::Entry& entry = codeMap->entries[minIndex];
+		return ip >= entry.baseAddress && ip < entry.endAddress ? &entry : nullptr;
+	}
+
 	void NotifyLoadedFunctor::operator()(
 		const llvm::orc::ObjectLinkingLayerBase::ObjSetHandleT& objectSetHandle,
 		const std::vector<std::unique_ptr<llvm::object::ObjectFile>>& objectSet,
@@ -82,6 +320,7 @@ namespace LLVMJIT
 		)
 	{
 		assert(objectSet.size() == loadResult.size());
+		std::vector<const JITFunction*> newFunctions;
 		for(uintptr objectIndex = 0;objectIndex < loadResult.size();++objectIndex)
 		{
 			auto& object = objectSet[objectIndex];
@@ -110,7 +349,8 @@ namespace LLVMJIT
 					}
 
 					// Save the address range this function was loaded at for future address->symbol lookups.
-					jitModule->functions.push_back({*name,loadedAddress,symbolSizePair.second});
+					jitModule->functions.push_back({*name,loadedAddress,symbolSizePair.second,jitModule->loadingOptimizationLevel});
+					newFunctions.push_back(&jitModule->functions.back());
 				}
 			}
 			
@@ -133,24 +373,213 @@ namespace LLVMJIT
 						}
 					}
 
-					RuntimePlatform::registerSEHUnwindInfo(
+					auto unwindInfo = RuntimePlatform::registerSEHUnwindInfo(
 						(uintptr)textLoadAddr,
 						(uintptr)xdataLoadAddr,
 						(uintptr)pdataLoadAddr,
 						pdataSection.getSize()
 						);
+					jitModule->sehUnwindInfos.push_back(unwindInfo);
 				}
 			#endif
 		}
+
+		// Register the objects' debug info with GDB's JIT interface.
+		if(jitModule->emitOptions.emitDebugInfo)
+		{
+			for(uintptr objectIndex = 0;objectIndex < loadResult.size();++objectIndex)
+			{ llvm::JITEventListener::createGDBRegistrationListener()->NotifyObjectEmitted(*objectSet[objectIndex],*loadResult[objectIndex]); }
+		}
+
+		if(jitModule->enablePerfMap || jitModule->enablePerfJITDump)
+		{ jitModule->unwrittenPerfFunctions.insert(jitModule->unwrittenPerfFunctions.end(),newFunctions.begin(),newFunctions.end()); }
+
+		addToCodeMap(jitModule,newFunctions);
 	}
 
-	bool compileModule(const AST::Module* astModule)
+	// The name and features of the host CPU. They are only looked up once, since that queries the CPU and OS.
+	struct HostCPU
 	{
-		auto llvmModule = emitModule(astModule);
-		
-		// Get a target machine object for this host, and set the module to use its data layout.
-		auto targetMachine = llvm::EngineBuilder().selectTarget(llvm::Triple(llvm::sys::getProcessTriple()),"","",llvm::SmallVector<std::string,0>());
-		llvmModule->setDataLayout(targetMachine->createDataLayout());
+		std::string name;
+		llvm::SmallVector<std::string,0> attributes;
+
+		HostCPU(): name(llvm::sys::getHostCPUName())
+		{
+			llvm::StringMap<bool> hostFeatures;
+			if(llvm::sys::getHostCPUFeatures(hostFeatures))
+			{
+				for(auto& feature : hostFeatures) { attributes.push_back((feature.getValue() ? "+" : "-") + feature.getKey().str()); }
+
+				// Sort the features so the feature string, which is part of the object cache key, doesn't depend on the map's iteration order.
+				std::sort(attributes.begin(),attributes.end());
+			}
+		}
+
+		static const HostCPU& get()
+		{
+			// It's never destroyed, since tier-up threads that are still running at exit use it until shutdown joins them.
+			static HostCPU* hostCPU = new HostCPU();
+			return *hostCPU;
+		}
+	};
+
+	// Creates a target machine object for the host.
+	// If targetCPU is empty, the code is generated for the host CPU and all the features it supports. Otherwise, the code is generated for the
+	// named CPU model and the features it implies, so the same code is generated regardless of which machine in a fleet compiles it.
+	std::unique_ptr<llvm::TargetMachine> createHostTargetMachine(const std::string& targetCPU,llvm::CodeGenOpt::Level codeGenOptLevel = llvm::CodeGenOpt::Default)
+	{
+		if(targetCPU.size()) { return std::unique_ptr<llvm::TargetMachine>(llvm::EngineBuilder().setOptLevel(codeGenOptLevel).selectTarget(llvm::Triple(llvm::sys::getProcessTriple()),"",targetCPU,llvm::SmallVector<std::string,0>())); }
+		const HostCPU& hostCPU = HostCPU::get();
+		return std::unique_ptr<llvm::TargetMachine>(llvm::EngineBuilder().setOptLevel(codeGenOptLevel).selectTarget(llvm::Triple(llvm::sys::getProcessTriple()),"",hostCPU.name,hostCPU.attributes));
+	}
+
+	// Returns the code generator optimization level used for an optimization level.
+	llvm::CodeGenOpt::Level getCodeGenOptLevel(Runtime::OptimizationLevel optimizationLevel)
+	{
+		switch(optimizationLevel)
+		{
+		case Runtime::OptimizationLevel::O0: return llvm::CodeGenOpt::None;
+		case Runtime::OptimizationLevel::O1: return llvm::CodeGenOpt::Less;
+		case Runtime::OptimizationLevel::O2: return llvm::CodeGenOpt::Default;
+		case Runtime::OptimizationLevel::O3: return llvm::CodeGenOpt::Aggressive;
+		case Runtime::OptimizationLevel::Os: return llvm::CodeGenOpt::Default;
+		default: throw;
+		}
+	}
+
+	// Configures a pass manager builder for an optimization level other than O0.
+	void configurePassManagerBuilder(Runtime::OptimizationLevel optimizationLevel,llvm::PassManagerBuilder& passManagerBuilder)
+	{
+		switch(optimizationLevel)
+		{
+		case Runtime::OptimizationLevel::O1: passManagerBuilder.OptLevel = 1; passManagerBuilder.SizeLevel = 0; break;
+		case Runtime::OptimizationLevel::O2: passManagerBuilder.OptLevel = 2; passManagerBuilder.SizeLevel = 0; break;
+		case Runtime::OptimizationLevel::O3: passManagerBuilder.OptLevel = 3; passManagerBuilder.SizeLevel = 0; break;
+		case Runtime::OptimizationLevel::Os: passManagerBuilder.OptLevel = 2; passManagerBuilder.SizeLevel = 1; break;
+		default: throw;
+		}
+		passManagerBuilder.LoopVectorize = passManagerBuilder.OptLevel > 1 && passManagerBuilder.SizeLevel == 0;
+		passManagerBuilder.SLPVectorize = passManagerBuilder.OptLevel > 1 && passManagerBuilder.SizeLevel == 0;
+	}
+
+	// Adds the standard LLVM function optimization pipeline for an optimization level to a function pass manager.
+	void populateFunctionPassManager(Runtime::OptimizationLevel optimizationLevel,llvm::TargetMachine& targetMachine,llvm::legacy::FunctionPassManager& functionPassManager)
+	{
+		// The emitter constructs SSA form directly, so the baseline code doesn't need any function passes.
+		if(optimizationLevel == Runtime::OptimizationLevel::O0) { return; }
+
+		// Give the target-specific cost model to the passes that use it, like the SLP vectorizer.
+		functionPassManager.add(llvm::createTargetTransformInfoWrapperPass(targetMachine.getTargetIRAnalysis()));
+
+		llvm::PassManagerBuilder passManagerBuilder;
+		configurePassManagerBuilder(optimizationLevel,passManagerBuilder);
+		passManagerBuilder.populateFunctionPassManager(functionPassManager);
+	}
+
+	// Adds the standard LLVM module optimization pipeline for an optimization level to a module pass manager.
+	void populateModulePassManager(Runtime::OptimizationLevel optimizationLevel,llvm::TargetMachine& targetMachine,llvm::legacy::PassManager& modulePassManager)
+	{
+		if(optimizationLevel == Runtime::OptimizationLevel::O0) { return; }
+
+		// Give the target-specific cost model to the passes that use it, like the loop vectorizer.
+		modulePassManager.add(llvm::createTargetTransformInfoWrapperPass(targetMachine.getTargetIRAnalysis()));
+
+		llvm::PassManagerBuilder passManagerBuilder;
+		configurePassManagerBuilder(optimizationLevel,passManagerBuilder);
+		passManagerBuilder.Inliner = llvm::createFunctionInliningPass(passManagerBuilder.OptLevel,passManagerBuilder.SizeLevel);
+		passManagerBuilder.populateModulePassManager(modulePassManager);
+	}
+
+	// A target machine and module optimization pipeline for an optimization level and target CPU. They are expensive to create relative
+	// to compiling a small module, so they are kept in a pool and reused by later compilations. A compiler is only used by one thread at
+	// a time. The function pass manager is still created for each module, since it is bound to the module it optimizes.
+	struct PartitionCompiler
+	{
+		Runtime::OptimizationLevel optimizationLevel;
+		std::string targetCPU;
+		std::unique_ptr<llvm::TargetMachine> targetMachine;
+		llvm::legacy::PassManager modulePassManager;
+
+		PartitionCompiler(Runtime::OptimizationLevel inOptimizationLevel,const std::string& inTargetCPU)
+		: optimizationLevel(inOptimizationLevel), targetCPU(inTargetCPU), targetMachine(createHostTargetMachine(inTargetCPU,getCodeGenOptLevel(inOptimizationLevel)))
+		{
+			populateModulePassManager(optimizationLevel,*targetMachine,modulePassManager);
+		}
+	};
+
+	// The compilers that aren't being used by any thread. Only accessed with idlePartitionCompilersMutex locked.
+	std::vector<std::unique_ptr<PartitionCompiler>> idlePartitionCompilers;
+	Platform::Mutex idlePartitionCompilersMutex;
+
+	// Takes an idle compiler for the optimization level and target CPU from the pool, or creates a new one if there aren't any.
+	std::unique_ptr<PartitionCompiler> acquirePartitionCompiler(Runtime::OptimizationLevel optimizationLevel,const std::string& targetCPU)
+	{
+		{
+			Platform::Lock idlePartitionCompilersLock(idlePartitionCompilersMutex);
+			for(auto compilerIt = idlePartitionCompilers.begin();compilerIt != idlePartitionCompilers.end();++compilerIt)
+			{
+				if((*compilerIt)->optimizationLevel == optimizationLevel && (*compilerIt)->targetCPU == targetCPU)
+				{
+					auto compiler = std::move(*compilerIt);
+					idlePartitionCompilers.erase(compilerIt);
+					return compiler;
+				}
+			}
+		}
+		return llvm::make_unique<PartitionCompiler>(optimizationLevel,targetCPU);
+	}
+
+	// Returns a compiler to the pool once the thread that acquired it is done with it.
+	void releasePartitionCompiler(std::unique_ptr<PartitionCompiler>&& compiler)
+	{
+		Platform::Lock idlePartitionCompilersLock(idlePartitionCompilersMutex);
+		idlePartitionCompilers.push_back(std::move(compiler));
+	}
+
+	// A subset of a module's functions that is optimized and compiled to machine code independently of the rest of the module.
+	struct ModulePartition
+	{
+		std::vector<uintptr> functionIndices;
+		llvm::SmallVector<char,0> bitcode;
+		llvm::object::OwningBinary<llvm::object::ObjectFile> object;
+		bool succeeded;
+
+		// The number of LLVM IR instructions in the partition before and after optimization, and the time spent compiling it.
+		uintptr numEmittedInstructions;
+		uintptr numOptimizedInstructions;
+		uintptr numSpeculatedCallSites;
+		float64 optimizeMilliseconds;
+		float64 codeGenMilliseconds;
+
+		ModulePartition(): succeeded(false), numEmittedInstructions(0), numOptimizedInstructions(0), numSpeculatedCallSites(0), optimizeMilliseconds(0.0), codeGenMilliseconds(0.0) {}
+	};
+
+	// Counts the LLVM IR instructions in a module.
+	uintptr countInstructions(const llvm::Module& llvmModule)
+	{
+		uintptr numInstructions = 0;
+		for(auto& function : llvmModule)
+		{
+			for(auto& basicBlock : function) { numInstructions += basicBlock.size(); }
+		}
+		return numInstructions;
+	}
+
+	// Sums the sizes of a set of object files.
+	uintptr countObjectBytes(const std::vector<std::unique_ptr<llvm::MemoryBuffer>>& objectBuffers)
+	{
+		uintptr numObjectBytes = 0;
+		for(auto& objectBuffer : objectBuffers) { numObjectBytes += objectBuffer->getBufferSize(); }
+		return numObjectBytes;
+	}
+
+	// Emits the LLVM IR for a module partition, and serializes it to the partition's bitcode. Returns false if the IR fails verification.
+	// This may be called on any thread: the IR is emitted in a pooled LLVM context that no other thread is using.
+	bool emitPartition(const AST::Module* astModule,const EmitOptions& emitOptions,ModulePartition& partition)
+	{
+		auto emitContext = acquireEmitContext();
+		auto llvmModule = std::unique_ptr<llvm::Module>(emitModule(*emitContext,astModule,partition.functionIndices,emitOptions,&partition.numSpeculatedCallSites));
+		partition.numEmittedInstructions = countInstructions(*llvmModule);
 
 		// Verify the module.
 		#ifdef _DEBUG
@@ -166,38 +595,563 @@ namespace LLVMJIT
 			}
 		#endif
 
-		// Run some optimization on the module's functions.
-		Core::Timer optimizationTimer;
-
-		auto fpm = new llvm::legacy::FunctionPassManager(llvmModule);
-		fpm->add(llvm::createPromoteMemoryToRegisterPass());
-		fpm->add(llvm::createInstructionCombiningPass());
-		fpm->add(llvm::createCFGSimplificationPass());
-		fpm->add(llvm::createJumpThreadingPass());
-		fpm->add(llvm::createConstantPropagationPass());
-		fpm->doInitialization();
-		fpm->doInitialization();
-		for(auto functionIt = llvmModule->begin();functionIt != llvmModule->end();++functionIt)
-		{ fpm->run(*functionIt); }
-		delete fpm;
-
-		std::cout << "Optimized LLVM code in " << optimizationTimer.getMilliseconds() << "ms" << std::endl;
-
-		// Pass the module to the JIT compiler.
-		Core::Timer machineCodeTimer;
-		std::vector<llvm::Module*> moduleSet;
-		moduleSet.push_back(llvmModule);
-
-		// Construct the JIT module and compile layers.
+		// Serialize the partition's IR so it can be read into the worker thread's LLVM context.
+		llvm::raw_svector_ostream bitcodeStream(partition.bitcode);
+		llvm::WriteBitcodeToFile(llvmModule.get(),bitcodeStream);
+		bitcodeStream.flush();
+
+		// Delete the module before the context is returned to the pool, since another thread may use the context as soon as it is.
+		llvmModule.reset();
+		releaseEmitContext(std::move(emitContext));
+		return true;
+	}
+
+	// Optimizes and generates machine code for a module partition. This may be called on any thread: the partition's IR is read
+	// from its bitcode into a LLVM context that is private to this call, and compiled with a pooled compiler that no other thread is using.
+	void compilePartition(ModulePartition& partition,Runtime::OptimizationLevel optimizationLevel,const std::string& targetCPU)
+	{
+		partition.succeeded = false;
+
+		llvm::LLVMContext partitionContext;
+		auto llvmModuleOrError = llvm::parseBitcodeFile(llvm::MemoryBufferRef(llvm::StringRef(partition.bitcode.data(),partition.bitcode.size()),""),partitionContext);
+		if(!llvmModuleOrError) { return; }
+		auto llvmModule = std::move(*llvmModuleOrError);
+
+		// Get a compiler for this host from the pool, and set the module to use its target machine's data layout.
+		auto compiler = acquirePartitionCompiler(optimizationLevel,targetCPU);
+		llvmModule->setDataLayout(compiler->targetMachine->createDataLayout());
+
+		// Optimize the module's functions, and then the module as a whole.
+		Core::Timer optimizeTimer;
+		{
+			llvm::legacy::FunctionPassManager functionPassManager(llvmModule.get());
+			populateFunctionPassManager(optimizationLevel,*compiler->targetMachine,functionPassManager);
+			functionPassManager.doInitialization();
+			for(auto functionIt = llvmModule->begin();functionIt != llvmModule->end();++functionIt)
+			{ functionPassManager.run(*functionIt); }
+			functionPassManager.doFinalization();
+		}
+		compiler->modulePassManager.run(*llvmModule);
+		partition.optimizeMilliseconds = optimizeTimer.getMilliseconds();
+		partition.numOptimizedInstructions = countInstructions(*llvmModule);
+
+		// Generate machine code for the module.
+		Core::Timer codeGenTimer;
+		partition.object = llvm::orc::SimpleCompiler(*compiler->targetMachine)(*llvmModule);
+		partition.codeGenMilliseconds = codeGenTimer.getMilliseconds();
+		releasePartitionCompiler(std::move(compiler));
+		partition.succeeded = partition.object.getBinary() != nullptr;
+	}
+
+	// Takes the object code generated for a set of module partitions. Returns false if any of the partitions failed to compile.
+	bool takePartitionObjects(std::vector<ModulePartition>& partitions,std::vector<std::unique_ptr<llvm::MemoryBuffer>>& outObjectBuffers)
+	{
+		for(auto& partition : partitions)
+		{
+			if(!partition.succeeded)
+			{
+				std::cerr << "Failed to generate machine code for module partition" << std::endl;
+				return false;
+			}
+			outObjectBuffers.push_back(std::move(partition.object.takeBinary().second));
+		}
+		return true;
+	}
+
+	// Adds a set of object files with code compiled at the given optimization level to a JIT module's object layer, and returns a handle
+	// to the object set.
+	JITModule::ObjectLayer::ObjSetHandleT addObjectSet(JITModule* jitModule,std::vector<std::unique_ptr<llvm::MemoryBuffer>>&& objectBuffers,Runtime::OptimizationLevel optimizationLevel)
+	{
+		std::vector<std::unique_ptr<llvm::object::ObjectFile>> objects;
+		for(auto& objectBuffer : objectBuffers)
+		{
+			auto objectOrError = llvm::object::ObjectFile::createObjectFile(objectBuffer->getMemBufferRef());
+			if(!objectOrError) { throw; }
+			objects.push_back(std::move(*objectOrError));
+		}
+
+		// Link all the objects into a single object set, so references between the module's partitions are resolved within it.
+		jitModule->loadingOptimizationLevel = optimizationLevel;
+		auto handle = jitModule->objectLayer->addObjectSet(objects,createMemoryManager(jitModule->useHugePageCodeMemory),jitModule->resolver.get());
+		jitModule->objectLayer->takeOwnershipOfBuffers(handle,std::move(objectBuffers));
+		if(jitModule->emitOptions.emitDebugInfo)
+		{
+			for(auto& object : objects) { jitModule->gdbRegisteredObjects.push_back(std::move(object)); }
+		}
+		return handle;
+	}
+
+	// Writes the functions that have been loaded for a module since the last call to the perf map and jitdump files. The object sets
+	// the functions are in must be finalized.
+	void writePerfSymbols(JITModule* jitModule)
+	{
+		#ifdef __linux__
+			for(auto function : jitModule->unwrittenPerfFunctions)
+			{
+				const std::string displayName = getJITFunctionDisplayName(jitModule,*function);
+				if(jitModule->enablePerfMap) { RuntimePlatform::writePerfMapSymbol(function->baseAddress,function->size,displayName); }
+				if(jitModule->enablePerfJITDump) { RuntimePlatform::writePerfJITDumpSymbol(function->baseAddress,function->size,displayName); }
+			}
+		#endif
+		jitModule->unwrittenPerfFunctions.clear();
+	}
+
+	// Looks up the addresses of a module's functions in its current object set, and saves them in the module's function pointer table.
+	// This finalizes the object set if it wasn't already, so it must be called with the module's mutex locked if another thread may access it.
+	void resolveFunctionPointers(JITModule* jitModule)
+	{
+		for(uintptr functionIndex = 0;functionIndex < jitModule->functionPointers.size();++functionIndex)
+		{
+			auto functionAddress = jitModule->objectLayer->findSymbolIn(jitModule->handle,getExternalFunctionName(functionIndex),false).getAddress();
+			jitModule->functionPointers[functionIndex].store((void*)functionAddress,std::memory_order_release);
+		}
+
+		if(jitModule->emitOptions.instrumentProfile)
+		{
+			jitModule->profileCounters.resize(jitModule->functionPointers.size(),nullptr);
+			for(uintptr functionIndex = 0;functionIndex < jitModule->profileCounters.size();++functionIndex)
+			{
+				auto countersAddress = jitModule->objectLayer->findSymbolIn(jitModule->handle,getProfileCountersName(functionIndex),false).getAddress();
+				if(countersAddress) { jitModule->profileCounters[functionIndex] = (const uint64*)countersAddress; }
+			}
+		}
+
+		writePerfSymbols(jitModule);
+	}
+
+	// Links a module's object files, which hold code compiled at codeOptimizationLevel, into a new JITModule. If isLazy is true, the object
+	// files contain the module's lazy compilation stubs.
+	JITModule* linkModule(
+		const AST::Module* astModule,
+		std::vector<std::unique_ptr<llvm::MemoryBuffer>>&& objectBuffers,
+		const Runtime::CompileOptions& options,
+		const EmitOptions& emitOptions,
+		Runtime::OptimizationLevel codeOptimizationLevel,
+		Runtime::CompileStats& outStats,
+		bool isLazy = false
+		)
+	{
+		Core::Timer linkTimer;
+		outStats.numObjectBytes = countObjectBytes(objectBuffers);
+
 		auto jitModule = new JITModule(astModule);
-		jitModules.push_back(jitModule);
+		jitModule->optimizationLevel = options.optimizationLevel;
+		jitModule->targetCPU = options.targetCPU ? options.targetCPU : "";
+		jitModule->emitOptions = emitOptions;
+		jitModule->useHugePageCodeMemory = options.enableHugePageCodeMemory;
+		jitModule->enablePerfMap = options.enablePerfMap;
+		jitModule->enablePerfJITDump = options.enablePerfJITDump;
 		jitModule->objectLayer = llvm::make_unique<JITModule::ObjectLayer>(NotifyLoadedFunctor(jitModule));
-		jitModule->compileLayer = llvm::make_unique<JITModule::CompileLayer>(*jitModule->objectLayer,llvm::orc::SimpleCompiler(*targetMachine));
+		jitModule->resolver = llvm::make_unique<ModuleResolver>(jitModule);
+		if(isLazy) { jitModule->lazyFunctionAddresses.resize(astModule->functions.size(),nullptr); }
 
-		// Compile the module.
-		jitModule->handle = jitModule->compileLayer->addModuleSet(moduleSet,llvm::make_unique<llvm::SectionMemoryManager>(),&IntrinsicResolver::singleton);
-		std::cout << "Generated machine code in " << machineCodeTimer.getMilliseconds() << "ms" << std::endl;
-		
+		jitModule->handle = addObjectSet(jitModule,std::move(objectBuffers),codeOptimizationLevel);
+		resolveFunctionPointers(jitModule);
+		{
+			Platform::Lock jitModulesLock(jitModulesMutex);
+			jitModules.push_back(jitModule);
+			astModuleToJITModuleMap[astModule] = jitModule;
+		}
+
+		outStats.numCodeBytes = 0;
+		for(auto& function : jitModule->functions) { outStats.numCodeBytes += function.size; }
+		outStats.linkMilliseconds = linkTimer.getMilliseconds();
+		return jitModule;
+	}
+
+	// Compiles a function in a lazily compiled module, and returns its address. This is called by the function's lazy compilation stub
+	// the first time it is called. The stub saves the returned address, but this may still be called more than once for a function
+	// if multiple threads call it concurrently before it is compiled. The address is also written to the module's function pointers,
+	// so invokes, and functions that are compiled later, call the compiled function instead of the stub.
+	void* compileFunctionOnDemand(JITModule* jitModule,uintptr functionIndex)
+	{
+		// Check whether another thread has already compiled the function, and copy the options to compile it with.
+		EmitOptions emitOptions;
+		{
+			Platform::Lock lock(jitModule->mutex);
+			assert(functionIndex < jitModule->lazyFunctionAddresses.size());
+			if(jitModule->lazyFunctionAddresses[functionIndex]) { return jitModule->lazyFunctionAddresses[functionIndex]; }
+			emitOptions = jitModule->emitOptions;
+		}
+
+		// Emit and compile the function without locking the module, so other threads can compile other functions at the same time.
+		ModulePartition partition;
+		partition.functionIndices.push_back(functionIndex);
+		if(!emitPartition(jitModule->astModule,emitOptions,partition)) { throw; }
+		compilePartition(partition,jitModule->optimizationLevel,jitModule->targetCPU);
+		if(!partition.succeeded) { throw; }
+
+		// If another thread compiled the function while this thread was compiling it, use that thread's code and discard this thread's.
+		Platform::Lock lock(jitModule->mutex);
+		void*& functionAddress = jitModule->lazyFunctionAddresses[functionIndex];
+		if(!functionAddress)
+		{
+			// Link the function in its own object set. Its references to other functions in the module are resolved to their stubs,
+			// or to their code if they have been compiled.
+			std::vector<std::unique_ptr<llvm::MemoryBuffer>> objectBuffers;
+			objectBuffers.push_back(std::move(partition.object.takeBinary().second));
+			auto handle = addObjectSet(jitModule,std::move(objectBuffers),jitModule->optimizationLevel);
+			functionAddress = (void*)jitModule->objectLayer->findSymbolIn(handle,getExternalFunctionName(functionIndex),false).getAddress();
+			if(jitModule->emitOptions.instrumentProfile)
+			{ jitModule->profileCounters[functionIndex] = (const uint64*)jitModule->objectLayer->findSymbolIn(handle,getProfileCountersName(functionIndex),false).getAddress(); }
+			writePerfSymbols(jitModule);
+			jitModule->functionPointers[functionIndex].store(functionAddress,std::memory_order_release);
+		}
+		return functionAddress;
+	}
+
+	// Compiles the lazy compilation stubs for a module, and links them into a new JITModule.
+	bool compileLazyModule(const AST::Module* astModule,const Runtime::CompileOptions& options,const EmitOptions& emitOptions,Runtime::CompileStats& outStats)
+	{
+		Core::Timer emitTimer;
+		ModulePartition stubPartition;
+		auto emitContext = acquireEmitContext();
+		auto llvmModule = std::unique_ptr<llvm::Module>(emitLazyStubModule(*emitContext,astModule));
+		outStats.numEmittedInstructions = countInstructions(*llvmModule);
+		llvm::raw_svector_ostream bitcodeStream(stubPartition.bitcode);
+		llvm::WriteBitcodeToFile(llvmModule.get(),bitcodeStream);
+		bitcodeStream.flush();
+		llvmModule.reset();
+		releaseEmitContext(std::move(emitContext));
+		outStats.emitMilliseconds = emitTimer.getMilliseconds();
+
+		compilePartition(stubPartition,Runtime::OptimizationLevel::O0,options.targetCPU ? options.targetCPU : "");
+		if(!stubPartition.succeeded)
+		{
+			std::cerr << "Failed to generate machine code for lazy compilation stubs" << std::endl;
+			return false;
+		}
+		outStats.codeSource = Runtime::CompileStats::CodeSource::LazyStubs;
+		outStats.numThreads = 1;
+		outStats.numOptimizedInstructions = stubPartition.numOptimizedInstructions;
+		outStats.optimizeMilliseconds = stubPartition.optimizeMilliseconds;
+		outStats.codeGenMilliseconds = stubPartition.codeGenMilliseconds;
+
+		std::vector<std::unique_ptr<llvm::MemoryBuffer>> objectBuffers;
+		objectBuffers.push_back(std::move(stubPartition.object.takeBinary().second));
+		linkModule(astModule,std::move(objectBuffers),options,emitOptions,Runtime::OptimizationLevel::O0,outStats,true);
+		return true;
+	}
+
+	// Returns the key that identifies the object code generated for a module with the given options.
+	std::string getModuleObjectKey(const AST::Module* astModule,const Runtime::CompileOptions& options,const EmitOptions& emitOptions)
+	{
+		// The profile is identified by the contents of its file, so the key doesn't depend on the profile being loaded.
+		std::string optimizationSettings = Runtime::describeOptimizationLevel(options.optimizationLevel);
+		if(emitOptions.instrumentProfile) { optimizationSettings += ",instrumented"; }
+		else if(options.profileFilePath) { optimizationSettings += ",profile=" + getFileHash(options.profileFilePath); }
+		if(emitOptions.emitDebugInfo) { optimizationSettings += ",debuginfo=" + emitOptions.sourcePath + ":" + getModuleLociHash(astModule); }
+		if(emitOptions.checkBounds) { optimizationSettings += ",boundschecks"; }
+
+		// Describe the target the same way createHostTargetMachine does, so the key doesn't depend on creating a target machine.
+		const std::string targetCPU = options.targetCPU ? options.targetCPU : "";
+		if(targetCPU.size()) { return getModuleObjectKey(astModule,llvm::sys::getProcessTriple(),targetCPU,"",optimizationSettings.c_str()); }
+		const HostCPU& hostCPU = HostCPU::get();
+		std::string hostFeatures;
+		for(auto& attribute : hostCPU.attributes) { hostFeatures += (hostFeatures.size() ? "," : "") + attribute; }
+		return getModuleObjectKey(astModule,llvm::sys::getProcessTriple(),hostCPU.name,hostFeatures,optimizationSettings.c_str());
+	}
+
+	// Inline small and single-caller functions into their callers, unless the module is unoptimized or instrumented. The copies of
+	// inlined functions in an instrumented module would each define the function's profile counters.
+	std::shared_ptr<const InliningPlan> getInliningPlan(const AST::Module* astModule,Runtime::OptimizationLevel optimizationLevel,bool instrumentProfile)
+	{
+		if(optimizationLevel == Runtime::OptimizationLevel::O0 || instrumentProfile) { return nullptr; }
+		return std::make_shared<InliningPlan>(planInlining(astModule));
+	}
+
+	// Determines the options for emitting a module's LLVM IR from the options it is compiled with. If isPrecompiled is true, the options
+	// are only used to link the module's precompiled code, so the module's profile isn't loaded and its inlining isn't planned.
+	EmitOptions getEmitOptions(const AST::Module* astModule,const Runtime::CompileOptions& options,bool isPrecompiled = false)
+	{
+		EmitOptions emitOptions;
+		emitOptions.instrumentProfile = options.enableProfileInstrumentation;
+		emitOptions.emitDebugInfo = options.enableDebugInfo;
+		emitOptions.checkBounds = options.enableBoundsChecks;
+		if(options.sourcePath) { emitOptions.sourcePath = options.sourcePath; }
+		if(isPrecompiled) { return emitOptions; }
+
+		if(options.profileFilePath && !options.enableProfileInstrumentation)
+		{
+			auto profile = std::make_shared<ModuleProfile>();
+			if(loadModuleProfile(options.profileFilePath,astModule,*profile)) { emitOptions.profile = profile; }
+		}
+		emitOptions.inliningPlan = getInliningPlan(astModule,options.optimizationLevel,options.enableProfileInstrumentation);
+		return emitOptions;
+	}
+
+	// Generates machine code for all of a module's functions. The module's functions are split into partitions that are optimized and
+	// compiled in parallel. The statistics of the emission and compilation are added to outStats.
+	bool generateModuleObjects(
+		const AST::Module* astModule,
+		const EmitOptions& emitOptions,
+		Runtime::OptimizationLevel optimizationLevel,
+		const std::string& targetCPU,
+		std::vector<std::unique_ptr<llvm::MemoryBuffer>>& outObjectBuffers,
+		Runtime::CompileStats& outStats
+		)
+	{
+		std::vector<ModulePartition> partitions;
+
+		// Split the module's functions into one partition per hardware thread, so they can be optimized and compiled in parallel.
+		// Functions are assigned to partitions round-robin, which balances the partition sizes well enough for large modules.
+		size_t numPartitions = llvm::llvm_is_multithreaded() ? std::max(1u,std::thread::hardware_concurrency()) : 1;
+		numPartitions = std::max((size_t)1,std::min(numPartitions,astModule->functions.size()));
+		partitions.resize(numPartitions);
+		for(uintptr functionIndex = 0;functionIndex < astModule->functions.size();++functionIndex)
+		{ partitions[functionIndex % numPartitions].functionIndices.push_back(functionIndex); }
+
+		// Emit the LLVM IR for each partition on this thread, and hand each partition off to a worker thread as soon as it is emitted
+		// so the emission overlaps with compilation. Other threads may be loading other modules at the same time: each uses its own
+		// pooled emit context and compilers.
+		Core::Timer emitTimer;
+		std::vector<std::thread> workerThreads;
+		for(auto& partition : partitions)
+		{
+			if(!emitPartition(astModule,emitOptions,partition))
+			{
+				for(auto& workerThread : workerThreads) { workerThread.join(); }
+				return false;
+			}
+			workerThreads.push_back(std::thread(compilePartition,std::ref(partition),optimizationLevel,targetCPU));
+		}
+		outStats.emitMilliseconds = emitTimer.getMilliseconds();
+
+		// Wait for the worker threads to finish compiling the partitions.
+		for(auto& workerThread : workerThreads) { workerThread.join(); }
+
+		outStats.codeSource = Runtime::CompileStats::CodeSource::Generated;
+		outStats.optimizationLevel = optimizationLevel;
+		outStats.numThreads = numPartitions;
+		if(emitOptions.inliningPlan)
+		{
+			outStats.numInlinedFunctions = emitOptions.inliningPlan->numInlinedFunctions;
+			outStats.numInlinedCallSites = emitOptions.inliningPlan->numInlinedCallSites;
+		}
+		for(auto& partition : partitions)
+		{
+			outStats.numEmittedInstructions += partition.numEmittedInstructions;
+			outStats.numOptimizedInstructions += partition.numOptimizedInstructions;
+			outStats.numSpeculatedCallSites += partition.numSpeculatedCallSites;
+			outStats.optimizeMilliseconds += partition.optimizeMilliseconds;
+			outStats.codeGenMilliseconds += partition.codeGenMilliseconds;
+		}
+
+		// Collect the object files for the partitions.
+		if(!takePartitionObjects(partitions,outObjectBuffers)) { return false; }
+		outStats.numObjectBytes = countObjectBytes(outObjectBuffers);
+		return true;
+	}
+
+	// Compiles a module's optimized code, and replaces the module's baseline code with it. This is run on the module's tier-up thread.
+	// The optimized code calls the module's functions directly, but the baseline code calls them through the module's function pointer
+	// table, so once the optimized code's addresses are written to it, baseline code that is still running calls the optimized code.
+	void tierUpModule(JITModule* jitModule,EmitOptions emitOptions,std::string cacheFilePath,std::string moduleObjectKey)
+	{
+		std::vector<std::unique_ptr<llvm::MemoryBuffer>> objectBuffers;
+		Runtime::CompileStats stats;
+		if(!generateModuleObjects(jitModule->astModule,emitOptions,jitModule->optimizationLevel,jitModule->targetCPU,objectBuffers,stats)) { return; }
+
+		if(cacheFilePath.size()) { saveModuleObjects(cacheFilePath,moduleObjectKey,objectBuffers); }
+
+		// Link the optimized code, and finalize it before switching the module to it so no other thread will see it unfinalized.
+		Platform::Lock lock(jitModule->mutex);
+		auto optimizedHandle = addObjectSet(jitModule,std::move(objectBuffers),jitModule->optimizationLevel);
+		jitModule->objectLayer->emitAndFinalize(optimizedHandle);
+		jitModule->handle = optimizedHandle;
+		jitModule->emitOptions = emitOptions;
+		resolveFunctionPointers(jitModule);
+	}
+
+	bool compileModule(const AST::Module* astModule,const Runtime::CompileOptions& options,Runtime::CompileStats& outStats)
+	{
+		outStats.optimizationLevel = options.optimizationLevel;
+		outStats.numFunctions = astModule->functions.size();
+
+		// If the module was compiled ahead-of-time, link its object code without generating any code.
+		if(options.precompiledObjectPath)
+		{
+			const EmitOptions emitOptions = getEmitOptions(astModule,options,true);
+			std::vector<std::unique_ptr<llvm::MemoryBuffer>> precompiledObjectBuffers;
+			if(!loadModuleObjects(options.precompiledObjectPath,getModuleObjectKey(astModule,options,emitOptions),precompiledObjectBuffers))
+			{
+				std::cerr << "Couldn't load precompiled module object file " << options.precompiledObjectPath << std::endl;
+				return false;
+			}
+			outStats.codeSource = Runtime::CompileStats::CodeSource::Precompiled;
+			linkModule(astModule,std::move(precompiledObjectBuffers),options,emitOptions,options.optimizationLevel,outStats);
+			return true;
+		}
+
+		const EmitOptions emitOptions = getEmitOptions(astModule,options);
+
+		// With lazy compilation, the module's functions are compiled when they are first called.
+		if(options.enableLazyCompilation) { return compileLazyModule(astModule,options,emitOptions,outStats); }
+
+		// If there's an object cache, try to load the module's object code from it.
+		std::string moduleObjectKey;
+		std::string cacheFilePath;
+		if(options.objectCacheDirectory)
+		{
+			moduleObjectKey = getModuleObjectKey(astModule,options,emitOptions);
+			cacheFilePath = getObjectCacheFilePath(options.objectCacheDirectory,moduleObjectKey);
+			std::vector<std::unique_ptr<llvm::MemoryBuffer>> cachedObjectBuffers;
+			if(loadModuleObjects(cacheFilePath,moduleObjectKey,cachedObjectBuffers))
+			{
+				outStats.codeSource = Runtime::CompileStats::CodeSource::ObjectCache;
+				linkModule(astModule,std::move(cachedObjectBuffers),options,emitOptions,options.optimizationLevel,outStats);
+				return true;
+			}
+		}
+
+		// With tiered compilation, the module is first compiled at O0, and recompiled at the requested level on a background thread.
+		// Instrumented modules aren't tiered, since the profile counts would be split between the baseline and optimized code.
+		const std::string targetCPU = options.targetCPU ? options.targetCPU : "";
+		const bool isTiered = options.enableTieredCompilation && options.optimizationLevel != Runtime::OptimizationLevel::O0 && !emitOptions.instrumentProfile;
+		std::vector<std::unique_ptr<llvm::MemoryBuffer>> objectBuffers;
+		if(isTiered)
+		{
+			// The baseline code calls the module's functions through its function pointer table, so it calls the optimized code once
+			// the optimized code is linked. The baseline code isn't optimized, so nothing is inlined into it.
+			EmitOptions baselineEmitOptions = emitOptions;
+			baselineEmitOptions.callThroughFunctionPointers = true;
+			baselineEmitOptions.inliningPlan.reset();
+			if(!generateModuleObjects(astModule,baselineEmitOptions,Runtime::OptimizationLevel::O0,targetCPU,objectBuffers,outStats)) { return false; }
+
+			// Link the baseline code, and start a thread to replace it with optimized code. The tier-up thread saves the optimized
+			// code to the object cache, since the baseline code shouldn't be reused.
+			auto jitModule = linkModule(astModule,std::move(objectBuffers),options,baselineEmitOptions,Runtime::OptimizationLevel::O0,outStats);
+			jitModule->tierUpThread = std::thread(tierUpModule,jitModule,emitOptions,cacheFilePath,moduleObjectKey);
+		}
+		else
+		{
+			if(!generateModuleObjects(astModule,emitOptions,options.optimizationLevel,targetCPU,objectBuffers,outStats)) { return false; }
+
+			// Save the object code to the object cache.
+			if(cacheFilePath.size()) { saveModuleObjects(cacheFilePath,moduleObjectKey,objectBuffers); }
+
+			linkModule(astModule,std::move(objectBuffers),options,emitOptions,options.optimizationLevel,outStats);
+		}
+		return true;
+	}
+
+	bool compileModuleToFile(const AST::Module* astModule,const Runtime::CompileOptions& options,const char* outputPath,Runtime::CompileStats& outStats)
+	{
+		const EmitOptions emitOptions = getEmitOptions(astModule,options);
+		outStats.numFunctions = astModule->functions.size();
+		std::vector<std::unique_ptr<llvm::MemoryBuffer>> objectBuffers;
+		if(!generateModuleObjects(astModule,emitOptions,options.optimizationLevel,options.targetCPU ? options.targetCPU : "",objectBuffers,outStats)) { return false; }
+		return saveModuleObjects(outputPath,getModuleObjectKey(astModule,options,emitOptions),objectBuffers);
+	}
+
+	// Returns the JITModule compiled from an AST module, or null if the module hasn't been compiled.
+	JITModule* getJITModule(const AST::Module* astModule)
+	{
+		Platform::Lock jitModulesLock(jitModulesMutex);
+		auto jitModuleIt = astModuleToJITModuleMap.find(astModule);
+		return jitModuleIt == astModuleToJITModuleMap.end() ? nullptr : jitModuleIt->second;
+	}
+
+	void shutdown()
+	{
+		// Wait for the tier-up threads, so none of them is compiling or linking a module while the process exits.
+		Platform::Lock jitModulesLock(jitModulesMutex);
+		for(auto jitModule : jitModules)
+		{
+			if(jitModule->tierUpThread.joinable()) { jitModule->tierUpThread.join(); }
+		}
+	}
+
+	bool unloadModule(const AST::Module* astModule)
+	{
+		JITModule* jitModule;
+		{
+			Platform::Lock jitModulesLock(jitModulesMutex);
+			auto jitModuleIt = astModuleToJITModuleMap.find(astModule);
+			if(jitModuleIt == astModuleToJITModuleMap.end())
+			{
+				std::cerr << "Module isn't loaded" << std::endl;
+				return false;
+			}
+			jitModule = jitModuleIt->second;
+			astModuleToJITModuleMap.erase(jitModuleIt);
+			jitModules.erase(std::find(jitModules.begin(),jitModules.end(),jitModule));
+		}
+
+		// Wait for the module's optimized code to be linked, so the tier-up thread doesn't use the module after it's deleted.
+		if(jitModule->tierUpThread.joinable()) { jitModule->tierUpThread.join(); }
+
+		removeFromCodeMap(jitModule);
+
+		#ifdef _WIN32
+			for(auto unwindInfo : jitModule->sehUnwindInfos) { RuntimePlatform::deregisterSEHUnwindInfo(unwindInfo); }
+		#endif
+		for(auto& object : jitModule->gdbRegisteredObjects) { llvm::JITEventListener::createGDBRegistrationListener()->NotifyFreeingObject(*object); }
+
+		// Deleting the module deletes its object layer, which frees the memory of all the object sets linked into it.
+		delete jitModule;
+		return true;
+	}
+
+	// Reads the counts recorded by an instrumented module's profile counters.
+	bool readModuleProfile(JITModule* jitModule,ModuleProfile& outProfile)
+	{
+		if(!jitModule->emitOptions.instrumentProfile)
+		{
+			std::cerr << "Module wasn't compiled with profile instrumentation" << std::endl;
+			return false;
+		}
+
+		Platform::Lock lock(jitModule->mutex);
+		outProfile.functionCounters.clear();
+		outProfile.functionCounters.resize(jitModule->profileCounters.size());
+		for(uintptr functionIndex = 0;functionIndex < jitModule->profileCounters.size();++functionIndex)
+		{
+			// The first element of the counter array holds the number of counters.
+			auto counters = jitModule->profileCounters[functionIndex];
+			if(counters) { outProfile.functionCounters[functionIndex].assign(counters + 1,counters + 1 + counters[0]); }
+		}
+		return true;
+	}
+
+	bool saveModuleProfile(const AST::Module* astModule,const char* filePath)
+	{
+		auto jitModule = getJITModule(astModule);
+		ModuleProfile profile;
+		return jitModule && readModuleProfile(jitModule,profile) && saveModuleProfile(filePath,astModule,profile);
+	}
+
+	bool recompileModuleWithProfile(const AST::Module* astModule,Runtime::CompileStats& outStats)
+	{
+		auto jitModule = getJITModule(astModule);
+		auto profile = std::make_shared<ModuleProfile>();
+		if(!jitModule || !readModuleProfile(jitModule,*profile)) { return false; }
+
+		// Generate optimized code for the module using the profile. Unlike the instrumented code, it inlines functions into their callers,
+		// including the speculated targets of indirect calls.
+		EmitOptions emitOptions = jitModule->emitOptions;
+		emitOptions.instrumentProfile = false;
+		emitOptions.profile = profile;
+		emitOptions.inliningPlan = getInliningPlan(astModule,jitModule->optimizationLevel,false);
+		std::vector<std::unique_ptr<llvm::MemoryBuffer>> objectBuffers;
+		outStats.numFunctions = astModule->functions.size();
+		if(!generateModuleObjects(astModule,emitOptions,jitModule->optimizationLevel,jitModule->targetCPU,objectBuffers,outStats)) { return false; }
+
+		// Link the optimized code, and switch the module to it. Like tiered compilation, the instrumented code is kept since it may still be executing.
+		Core::Timer linkTimer;
+		Platform::Lock lock(jitModule->mutex);
+		const uintptr numInstrumentedFunctions = jitModule->functions.size();
+		auto optimizedHandle = addObjectSet(jitModule,std::move(objectBuffers),jitModule->optimizationLevel);
+		jitModule->objectLayer->emitAndFinalize(optimizedHandle);
+		jitModule->handle = optimizedHandle;
+		jitModule->emitOptions = emitOptions;
+		jitModule->profileCounters.clear();
+		resolveFunctionPointers(jitModule);
+
+		auto functionIt = jitModule->functions.begin();
+		std::advance(functionIt,numInstrumentedFunctions);
+		for(;functionIt != jitModule->functions.end();++functionIt) { outStats.numCodeBytes += functionIt->size; }
+		outStats.linkMilliseconds = linkTimer.getMilliseconds();
 		return true;
 	}
 
@@ -206,6 +1160,11 @@ namespace LLVMJIT
 		return "wasmFunc" + std::to_string(functionIndex);
 	}
 
+	std::string getProfileCountersName(uintptr_t functionIndex)
+	{
+		return "wavmProfileCounters" + std::to_string(functionIndex);
+	}
+
 	bool getFunctionIndexFromExternalName(const char* externalName,uintptr_t& outFunctionIndex)
 	{
 		if(strncmp(externalName,"wasmFunc",8)) { return false; }
@@ -219,37 +1178,28 @@ namespace LLVMJIT
 
 	void* getFunctionPointer(const AST::Module* module,uintptr functionIndex)
 	{
-		for(auto jitModule : jitModules)
-		{
-			if(jitModule->astModule == module)
-			{
-				return (void*)jitModule->compileLayer->findSymbolIn(jitModule->handle,getExternalFunctionName(functionIndex),false).getAddress();
-			}
-		}
-		return nullptr;
+		auto jitModule = getJITModule(module);
+		if(!jitModule) { return nullptr; }
+		assert(functionIndex < jitModule->functionPointers.size());
+		return jitModule->functionPointers[functionIndex].load(std::memory_order_acquire);
 	}
 	
+	bool getOptimizationLevelFromInstructionPointer(uintptr_t ip,Runtime::OptimizationLevel& outOptimizationLevel)
+	{
+		CodeMapReadScope codeMapReadScope;
+		auto entry = findCodeMapEntry(codeMapReadScope,ip);
+		if(!entry) { return false; }
+		outOptimizationLevel = entry->function->optimizationLevel;
+		return true;
+	}
+
 	bool describeInstructionPointer(uintptr_t ip,std::string& outDescription)
 	{
-		for(auto jitModule : jitModules)
-		{
-			for(auto function : jitModule->functions)
-			{
-				if(ip >= function.baseAddress && ip <= (function.baseAddress + function.size))
-				{
-					uintptr_t functionIndex;
-					if(getFunctionIndexFromExternalName(function.name.data(),functionIndex))
-					{
-						assert(functionIndex < jitModule->astModule->functions.size());
-						auto astFunction = jitModule->astModule->functions[functionIndex];
-						if(astFunction->name) { outDescription = astFunction->name; return true; }
-					}
+		CodeMapReadScope codeMapReadScope;
+		auto entry = findCodeMapEntry(codeMapReadScope,ip);
+		if(!entry) { return false; }
 
-					outDescription = function.name;
-					return true;
-				}
-			}
-		}
-		return false;
+		outDescription = getJITFunctionDisplayName(entry->jitModule,*entry->function);
+		return true;
 	}
 }
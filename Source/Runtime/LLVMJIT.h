@@ -24,8 +24,11 @@
 #endif
 
 #include "llvm/Analysis/Passes.h"
+#include "llvm/Bitcode/ReaderWriter.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
 #include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
@@ -33,6 +36,7 @@
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
@@ -40,6 +44,7 @@
 #include "llvm/IR/Verifier.h"
 #include "llvm/IR/ValueHandle.h"
 #include "llvm/IR/DebugLoc.h"
+#include "llvm/IR/DIBuilder.h"
 #include "llvm/Object/ObjectFile.h"
 #include "llvm/Object/SymbolSize.h"
 #include "llvm/CodeGen/MachineFunction.h"
@@ -47,8 +52,18 @@
 #include "llvm/Support/DataTypes.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/Host.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Threading.h"
 #include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Dwarf.h"
 #include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/DebugInfo/DIContext.h"
 #include "llvm/DebugInfo/DWARF/DWARFContext.h"
 #include <cctype>
@@ -56,6 +71,12 @@
 #include <string>
 #include <vector>
 #include <iostream>
+#include <thread>
+#include <atomic>
+#include <unordered_map>
+#include <deque>
+#include <algorithm>
+#include <iterator>
 
 #ifdef _WIN32
 	#pragma warning(pop)
@@ -63,9 +84,152 @@
 
 namespace LLVMJIT
 {
+	// The names of the symbols that lazy compilation stubs use to compile a function on demand, and to identify the module it is in.
+	const char* const lazyCompileFunctionSymbolName = "wavmLazyCompileFunction";
+	const char* const lazyJITModuleSymbolName = "wavmLazyJITModule";
+
+	// The name of the symbol for a module's function pointer table: an array with the current address of each of the module's functions.
+	const char* const functionPointersSymbolName = "wavmFunctionPointers";
+
+	// The name of the section that the emitter puts functions in if their profile shows they are hot. The huge page memory manager
+	// places the code in these sections together.
+	const char* const hotCodeSectionName = ".text.hot";
+
 	std::string getExternalFunctionName(uintptr_t functionIndex);
 	bool getFunctionIndexFromExternalName(const char* externalName,uintptr_t& outFunctionIndex);
 
-	// Emits LLVM IR for a module.
-	llvm::Module* emitModule(const AST::Module* astModule);
-}
+	// Returns the name of the symbol for the profile counter array of a function in an instrumented module.
+	std::string getProfileCountersName(uintptr_t functionIndex);
+
+	// Execution counts recorded by the profile instrumentation of a module. functionCounters[i] holds the counters for the function with
+	// index i in the order the emitter allocated them, or is empty if there is no profile for the function. The first counter of each
+	// function counts the function's entries.
+	struct ModuleProfile
+	{
+		std::vector<std::vector<uint64>> functionCounters;
+	};
+
+	// Which of a module's functions are inlined into their callers. Inlining across the module's partitions works by emitting an
+	// available_externally copy of each inlined function into every partition that calls it, marked to always be inlined.
+	struct InliningPlan
+	{
+		// Whether each function is inlined into its callers.
+		std::vector<bool> isInlinedFunction;
+
+		// Whether each function is small enough to inline into any caller. Small functions that are only called through function tables
+		// aren't inlined functions, but are inlined into the direct calls the emitter speculates for call_indirect.
+		std::vector<bool> isSmallFunction;
+
+		// For each function, the inlined functions that it calls directly.
+		std::vector<std::vector<uintptr>> inlinedCallees;
+
+		uintptr numInlinedFunctions;
+		uintptr numInlinedCallSites;
+	};
+
+	// Decides which functions of a module to inline into their callers: small functions, and functions that are only called from
+	// one call site. The decision is only based on the module, so every partition of the module agrees on it.
+	InliningPlan planInlining(const AST::Module* astModule);
+
+	// Options that control how the LLVM IR for a module is emitted.
+	struct EmitOptions
+	{
+		// If true, the emitted code counts how often each function is entered, each if-else and switch arm is taken, and each loop iterates.
+		bool instrumentProfile;
+
+		// If non-null, a profile that is used to add branch weights, function entry counts, and hot and cold attributes to the emitted code.
+		std::shared_ptr<const ModuleProfile> profile;
+
+		// If non-null, the functions to inline into their callers.
+		std::shared_ptr<const InliningPlan> inliningPlan;
+
+		// If true, the emitted code has debug info that maps it to the loci of the module's functions and expressions in sourcePath.
+		bool emitDebugInfo;
+		std::string sourcePath;
+
+		// If true, addresses aren't masked, and are compared against the instance memory's size instead, trapping if they are out of bounds.
+		bool checkBounds;
+
+		// If true, calls to the module's functions, and the module's function tables, load the functions' addresses from the module's
+		// function pointer table instead of referring to the functions' symbols. The baseline code of tiered compilation is emitted this
+		// way, so it calls the optimized code as soon as the optimized code's addresses are written to the function pointer table.
+		bool callThroughFunctionPointers;
+
+		EmitOptions(): instrumentProfile(false), emitDebugInfo(false), checkBounds(false), callThroughFunctionPointers(false) {}
+	};
+
+	// A LLVM context that IR is emitted in, and the LLVM types and constants the emitter uses, which belong to the context. A LLVM context
+	// may only be used by one thread at a time, so each thread that emits IR takes a context from a pool with acquireEmitContext, and
+	// returns it with releaseEmitContext once it is done with the IR.
+	struct EmitContext
+	{
+		llvm::LLVMContext llvmContext;
+
+		// Maps a type ID to the corresponding LLVM type.
+		llvm::Type* llvmTypesByTypeId[(size_t)AST::TypeId::num];
+
+		// Zero constants of each type.
+		llvm::Constant* typedZeroConstants[(size_t)AST::TypeId::num];
+
+		// A dummy constant to use as the unique value inhabiting the void type.
+		llvm::Constant* voidDummy;
+
+		// The type of the pointer to the Runtime::InstanceMemory that each generated function is passed as its first argument. Only the
+		// InstanceMemory's base and numBytes members are declared.
+		llvm::PointerType* instanceMemoryPointerType;
+
+		EmitContext();
+	};
+
+	// Takes an emit context that no other thread is using from the pool, or creates a new one if there aren't any.
+	std::unique_ptr<EmitContext> acquireEmitContext();
+
+	// Returns an emit context to the pool. Any LLVM modules created in the context must have been deleted.
+	void releaseEmitContext(std::unique_ptr<EmitContext>&& emitContext);
+
+	// Emits LLVM IR for a module. Only the functions with the given indices are defined in the
+	// resulting LLVM module; the others are declared as external symbols, or emitted as
+	// available_externally copies if the inlining plan inlines them into a defined function. If outNumSpeculatedCallSites is non-null,
+	// it receives the number of call_indirect sites in the defined functions that the profile let the emitter call directly.
+	llvm::Module* emitModule(EmitContext& emitContext,const AST::Module* astModule,const std::vector<uintptr>& definedFunctionIndices,const EmitOptions& options,uintptr* outNumSpeculatedCallSites = nullptr);
+
+	// Emits LLVM IR for a module that defines a stub for each of the module's functions. The first call to a stub compiles the
+	// function by calling lazyCompileFunctionSymbolName, and the stub forwards that and all later calls to the compiled function.
+	// The stub itself isn't rewritten, so calls that were bound to it keep going through it.
+	llvm::Module* emitLazyStubModule(EmitContext& emitContext,const AST::Module* astModule);
+
+	// Creates a memory manager for the code and data of an object set, which frees the memory when the object set is removed. If
+	// useHugePages is true, the memory is allocated from regions that are shared by all modules and backed by huge pages if the OS
+	// supports it, and the code in hotCodeSectionName sections is placed together.
+	std::unique_ptr<llvm::RTDyldMemoryManager> createMemoryManager(bool useHugePages);
+
+	// Returns a hash of everything in a module that affects the code generated for it.
+	std::string getModuleHash(const AST::Module* astModule);
+
+	// Returns a hash of the loci of a module's functions and expressions, which the debug info generated for the module maps its code to.
+	// getModuleHash doesn't include them, since they don't affect the code.
+	std::string getModuleLociHash(const AST::Module* astModule);
+
+	// Returns a hash of a file's contents, or an empty string if the file can't be read.
+	std::string getFileHash(const char* filePath);
+
+	// Returns a key that identifies the object code generated for a module for a target with the given optimization settings. The target is
+	// described by the strings a target machine would be created from, so the key can be computed without creating a target machine.
+	std::string getModuleObjectKey(const AST::Module* astModule,const std::string& targetTriple,const std::string& targetCPU,const std::string& targetFeatures,const char* optimizationSettings);
+
+	// Returns the path of the file in an object cache directory that holds the object code with the given key.
+	std::string getObjectCacheFilePath(const char* cacheDirectory,const std::string& moduleObjectKey);
+
+	// Loads the object code for a module from a file written by saveModuleObjects. Returns false if there isn't a valid file at the
+	// path, or if the file holds object code with a different key.
+	bool loadModuleObjects(const std::string& filePath,const std::string& moduleObjectKey,std::vector<std::unique_ptr<llvm::MemoryBuffer>>& outObjectBuffers);
+
+	// Saves the object code for a module to a file. This is used for both the object cache, and ahead-of-time compiled modules.
+	bool saveModuleObjects(const std::string& filePath,const std::string& moduleObjectKey,const std::vector<std::unique_ptr<llvm::MemoryBuffer>>& objectBuffers);
+
+	// Reads a module profile from a file written by saveModuleProfile. Returns false if the file couldn't be read, or doesn't match the module.
+	bool loadModuleProfile(const char* filePath,const AST::Module* astModule,ModuleProfile& outProfile);
+
+	// Writes a module profile to a file.
+	bool saveModuleProfile(const char* filePath,const AST::Module* astModule,const ModuleProfile& profile);
+}
\ No newline at end of file
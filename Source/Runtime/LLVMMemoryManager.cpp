@@ -0,0 +1,282 @@
+#include "LLVMJIT.h"
+
+namespace LLVMJIT
+{
+	// The number of bytes of code and data allocated by the memory managers of all object sets that haven't been removed.
+	static std::atomic<uint64> numAllocatedCodeMemoryBytes(0);
+
+	// A memory manager for the code and data of an object set. When the object set is removed, this frees its memory, and deregisters
+	// the EH frames that were registered for it so the unwinder doesn't read the freed memory.
+	struct JITMemoryManager : llvm::SectionMemoryManager
+	{
+		// The number of bytes of code and data allocated for the object set, which are counted in numAllocatedCodeMemoryBytes.
+		uint64 numAllocatedBytes;
+
+		JITMemoryManager(): numAllocatedBytes(0) {}
+
+		void countAllocation(uintptr_t numBytes)
+		{
+			numAllocatedBytes += numBytes;
+			numAllocatedCodeMemoryBytes += numBytes;
+		}
+
+		virtual uint8* allocateCodeSection(uintptr_t numBytes,unsigned alignment,unsigned sectionID,llvm::StringRef sectionName) override
+		{
+			countAllocation(numBytes);
+			return llvm::SectionMemoryManager::allocateCodeSection(numBytes,alignment,sectionID,sectionName);
+		}
+
+		virtual uint8* allocateDataSection(uintptr_t numBytes,unsigned alignment,unsigned sectionID,llvm::StringRef sectionName,bool isReadOnly) override
+		{
+			countAllocation(numBytes);
+			return llvm::SectionMemoryManager::allocateDataSection(numBytes,alignment,sectionID,sectionName,isReadOnly);
+		}
+
+		struct EHFrame
+		{
+			uint8* address;
+			uint64 loadAddress;
+			size_t numBytes;
+		};
+		std::vector<EHFrame> ehFrames;
+
+		virtual void registerEHFrames(uint8* address,uint64 loadAddress,size_t numBytes) override
+		{
+			llvm::SectionMemoryManager::registerEHFrames(address,loadAddress,numBytes);
+			ehFrames.push_back({address,loadAddress,numBytes});
+		}
+
+		void deregisterAllEHFrames()
+		{
+			for(auto& ehFrame : ehFrames) { deregisterEHFrames(ehFrame.address,ehFrame.loadAddress,ehFrame.numBytes); }
+			ehFrames.clear();
+		}
+
+		~JITMemoryManager()
+		{
+			deregisterAllEHFrames();
+			numAllocatedCodeMemoryBytes -= numAllocatedBytes;
+		}
+	};
+
+	// The size of the huge pages used for code on x86-64, and the granularity that memory is committed to the shared memory regions in.
+	static const size_t hugePageNumBytes = 2 * 1024 * 1024;
+
+	// Allocates memory from a range of virtual addresses. Memory is committed as it is first needed, and freed memory is kept in a free
+	// list to be reused, but never decommitted.
+	struct SharedMemoryRegion
+	{
+		SharedMemoryRegion(uint8* inBaseAddress,size_t inNumReservedBytes,Platform::MemoryAccess inAccess)
+		: baseAddress(inBaseAddress), numReservedBytes(inNumReservedBytes), numCommittedBytes(0), numAllocatedBytes(0), access(inAccess) {}
+
+		uint8* allocate(size_t numBytes,size_t alignment)
+		{
+			Platform::Lock lock(mutex);
+			alignment = std::max(alignment,(size_t)16);
+			numBytes = (numBytes + 15) & ~(size_t)15;
+
+			// Use the first free block that is big enough for the allocation once it's aligned.
+			for(auto freeBlockIt = freeBlocks.begin();freeBlockIt != freeBlocks.end();++freeBlockIt)
+			{
+				const uintptr blockAddress = freeBlockIt->first;
+				const size_t blockNumBytes = freeBlockIt->second;
+				const uintptr alignedAddress = (blockAddress + alignment - 1) & ~(uintptr)(alignment - 1);
+				if(alignedAddress + numBytes <= blockAddress + blockNumBytes)
+				{
+					// Put the parts of the block before and after the allocation back in the free list.
+					freeBlocks.erase(freeBlockIt);
+					if(alignedAddress > blockAddress) { freeBlocks[blockAddress] = alignedAddress - blockAddress; }
+					if(alignedAddress + numBytes < blockAddress + blockNumBytes) { freeBlocks[alignedAddress + numBytes] = blockAddress + blockNumBytes - alignedAddress - numBytes; }
+					return (uint8*)alignedAddress;
+				}
+			}
+
+			// Otherwise, allocate from the end of the region, committing more memory if necessary.
+			const uintptr endAddress = (uintptr)baseAddress + numAllocatedBytes;
+			const uintptr alignedAddress = (endAddress + alignment - 1) & ~(uintptr)(alignment - 1);
+			const size_t newNumAllocatedBytes = alignedAddress + numBytes - (uintptr)baseAddress;
+			if(newNumAllocatedBytes > numReservedBytes) { return nullptr; }
+			if(newNumAllocatedBytes > numCommittedBytes)
+			{
+				const size_t newNumCommittedBytes = std::min(numReservedBytes,(newNumAllocatedBytes + hugePageNumBytes - 1) & ~(hugePageNumBytes - 1));
+				const uint32 pageSizeLog2 = Platform::getPreferredVirtualPageSizeLog2();
+				if(!Platform::commitVirtualPages(baseAddress + numCommittedBytes,(newNumCommittedBytes - numCommittedBytes) >> pageSizeLog2,access)) { return nullptr; }
+				numCommittedBytes = newNumCommittedBytes;
+			}
+			if(alignedAddress > endAddress) { freeBlocks[endAddress] = alignedAddress - endAddress; }
+			numAllocatedBytes = newNumAllocatedBytes;
+			return (uint8*)alignedAddress;
+		}
+
+		void free(uint8* address,size_t numBytes)
+		{
+			Platform::Lock lock(mutex);
+			numBytes = (numBytes + 15) & ~(size_t)15;
+
+			// Coalesce the block with the adjacent free blocks.
+			uintptr blockAddress = (uintptr)address;
+			auto nextBlockIt = freeBlocks.find(blockAddress + numBytes);
+			if(nextBlockIt != freeBlocks.end())
+			{
+				numBytes += nextBlockIt->second;
+				freeBlocks.erase(nextBlockIt);
+			}
+			auto previousBlockIt = freeBlocks.lower_bound(blockAddress);
+			if(previousBlockIt != freeBlocks.begin())
+			{
+				--previousBlockIt;
+				if(previousBlockIt->first + previousBlockIt->second == blockAddress)
+				{
+					blockAddress = previousBlockIt->first;
+					numBytes += previousBlockIt->second;
+					freeBlocks.erase(previousBlockIt);
+				}
+			}
+			freeBlocks[blockAddress] = numBytes;
+		}
+
+		// Returns the number of bytes from the start of the region to the end of its last allocation, including the free blocks below it.
+		size_t getNumAllocatedBytes()
+		{
+			Platform::Lock lock(mutex);
+			return numAllocatedBytes;
+		}
+
+	private:
+		Platform::Mutex mutex;
+		uint8* baseAddress;
+		size_t numReservedBytes;
+		size_t numCommittedBytes;
+		size_t numAllocatedBytes;
+		Platform::MemoryAccess access;
+
+		// Maps the address of each free block below numAllocatedBytes to its size.
+		std::map<uintptr,size_t> freeBlocks;
+	};
+
+	// The memory shared by all object sets that use HugePageMemoryManager. It is reserved as a single range of addresses, so the code
+	// and data in it are always within the +/-2GB range of the x86-64 small code model's PC-relative references, and is split into:
+	//	- hot code: the code in sections named hotCodeSectionName, placed together so the hot code of all modules shares few pages.
+	//	- code: all other code.
+	//	- read-only data.
+	//	- read-write data.
+	// The code regions are backed by huge pages if the OS supports them. Since the pages are shared by object sets that are loaded at
+	// different times, they can't be made read-only or executable when a single object set is finalized, so the code regions are
+	// committed as readable, writable, and executable.
+	struct SharedMemory
+	{
+		std::unique_ptr<SharedMemoryRegion> hotCode;
+		std::unique_ptr<SharedMemoryRegion> code;
+		std::unique_ptr<SharedMemoryRegion> readOnlyData;
+		std::unique_ptr<SharedMemoryRegion> readWriteData;
+
+		SharedMemory()
+		{
+			const size_t regionUnitBytes = sizeof(uintptr) == 8 ? 64 * 1024 * 1024 : 4 * 1024 * 1024;
+			const size_t numHotCodeBytes = 2 * regionUnitBytes;
+			const size_t numCodeBytes = 8 * regionUnitBytes;
+			const size_t numReadOnlyDataBytes = 3 * regionUnitBytes;
+			const size_t numReadWriteDataBytes = 3 * regionUnitBytes;
+			const size_t numBytes = numHotCodeBytes + numCodeBytes + numReadOnlyDataBytes + numReadWriteDataBytes;
+
+			// Reserve an extra huge page of addresses to align the regions to huge page boundaries.
+			const uint32 pageSizeLog2 = Platform::getPreferredVirtualPageSizeLog2();
+			uint8* unalignedBaseAddress = Platform::allocateVirtualPages((numBytes + hugePageNumBytes) >> pageSizeLog2);
+			if(!unalignedBaseAddress) { throw; }
+			uint8* baseAddress = (uint8*)(((uintptr)unalignedBaseAddress + hugePageNumBytes - 1) & ~(uintptr)(hugePageNumBytes - 1));
+			Platform::adviseHugePages(baseAddress,(numHotCodeBytes + numCodeBytes) >> pageSizeLog2);
+
+			hotCode.reset(new SharedMemoryRegion(baseAddress,numHotCodeBytes,Platform::MemoryAccess::ReadWriteExecute));
+			baseAddress += numHotCodeBytes;
+			code.reset(new SharedMemoryRegion(baseAddress,numCodeBytes,Platform::MemoryAccess::ReadWriteExecute));
+			baseAddress += numCodeBytes;
+			readOnlyData.reset(new SharedMemoryRegion(baseAddress,numReadOnlyDataBytes,Platform::MemoryAccess::ReadWrite));
+			baseAddress += numReadOnlyDataBytes;
+			readWriteData.reset(new SharedMemoryRegion(baseAddress,numReadWriteDataBytes,Platform::MemoryAccess::ReadWrite));
+		}
+
+		static SharedMemory& get()
+		{
+			// It's never destroyed, since tier-up threads that are still running at exit allocate from it until shutdown joins them.
+			static SharedMemory* sharedMemory = createdSharedMemory = new SharedMemory();
+			return *sharedMemory;
+		}
+
+		// Returns the shared memory if get has created it, or null, so the shared memory can be inspected without reserving it.
+		static SharedMemory* getIfCreated() { return createdSharedMemory.load(); }
+
+	private:
+		static std::atomic<SharedMemory*> createdSharedMemory;
+	};
+	std::atomic<SharedMemory*> SharedMemory::createdSharedMemory(nullptr);
+
+	// A memory manager that allocates the code and data of an object set from the shared memory, and frees it back to the shared memory
+	// when the object set is removed.
+	struct HugePageMemoryManager : JITMemoryManager
+	{
+		struct Allocation
+		{
+			SharedMemoryRegion* region;
+			uint8* address;
+			size_t numBytes;
+		};
+		std::vector<Allocation> allocations;
+
+		uint8* allocate(SharedMemoryRegion* region,size_t numBytes,unsigned alignment)
+		{
+			uint8* address = region->allocate(numBytes,alignment);
+			if(!address)
+			{
+				std::cerr << "Couldn't allocate " << numBytes << " bytes of shared JIT memory" << std::endl;
+				throw;
+			}
+			allocations.push_back({region,address,numBytes});
+			countAllocation(numBytes);
+			return address;
+		}
+
+		virtual uint8* allocateCodeSection(uintptr_t numBytes,unsigned alignment,unsigned sectionID,llvm::StringRef sectionName) override
+		{
+			SharedMemory& sharedMemory = SharedMemory::get();
+			return allocate(sectionName == hotCodeSectionName ? sharedMemory.hotCode.get() : sharedMemory.code.get(),numBytes,alignment);
+		}
+
+		virtual uint8* allocateDataSection(uintptr_t numBytes,unsigned alignment,unsigned sectionID,llvm::StringRef sectionName,bool isReadOnly) override
+		{
+			SharedMemory& sharedMemory = SharedMemory::get();
+			return allocate(isReadOnly ? sharedMemory.readOnlyData.get() : sharedMemory.readWriteData.get(),numBytes,alignment);
+		}
+
+		virtual bool finalizeMemory(std::string* outErrorMessage) override
+		{
+			// The shared memory is always executable, so it just needs to make sure the instruction cache sees the relocated code.
+			for(auto& allocation : allocations) { llvm::sys::Memory::InvalidateInstructionCache(allocation.address,allocation.numBytes); }
+			return true;
+		}
+
+		~HugePageMemoryManager()
+		{
+			// Deregister the EH frames before freeing the memory they are in, since another object set may reuse it.
+			deregisterAllEHFrames();
+			for(auto& allocation : allocations) { allocation.region->free(allocation.address,allocation.numBytes); }
+		}
+	};
+
+	Runtime::CodeMemoryStats getCodeMemoryStats()
+	{
+		Runtime::CodeMemoryStats stats;
+		stats.numAllocatedBytes = numAllocatedCodeMemoryBytes.load();
+		if(SharedMemory* sharedMemory = SharedMemory::getIfCreated())
+		{
+			stats.numSharedMemoryBytes = sharedMemory->hotCode->getNumAllocatedBytes() + sharedMemory->code->getNumAllocatedBytes()
+				+ sharedMemory->readOnlyData->getNumAllocatedBytes() + sharedMemory->readWriteData->getNumAllocatedBytes();
+		}
+		return stats;
+	}
+
+	std::unique_ptr<llvm::RTDyldMemoryManager> createMemoryManager(bool useHugePages)
+	{
+		if(useHugePages) { return llvm::make_unique<HugePageMemoryManager>(); }
+		else { return llvm::make_unique<JITMemoryManager>(); }
+	}
+}
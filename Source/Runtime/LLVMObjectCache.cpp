@@ -0,0 +1,381 @@
+#include "LLVMJIT.h"
+
+using namespace AST;
+
+namespace LLVMJIT
+{
+	// Identifies the format of the module object files. Change this when the file format or the generated code's ABI changes.
+	static const uint32 objectFileMagic = 0x4f4d5657; // 'WVMO'
+	static const uint32 objectFileVersion = 6;
+
+	// Computes a hash of everything in an AST module that affects the code generated for it.
+	struct ModuleHashVisitor
+	{
+		typedef void DispatchResult;
+
+		llvm::MD5& md5;
+		const Module* astModule;
+		const Function* astFunction;
+
+		// Branch targets are identified by the order they are defined in.
+		std::map<const BranchTarget*,uintptr> branchTargetIds;
+
+		ModuleHashVisitor(llvm::MD5& inMD5,const Module* inASTModule): md5(inMD5), astModule(inASTModule), astFunction(nullptr) {}
+
+		template<typename Value> void hash(const Value& value) { md5.update(llvm::ArrayRef<uint8>((const uint8*)&value,sizeof(Value))); }
+		void hashString(const char* string)
+		{
+			if(string) { md5.update(llvm::StringRef(string)); }
+			hash((uint8)0);
+		}
+		void hashFunctionType(const FunctionType& functionType)
+		{
+			hash(functionType.returnType);
+			hash(functionType.parameters.size());
+			for(auto parameterType : functionType.parameters) { hash(parameterType); }
+		}
+		void hashExpression(UntypedExpression* expression,TypeId type)
+		{
+			hash(type);
+			dispatch(*this,expression,type);
+		}
+		void hashExpression(const TypedExpression& expression) { hashExpression(expression.expression,expression.type); }
+		void defineBranchTarget(const BranchTarget* branchTarget)
+		{
+			hash(branchTarget->type);
+			const uintptr branchTargetId = branchTargetIds.size();
+			branchTargetIds[branchTarget] = branchTargetId;
+		}
+
+		void hashFunction(const Function* function)
+		{
+			astFunction = function;
+			hashFunctionType(function->type);
+			hash(function->locals.size());
+			for(auto local : function->locals) { hash(local.type); }
+			for(auto parameterLocalIndex : function->parameterLocalIndices) { hash(parameterLocalIndex); }
+			hashExpression(function->expression,function->type.returnType);
+			astFunction = nullptr;
+		}
+
+		template<typename Type> void visitLiteral(const Literal<Type>* literal)
+		{
+			hash(literal->op());
+			hash(literal->value);
+		}
+		template<typename Class> void visitError(TypeId type,const Error<Class>* error)
+		{
+			std::cerr << "Found error node while hashing module:" << std::endl;
+			std::cerr << error->message << std::endl;
+			throw;
+		}
+		void visitGetLocal(TypeId type,const GetLocal* getVariable)
+		{
+			hash(getVariable->op());
+			hash(getVariable->variableIndex);
+		}
+		void visitSetLocal(const SetLocal* setVariable)
+		{
+			hash(setVariable->op());
+			hash(setVariable->variableIndex);
+			hashExpression(setVariable->value,astFunction->locals[setVariable->variableIndex].type);
+		}
+		template<typename Class,typename OpAsType> void visitLoad(TypeId type,const Load<Class>* load,OpAsType)
+		{
+			hash(load->op());
+			hash(load->isFarAddress);
+			hash(load->alignmentLog2);
+			hash(load->memoryType);
+			hashExpression(load->address,load->isFarAddress ? TypeId::I64 : TypeId::I32);
+		}
+		template<typename Class> void visitStore(const Store<Class>* store)
+		{
+			hash(store->op());
+			hash(store->isFarAddress);
+			hash(store->alignmentLog2);
+			hash(store->memoryType);
+			hashExpression(store->address,store->isFarAddress ? TypeId::I64 : TypeId::I32);
+			hashExpression(store->value);
+		}
+		template<typename Class,typename OpAsType> void visitUnary(TypeId type,const Unary<Class>* unary,OpAsType)
+		{
+			hash(unary->op());
+			hashExpression(unary->operand,type);
+		}
+		template<typename Class,typename OpAsType> void visitBinary(TypeId type,const Binary<Class>* binary,OpAsType)
+		{
+			hash(binary->op());
+			hashExpression(binary->left,type);
+			hashExpression(binary->right,type);
+		}
+		template<typename Class,typename OpAsType> void visitCast(TypeId type,const Cast<Class>* cast,OpAsType)
+		{
+			hash(cast->op());
+			hashExpression(cast->source);
+		}
+		template<typename OpAsType> void visitComparison(const Comparison* compare,OpAsType)
+		{
+			hash(compare->op());
+			hashExpression(compare->left,compare->operandType);
+			hashExpression(compare->right,compare->operandType);
+		}
+		template<typename OpAsType> void visitCall(TypeId type,const Call* call,OpAsType)
+		{
+			hash(call->op());
+			hash(call->functionIndex);
+			const FunctionType& functionType = call->op() == AnyOp::callDirect
+				? astModule->functions[call->functionIndex]->type
+				: astModule->functionImports[call->functionIndex].type;
+			for(uintptr parameterIndex = 0;parameterIndex < functionType.parameters.size();++parameterIndex)
+			{ hashExpression(call->parameters[parameterIndex],functionType.parameters[parameterIndex]); }
+		}
+		void visitCallIndirect(TypeId type,const CallIndirect* callIndirect)
+		{
+			hash(callIndirect->op());
+			hash(callIndirect->tableIndex);
+			hashExpression(callIndirect->functionIndex,TypeId::I32);
+			const FunctionType& functionType = astModule->functionTables[callIndirect->tableIndex].type;
+			for(uintptr parameterIndex = 0;parameterIndex < functionType.parameters.size();++parameterIndex)
+			{ hashExpression(callIndirect->parameters[parameterIndex],functionType.parameters[parameterIndex]); }
+		}
+		template<typename Class> void visitSwitch(TypeId type,const Switch<Class>* switchExpression)
+		{
+			hash(switchExpression->op());
+			defineBranchTarget(switchExpression->endTarget);
+			hashExpression(switchExpression->key);
+			hash(switchExpression->defaultArmIndex);
+			hash(switchExpression->numArms);
+			for(uintptr armIndex = 0;armIndex < switchExpression->numArms;++armIndex)
+			{
+				hash(switchExpression->arms[armIndex].key);
+				hashExpression(switchExpression->arms[armIndex].value,armIndex + 1 == switchExpression->numArms ? type : TypeId::Void);
+			}
+		}
+		template<typename Class> void visitIfElse(TypeId type,const IfElse<Class>* ifElse)
+		{
+			hash(ifElse->op());
+			hashExpression(ifElse->condition,TypeId::Bool);
+			hashExpression(ifElse->thenExpression,type);
+			hashExpression(ifElse->elseExpression,type);
+		}
+		template<typename Class> void visitLabel(TypeId type,const Label<Class>* label)
+		{
+			hash(label->op());
+			defineBranchTarget(label->endTarget);
+			hashExpression(label->expression,type);
+		}
+		template<typename Class> void visitSequence(TypeId type,const Sequence<Class>* seq)
+		{
+			hash(seq->op());
+			hashExpression(seq->voidExpression,TypeId::Void);
+			hashExpression(seq->resultExpression,type);
+		}
+		template<typename Class> void visitReturn(TypeId type,const Return<Class>* ret)
+		{
+			hash(ret->op());
+			if(astFunction->type.returnType != TypeId::Void) { hashExpression(ret->value,astFunction->type.returnType); }
+		}
+		template<typename Class> void visitLoop(TypeId type,const Loop<Class>* loop)
+		{
+			hash(loop->op());
+			defineBranchTarget(loop->breakTarget);
+			defineBranchTarget(loop->continueTarget);
+			hashExpression(loop->expression,TypeId::Void);
+		}
+		template<typename Class> void visitBranch(TypeId type,const Branch<Class>* branch)
+		{
+			hash(branch->op());
+			assert(branchTargetIds.count(branch->branchTarget));
+			hash(branchTargetIds[branch->branchTarget]);
+			if(branch->branchTarget->type != TypeId::Void) { hashExpression(branch->value,branch->branchTarget->type); }
+		}
+		void visitNop(const Nop* nop) { hash(nop->op()); }
+		void visitDiscardResult(const DiscardResult* discardResult)
+		{
+			hash(discardResult->op());
+			hashExpression(discardResult->expression);
+		}
+	};
+
+	// Hashes the module's functions, imports, and function tables.
+	static void hashModule(ModuleHashVisitor& visitor,const Module* astModule)
+	{
+		visitor.hash(astModule->functions.size());
+		for(auto function : astModule->functions) { visitor.hashFunction(function); }
+		visitor.hash(astModule->functionImports.size());
+		for(auto& functionImport : astModule->functionImports)
+		{
+			visitor.hashFunctionType(functionImport.type);
+			visitor.hashString(functionImport.module);
+			visitor.hashString(functionImport.name);
+		}
+		visitor.hash(astModule->functionTables.size());
+		for(auto& functionTable : astModule->functionTables)
+		{
+			visitor.hashFunctionType(functionTable.type);
+			visitor.hash(functionTable.numFunctions);
+			for(uintptr elementIndex = 0;elementIndex < functionTable.numFunctions;++elementIndex)
+			{ visitor.hash(functionTable.functionIndices[elementIndex]); }
+		}
+	}
+
+	static std::string getMD5String(llvm::MD5& md5)
+	{
+		llvm::MD5::MD5Result md5Result;
+		md5.final(md5Result);
+		llvm::SmallString<32> md5String;
+		llvm::MD5::stringifyResult(md5Result,md5String);
+		return md5String.str();
+	}
+
+	std::string getModuleHash(const Module* astModule)
+	{
+		llvm::MD5 md5;
+		ModuleHashVisitor visitor(md5,astModule);
+		hashModule(visitor,astModule);
+		return getMD5String(md5);
+	}
+
+	std::string getModuleLociHash(const Module* astModule)
+	{
+		// The loci are recorded in the order the parser parsed the expressions, so they are in the same order for the same module text.
+		llvm::MD5 md5;
+		ModuleHashVisitor visitor(md5,astModule);
+		auto hashLocus = [&](const Core::TextFileLocus& locus)
+		{
+			visitor.hash(locus.newlines);
+			visitor.hash(locus.tabs);
+			visitor.hash(locus.characters);
+		};
+		for(auto function : astModule->functions)
+		{
+			hashLocus(function->locus);
+			visitor.hash(function->expressionLoci.size());
+			for(auto& expressionLocus : function->expressionLoci) { hashLocus(expressionLocus.locus); }
+		}
+		return getMD5String(md5);
+	}
+
+	std::string getFileHash(const char* filePath)
+	{
+		auto fileBufferOrError = llvm::MemoryBuffer::getFile(filePath);
+		if(!fileBufferOrError) { return ""; }
+		llvm::MD5 md5;
+		md5.update((*fileBufferOrError)->getBuffer());
+		return getMD5String(md5);
+	}
+
+	std::string getModuleObjectKey(const Module* astModule,const std::string& targetTriple,const std::string& targetCPU,const std::string& targetFeatures,const char* optimizationSettings)
+	{
+		llvm::MD5 md5;
+		ModuleHashVisitor visitor(md5,astModule);
+
+		// Hash the version of the cache and LLVM, and the target the code was generated for.
+		visitor.hash(objectFileVersion);
+		visitor.hashString(LLVM_VERSION_STRING);
+		visitor.hashString(targetTriple.c_str());
+		visitor.hashString(targetCPU.c_str());
+		visitor.hashString(targetFeatures.c_str());
+		visitor.hashString(optimizationSettings);
+		visitor.hash(Runtime::instanceAddressSpaceMaxBytes);
+
+		hashModule(visitor,astModule);
+		return getMD5String(md5);
+	}
+
+	std::string getObjectCacheFilePath(const char* cacheDirectory,const std::string& moduleObjectKey)
+	{
+		llvm::SmallString<256> cacheFilePath(cacheDirectory);
+		llvm::sys::path::append(cacheFilePath,moduleObjectKey + ".wavmobj");
+		return cacheFilePath.str();
+	}
+
+	bool loadModuleObjects(const std::string& filePath,const std::string& moduleObjectKey,std::vector<std::unique_ptr<llvm::MemoryBuffer>>& outObjectBuffers)
+	{
+		auto fileBufferOrError = llvm::MemoryBuffer::getFile(filePath);
+		if(!fileBufferOrError) { return false; }
+		auto fileBytes = (*fileBufferOrError)->getBuffer();
+
+		// Read the file header.
+		uintptr offset = 0;
+		auto read = [&](void* outData,size_t numBytes) -> bool
+		{
+			if(offset + numBytes > fileBytes.size()) { return false; }
+			memcpy(outData,fileBytes.data() + offset,numBytes);
+			offset += numBytes;
+			return true;
+		};
+		uint32 magic = 0;
+		uint32 version = 0;
+		char fileModuleObjectKey[32] = {0};
+		uint32 numObjects = 0;
+		if(!read(&magic,sizeof(magic)) || magic != objectFileMagic
+		|| !read(&version,sizeof(version)) || version != objectFileVersion
+		|| !read(fileModuleObjectKey,sizeof(fileModuleObjectKey))
+		|| !read(&numObjects,sizeof(numObjects)))
+		{
+			std::cerr << "Ignoring invalid module object file " << filePath << std::endl;
+			return false;
+		}
+
+		// Check that the file contains code for the same module, target, and optimization settings.
+		if(moduleObjectKey != std::string(fileModuleObjectKey,sizeof(fileModuleObjectKey)))
+		{
+			std::cerr << "Ignoring module object file " << filePath << " that was compiled from a different module or with different settings" << std::endl;
+			return false;
+		}
+
+		// Copy each object into its own buffer.
+		std::vector<std::unique_ptr<llvm::MemoryBuffer>> objectBuffers;
+		for(uint32 objectIndex = 0;objectIndex < numObjects;++objectIndex)
+		{
+			uint64 numObjectBytes = 0;
+			if(!read(&numObjectBytes,sizeof(numObjectBytes)) || offset + numObjectBytes > fileBytes.size())
+			{
+				std::cerr << "Ignoring truncated module object file " << filePath << std::endl;
+				return false;
+			}
+			objectBuffers.push_back(llvm::MemoryBuffer::getMemBufferCopy(fileBytes.substr(offset,numObjectBytes),filePath));
+			offset += numObjectBytes;
+		}
+
+		outObjectBuffers = std::move(objectBuffers);
+		return true;
+	}
+
+	bool saveModuleObjects(const std::string& filePath,const std::string& moduleObjectKey,const std::vector<std::unique_ptr<llvm::MemoryBuffer>>& objectBuffers)
+	{
+		// Write the objects to a temporary file, then rename it to the file path. This ensures that another process
+		// that is reading the same file will either see the complete file or no file.
+		assert(moduleObjectKey.size() == 32);
+		int temporaryFileDescriptor = -1;
+		llvm::SmallString<256> temporaryFilePath;
+		if(llvm::sys::fs::createUniqueFile(filePath + "-%%%%%%.tmp",temporaryFileDescriptor,temporaryFilePath))
+		{
+			std::cerr << "Couldn't create module object file " << filePath << std::endl;
+			return false;
+		}
+		{
+			llvm::raw_fd_ostream fileStream(temporaryFileDescriptor,true);
+			auto write = [&](const void* data,size_t numBytes) { fileStream.write((const char*)data,numBytes); };
+			const uint32 numObjects = (uint32)objectBuffers.size();
+			write(&objectFileMagic,sizeof(objectFileMagic));
+			write(&objectFileVersion,sizeof(objectFileVersion));
+			write(moduleObjectKey.data(),moduleObjectKey.size());
+			write(&numObjects,sizeof(numObjects));
+			for(auto& objectBuffer : objectBuffers)
+			{
+				const uint64 numObjectBytes = objectBuffer->getBufferSize();
+				write(&numObjectBytes,sizeof(numObjectBytes));
+				write(objectBuffer->getBufferStart(),objectBuffer->getBufferSize());
+			}
+		}
+		if(llvm::sys::fs::rename(temporaryFilePath,filePath))
+		{
+			std::cerr << "Couldn't write module object file " << filePath << std::endl;
+			llvm::sys::fs::remove(temporaryFilePath);
+			return false;
+		}
+		return true;
+	}
+}
@@ -0,0 +1,85 @@
+#include "LLVMJIT.h"
+
+#include <fstream>
+#include <sstream>
+
+namespace LLVMJIT
+{
+	// Identifies the format of the profile files. Change this when the file format or the order the emitter allocates counters in changes.
+	static const char* profileFileHeader = "wavm-profile";
+	static const uint32 profileFileVersion = 2;
+
+	bool loadModuleProfile(const char* filePath,const AST::Module* astModule,ModuleProfile& outProfile)
+	{
+		std::ifstream stream(filePath);
+		if(!stream.is_open())
+		{
+			std::cerr << "Couldn't open profile file " << filePath << std::endl;
+			return false;
+		}
+
+		// Read the header, and check that the profile was recorded for the same module.
+		std::string header;
+		uint32 version = 0;
+		std::string moduleHash;
+		uintptr numFunctions = 0;
+		stream >> header >> version >> moduleHash >> numFunctions;
+		if(!stream || header != profileFileHeader || version != profileFileVersion)
+		{
+			std::cerr << "Ignoring invalid profile file " << filePath << std::endl;
+			return false;
+		}
+		if(moduleHash != getModuleHash(astModule) || numFunctions != astModule->functions.size())
+		{
+			std::cerr << "Ignoring profile file " << filePath << " that was recorded for a different module" << std::endl;
+			return false;
+		}
+
+		// Read the counters for each function that has a profile.
+		ModuleProfile profile;
+		profile.functionCounters.resize(numFunctions);
+		uintptr functionIndex = 0;
+		uintptr numCounters = 0;
+		while(stream >> functionIndex >> numCounters)
+		{
+			if(functionIndex >= numFunctions)
+			{
+				std::cerr << "Ignoring invalid profile file " << filePath << std::endl;
+				return false;
+			}
+			auto& functionCounters = profile.functionCounters[functionIndex];
+			functionCounters.resize(numCounters);
+			for(auto& counter : functionCounters) { stream >> counter; }
+		}
+		if(!stream.eof())
+		{
+			std::cerr << "Ignoring invalid profile file " << filePath << std::endl;
+			return false;
+		}
+
+		outProfile = std::move(profile);
+		return true;
+	}
+
+	bool saveModuleProfile(const char* filePath,const AST::Module* astModule,const ModuleProfile& profile)
+	{
+		std::ofstream stream(filePath);
+		if(!stream.is_open())
+		{
+			std::cerr << "Couldn't create profile file " << filePath << std::endl;
+			return false;
+		}
+
+		// Write one line per function that has a profile: the function index, the number of counters, and then the counters.
+		stream << profileFileHeader << ' ' << profileFileVersion << ' ' << getModuleHash(astModule) << ' ' << profile.functionCounters.size() << std::endl;
+		for(uintptr functionIndex = 0;functionIndex < profile.functionCounters.size();++functionIndex)
+		{
+			auto& functionCounters = profile.functionCounters[functionIndex];
+			if(!functionCounters.size()) { continue; }
+			stream << functionIndex << ' ' << functionCounters.size();
+			for(auto counter : functionCounters) { stream << ' ' << counter; }
+			stream << std::endl;
+		}
+		return !!stream;
+	}
+}
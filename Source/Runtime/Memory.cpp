@@ -1,77 +1,101 @@
 #include "Core/Core.h"
-#include "Runtime.h"
+#include "RuntimePrivate.h"
 #include "Core/Platform.h"
 
+#include <algorithm>
+#include <iostream>
+
 namespace Runtime
 {
-	bool instanceMemoryInitialized = false;
-	uint8* instanceMemoryBase = nullptr;
 	size_t instanceAddressSpaceMaxBytes = 0;
 
-	uint8* unalignedInstanceMemoryBase = nullptr;
+	InstanceMemory* defaultInstanceMemory = nullptr;
+	THREAD_LOCAL InstanceMemory* currentInstanceMemory = nullptr;
 
-	static size_t numCommittedVirtualPages = 0;
-	static uint32 numAllocatedBytes = 0;
+	// The alignment of each instance memory's base, and the number of pages reserved for an instance memory, including the alignment padding.
+	static size_t instanceMemoryAlignment = 0;
+	static size_t numReservedVirtualPages = 0;
 
-	bool initInstanceMemory()
+	bool initInstanceMemory(uint64 addressSpaceMaxBytes)
 	{
-		numCommittedVirtualPages = 0;
-		numAllocatedBytes = 0;
-		if(!instanceMemoryInitialized)
+		if(!defaultInstanceMemory)
 		{
-		        // On a 64 runtime, allocate 4TB of address space for the instance. This is a tradeoff:
-			// - Windows 8+ and Linux user processes can allocate 128TB of virtual memory.
+		        // On a 64 runtime, allocate 4TB of address space for each instance by default. This is a tradeoff:
+			// - Windows 8+ and Linux user processes can allocate 128TB of virtual memory, so that allows ~30 instance memories.
 			// - Windows 7 user processes can allocate 8TB of virtual memory.
 			// - Windows (haven't checked on Linux) allocates a fair amount of physical memory
 			//   for memory management data structures: 128MB for 64TB.
-			const size_t addressSpaceMaxBytes = sizeof(uintptr) == 8 ? 4ull*1024*1024*1024*1024 : 0x40000000;
-			instanceAddressSpaceMaxBytes = addressSpaceMaxBytes;
+			if(!addressSpaceMaxBytes) { addressSpaceMaxBytes = sizeof(uintptr) == 8 ? 4ull*1024*1024*1024*1024 : 0x40000000; }
+			const uint64 pageSize = 1ull << Platform::getPreferredVirtualPageSizeLog2();
+			if((addressSpaceMaxBytes & (addressSpaceMaxBytes - 1)) || addressSpaceMaxBytes < pageSize || addressSpaceMaxBytes > (sizeof(uintptr) == 8 ? 1ull<<46 : 0x40000000))
+			{
+				std::cerr << "The instance address-space reservation must be a power of two between the page size and " << (sizeof(uintptr) == 8 ? "64TB" : "1GB") << std::endl;
+				return false;
+			}
+			instanceAddressSpaceMaxBytes = (size_t)addressSpaceMaxBytes;
 
-			// On a 64 bit runtime, align the instance memory base to a 4GB boundary, so the lower 32-bits will all be zero. Maybe it will allow better code generation?
-			// Note that this reserves a full extra 4GB, but only uses (4GB-1 page) for alignment, so there will always be a guard page at the end to
+			// On a 64 bit runtime, align the instance memory base to a 4GB boundary (or the size of a smaller reservation), so the lower bits will all be zero. Maybe it will allow better code generation?
+			// Note that this reserves a full extra alignment, but only uses (alignment-1 page) for alignment, so there will always be a guard page at the end to
 			// protect against unaligned loads/stores that straddle the end of the address-space.
-			const size_t numAllocatedVirtualPages = addressSpaceMaxBytes >> Platform::getPreferredVirtualPageSizeLog2();
-			const size_t alignment = sizeof(uintptr) == 8 ? 4ull*1024*1024*1024 : (uintptr)1 << Platform::getPreferredVirtualPageSizeLog2();
-			const size_t pageAlignment = alignment >> Platform::getPreferredVirtualPageSizeLog2();
-			unalignedInstanceMemoryBase = Platform::allocateVirtualPages(numAllocatedVirtualPages + pageAlignment);
-			if(!unalignedInstanceMemoryBase) { return false; }
-			instanceMemoryBase = (uint8*)((uintptr)(unalignedInstanceMemoryBase + alignment - 1) & ~(alignment - 1));
+			instanceMemoryAlignment = sizeof(uintptr) == 8 ? (size_t)std::min(addressSpaceMaxBytes,(uint64)4*1024*1024*1024) : (uintptr)pageSize;
+			numReservedVirtualPages = (instanceAddressSpaceMaxBytes + instanceMemoryAlignment) >> Platform::getPreferredVirtualPageSizeLog2();
 
-			instanceMemoryInitialized = true;
+			defaultInstanceMemory = createInstanceMemory();
+			if(!defaultInstanceMemory) { return false; }
 		}
 		return true;
 	}
 
-	uint32 vmSbrk(int32 numBytes)
+	InstanceMemory* createInstanceMemory()
+	{
+		auto unalignedBase = Platform::allocateVirtualPages(numReservedVirtualPages);
+		if(!unalignedBase) { return nullptr; }
+
+		auto memory = new InstanceMemory();
+		memory->unalignedBase = unalignedBase;
+		memory->base = (uint8*)((uintptr)(unalignedBase + instanceMemoryAlignment - 1) & ~(instanceMemoryAlignment - 1));
+		memory->numBytes = 0;
+		memory->numCommittedVirtualPages = 0;
+		return memory;
+	}
+
+	void destroyInstanceMemory(InstanceMemory* memory)
+	{
+		Platform::freeVirtualPages(memory->unalignedBase,numReservedVirtualPages);
+		delete memory;
+	}
+
+	uint32 growInstanceMemory(InstanceMemory* memory,int32 numBytes)
 	{
 		// Round up to an alignment boundary.
 		numBytes = (numBytes + 7) & ~7;
-		const uint32 existingNumBytes = numAllocatedBytes;
+		const uint32 existingNumBytes = memory->numBytes;
 		if(numBytes > 0)
 		{
-			if(uint64(existingNumBytes) + numBytes > (1ull<<32))
+			// The memory can't grow past the instance's address-space reservation, or past the 4GB its size can represent.
+			if(uint64(existingNumBytes) + numBytes > std::min((uint64)instanceAddressSpaceMaxBytes,(uint64)UINT32_MAX))
 			{
 				return (uint32)-1;
 			}
 
 			const uint32 pageSizeLog2 = Platform::getPreferredVirtualPageSizeLog2();
 			const uint32 pageSize = 1ull << pageSizeLog2;
-			const size_t numDesiredPages = (numAllocatedBytes + numBytes + pageSize - 1) >> pageSizeLog2;
-			const intptr deltaPages = numDesiredPages - numCommittedVirtualPages;
+			const size_t numDesiredPages = (memory->numBytes + numBytes + pageSize - 1) >> pageSizeLog2;
+			const intptr deltaPages = numDesiredPages - memory->numCommittedVirtualPages;
 			if(deltaPages > 0)
 			{
-				bool successfullyCommittedPhysicalMemory = Platform::commitVirtualPages(instanceMemoryBase + (numCommittedVirtualPages << pageSizeLog2),deltaPages);
+				bool successfullyCommittedPhysicalMemory = Platform::commitVirtualPages(memory->base + (memory->numCommittedVirtualPages << pageSizeLog2),deltaPages);
 				if(!successfullyCommittedPhysicalMemory)
 				{
 					return (uint32)-1;
 				}
-				numCommittedVirtualPages += deltaPages;
+				memory->numCommittedVirtualPages += deltaPages;
 			}
-			numAllocatedBytes += numBytes;
+			memory->numBytes += numBytes;
 		}
 		else if(numBytes < 0)
 		{
-			numAllocatedBytes += numBytes;
+			memory->numBytes += numBytes;
 		}
 		return (int32)existingNumBytes;
 	}
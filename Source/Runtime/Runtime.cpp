@@ -5,15 +5,32 @@
 #include "RuntimePrivate.h"
 
 #include <iostream>
+#include <sstream>
+#include <cstdlib>
 
 namespace AST { struct Module; }
 
 namespace Runtime
 {
-	bool init()
+	bool init(const InitOptions& options)
 	{
 		LLVMJIT::init();
-		return initInstanceMemory();
+		if(options.enableTestIntrinsics) { initTestIntrinsics(); }
+
+		// Join the tier-up threads at exit, before the static objects they use are destroyed.
+		static bool isShutdownRegistered = false;
+		if(!isShutdownRegistered)
+		{
+			std::atexit(shutdown);
+			isShutdownRegistered = true;
+		}
+
+		return initInstanceMemory(options.instanceAddressSpaceMaxBytes);
+	}
+
+	void shutdown()
+	{
+		LLVMJIT::shutdown();
 	}
 	
 	const char* describeExceptionCause(Exception::Cause cause)
@@ -30,6 +47,74 @@ namespace Runtime
 		}
 	}
 
+	const char* describeOptimizationLevel(OptimizationLevel level)
+	{
+		switch(level)
+		{
+		case OptimizationLevel::O0: return "O0";
+		case OptimizationLevel::O1: return "O1";
+		case OptimizationLevel::O2: return "O2";
+		case OptimizationLevel::O3: return "O3";
+		case OptimizationLevel::Os: return "Os";
+		default: return "unknown";
+		}
+	}
+
+	static const char* describeCodeSource(CompileStats::CodeSource codeSource)
+	{
+		switch(codeSource)
+		{
+		case CompileStats::CodeSource::Generated: return "generated";
+		case CompileStats::CodeSource::Precompiled: return "precompiled";
+		case CompileStats::CodeSource::ObjectCache: return "object cache";
+		case CompileStats::CodeSource::LazyStubs: return "lazy stubs";
+		default: return "unknown";
+		}
+	}
+
+	std::string describeCompileStats(const CompileStats& stats)
+	{
+		std::ostringstream stream;
+		stream << "Machine code: " << describeCodeSource(stats.codeSource) << " (" << describeOptimizationLevel(stats.optimizationLevel) << ", " << stats.numThreads << " threads)" << std::endl;
+		stream << "Functions: " << stats.numFunctions << " (" << stats.numInlinedFunctions << " inlined into " << stats.numInlinedCallSites << " call sites)" << std::endl;
+		stream << "Speculated indirect call sites: " << stats.numSpeculatedCallSites << std::endl;
+		stream << "LLVM IR instructions: " << stats.numEmittedInstructions << " emitted, " << stats.numOptimizedInstructions << " after optimization" << std::endl;
+		stream << "Code size: " << stats.numCodeBytes << " bytes of machine code in " << stats.numObjectBytes << " bytes of object files" << std::endl;
+		stream << "Parse: " << stats.parseMilliseconds << "ms" << std::endl;
+		stream << "Emit: " << stats.emitMilliseconds << "ms" << std::endl;
+		stream << "Optimize: " << stats.optimizeMilliseconds << "ms" << std::endl;
+		stream << "Code generation: " << stats.codeGenMilliseconds << "ms" << std::endl;
+		stream << "Link: " << stats.linkMilliseconds << "ms" << std::endl;
+		stream << "Total: " << stats.totalMilliseconds << "ms" << std::endl;
+		stream << "Peak memory: " << stats.peakMemoryBytes / 1024 << "KB" << std::endl;
+		return stream.str();
+	}
+
+	std::string describeCompileStatsAsJSON(const CompileStats& stats)
+	{
+		std::ostringstream stream;
+		stream << "{\"codeSource\":\"" << describeCodeSource(stats.codeSource) << "\""
+			<< ",\"optimizationLevel\":\"" << describeOptimizationLevel(stats.optimizationLevel) << "\""
+			<< ",\"numFunctions\":" << stats.numFunctions
+			<< ",\"numThreads\":" << stats.numThreads
+			<< ",\"numInlinedFunctions\":" << stats.numInlinedFunctions
+			<< ",\"numInlinedCallSites\":" << stats.numInlinedCallSites
+			<< ",\"numSpeculatedCallSites\":" << stats.numSpeculatedCallSites
+			<< ",\"numEmittedInstructions\":" << stats.numEmittedInstructions
+			<< ",\"numOptimizedInstructions\":" << stats.numOptimizedInstructions
+			<< ",\"numObjectBytes\":" << stats.numObjectBytes
+			<< ",\"numCodeBytes\":" << stats.numCodeBytes
+			<< ",\"parseMilliseconds\":" << stats.parseMilliseconds
+			<< ",\"emitMilliseconds\":" << stats.emitMilliseconds
+			<< ",\"optimizeMilliseconds\":" << stats.optimizeMilliseconds
+			<< ",\"codeGenMilliseconds\":" << stats.codeGenMilliseconds
+			<< ",\"linkMilliseconds\":" << stats.linkMilliseconds
+			<< ",\"totalMilliseconds\":" << stats.totalMilliseconds
+			<< ",\"peakMemoryBytes\":" << stats.peakMemoryBytes
+			<< "}";
+		return stream.str();
+	}
+
 	std::string describeStackFrame(const StackFrame& frame)
 	{
 		std::string frameDescription;
@@ -47,13 +132,11 @@ namespace Runtime
 		return frameDescriptions;
 	}
 
-	bool loadModule(const AST::Module* module)
+	// Allocates a module's initial memory in an instance memory that has no bytes allocated, and copies the module's data segments into it.
+	static bool initModuleMemory(InstanceMemory* memory,const AST::Module* module)
 	{
-		// Free any existing memory.
-		vmSbrk(-(int32)vmSbrk(0));
-
 		// Initialize the module's requested initial memory.
-		if(vmSbrk((int32)module->initialNumBytesMemory) != 0)
+		if(growInstanceMemory(memory,(int32)module->initialNumBytesMemory) != 0)
 		{
 			std::cerr << "Failed to commit the requested initial memory for module instance (" << module->initialNumBytesMemory/1024 << "KB requested)" << std::endl;
 			return false;
@@ -68,16 +151,108 @@ namespace Runtime
 				std::cerr << "Module data segment exceeds initial memory allocation" << std::endl;
 				return false;
 			}
-			memcpy(instanceMemoryBase + dataSegment.baseAddress,dataSegment.data,dataSegment.numBytes);
+			memcpy(memory->base + dataSegment.baseAddress,dataSegment.data,dataSegment.numBytes);
 		}
+		return true;
+	}
+
+	// Synchronizes the initialization of the default instance memory by threads that load modules concurrently.
+	static Platform::Mutex instanceMemoryMutex;
+
+	bool loadModule(const AST::Module* module,const CompileOptions& options,CompileStats* outStats)
+	{
+		Core::Timer totalTimer;
+
+		// The default instance memory is shared by all modules, so initializing it for the module is serialized with other threads that
+		// load modules. Generating the module's machine code doesn't depend on the instance memory, so it isn't.
+		{
+			Platform::Lock instanceMemoryLock(instanceMemoryMutex);
+
+			// Free any existing memory.
+			growInstanceMemory(defaultInstanceMemory,-(int32)defaultInstanceMemory->numBytes);
+			if(!initModuleMemory(defaultInstanceMemory,module)) { return false; }
 		
-		// Initialize the intrinsics.
-		initEmscriptenIntrinsics();
-		initWebAssemblyIntrinsics();
-		initWAVMIntrinsics();
+			// Initialize the intrinsics.
+			initEmscriptenIntrinsics();
+			initWebAssemblyIntrinsics();
+			initWAVMIntrinsics();
+		}
 
 		// Generate machine code for the module.
-		return LLVMJIT::compileModule(module);
+		CompileStats stats;
+		if(!LLVMJIT::compileModule(module,options,stats)) { return false; }
+
+		stats.totalMilliseconds = totalTimer.getMilliseconds();
+		stats.peakMemoryBytes = Platform::getPeakMemoryUsageBytes();
+		if(outStats) { *outStats = stats; }
+		return true;
+	}
+
+	bool compileModuleToFile(const AST::Module* module,const CompileOptions& options,const char* outputPath,CompileStats* outStats)
+	{
+		Core::Timer totalTimer;
+		CompileStats stats;
+		if(!LLVMJIT::compileModuleToFile(module,options,outputPath,stats)) { return false; }
+
+		stats.totalMilliseconds = totalTimer.getMilliseconds();
+		stats.peakMemoryBytes = Platform::getPeakMemoryUsageBytes();
+		if(outStats) { *outStats = stats; }
+		return true;
+	}
+
+	bool saveModuleProfile(const AST::Module* module,const char* filePath)
+	{
+		return LLVMJIT::saveModuleProfile(module,filePath);
+	}
+
+	bool recompileModuleWithProfile(const AST::Module* module,CompileStats* outStats)
+	{
+		Core::Timer totalTimer;
+		CompileStats stats;
+		if(!LLVMJIT::recompileModuleWithProfile(module,stats)) { return false; }
+
+		stats.totalMilliseconds = totalTimer.getMilliseconds();
+		stats.peakMemoryBytes = Platform::getPeakMemoryUsageBytes();
+		if(outStats) { *outStats = stats; }
+		return true;
+	}
+
+	bool unloadModule(const AST::Module* module)
+	{
+		return LLVMJIT::unloadModule(module);
+	}
+
+	CodeMemoryStats getCodeMemoryStats()
+	{
+		return LLVMJIT::getCodeMemoryStats();
+	}
+
+	struct Instance
+	{
+		const AST::Module* module;
+		InstanceMemory* memory;
+	};
+
+	Instance* instantiateModule(const AST::Module* module)
+	{
+		auto memory = createInstanceMemory();
+		if(!memory)
+		{
+			std::cerr << "Failed to reserve the address-space for a module instance's memory" << std::endl;
+			return nullptr;
+		}
+		if(!initModuleMemory(memory,module))
+		{
+			destroyInstanceMemory(memory);
+			return nullptr;
+		}
+		return new Instance {module,memory};
+	}
+
+	void destroyInstance(Instance* instance)
+	{
+		destroyInstanceMemory(instance->memory);
+		delete instance;
 	}
 
 	// This is called to recursively turn the boxed values in untypedArgs into C++ values.
@@ -122,7 +297,8 @@ namespace Runtime
 		}
 	};
 
-	Value invokeFunction(const AST::Module* module,uintptr functionIndex,const Value* parameters)
+	// Invokes a function of a module with the given instance memory.
+	static Value invokeFunction(const AST::Module* module,InstanceMemory* memory,uintptr functionIndex,const Value* parameters)
 	{
 		// Check that the parameter types match the function.
 		auto function = module->functions[functionIndex];
@@ -138,19 +314,37 @@ namespace Runtime
 		void* functionPtr = LLVMJIT::getFunctionPointer(module,functionIndex);
 		assert(functionPtr);
 
+		// Make the memory the one the intrinsics called by the function access, restoring the outer invoke's memory once the function returns.
+		struct CurrentInstanceMemoryScope
+		{
+			InstanceMemory* outerMemory;
+			CurrentInstanceMemoryScope(InstanceMemory* memory): outerMemory(currentInstanceMemory) { currentInstanceMemory = memory; }
+			~CurrentInstanceMemoryScope() { currentInstanceMemory = outerMemory; }
+		} currentInstanceMemoryScope(memory);
+
 		// Catch platform-specific runtime exceptions and turn them into Runtime::Values.
 		return RuntimePlatform::catchRuntimeExceptions([&]
 		{
-			// Dispatch the invoke by number of parameters in the function.
+			// Dispatch the invoke by number of parameters in the function. The generated code takes the instance memory as its first argument.
 			// We're practically limited in how many parameters can be handled because this instantiates RecursiveInvoke 7^N times.
 			switch(function->type.parameters.size())
 			{
-			case 0: return RecursiveInvoke<0>::invoke(function->type,functionPtr,parameters,0);
-			case 1: return RecursiveInvoke<1>::invoke(function->type,functionPtr,parameters,0);
-			case 2: return RecursiveInvoke<2>::invoke(function->type,functionPtr,parameters,0);
-			case 3: return RecursiveInvoke<3>::invoke(function->type,functionPtr,parameters,0);
+			case 0: return RecursiveInvoke<0,InstanceMemory*>::invoke(function->type,functionPtr,parameters,0,memory);
+			case 1: return RecursiveInvoke<1,InstanceMemory*>::invoke(function->type,functionPtr,parameters,0,memory);
+			case 2: return RecursiveInvoke<2,InstanceMemory*>::invoke(function->type,functionPtr,parameters,0,memory);
+			case 3: return RecursiveInvoke<3,InstanceMemory*>::invoke(function->type,functionPtr,parameters,0,memory);
 			default: return Value(new Exception {Exception::Cause::InvokeSignatureMismatch});
 			}
 		});
 	}
-}
\ No newline at end of file
+
+	Value invokeFunction(const AST::Module* module,uintptr functionIndex,const Value* parameters)
+	{
+		return invokeFunction(module,defaultInstanceMemory,functionIndex,parameters);
+	}
+
+	Value invokeFunction(Instance* instance,uintptr functionIndex,const Value* parameters)
+	{
+		return invokeFunction(instance->module,instance->memory,functionIndex,parameters);
+	}
+}
@@ -74,15 +74,215 @@ namespace Runtime
 		Value(Exception* inException): exception(inException), type(TypeId::Exception) {}
 	};
 
+	// The levels of optimization that may be applied to a module's generated code.
+	enum class OptimizationLevel
+	{
+		O0,	// No IR optimization, and fast instruction selection.
+		O1,
+		O2,
+		O3,
+		Os,	// Optimizes for code size.
+		num
+	};
+
+	// Options that control how a module is compiled.
+	struct CompileOptions
+	{
+		// The optimization pipeline used for the module. With tiered compilation, this is the level of the optimized tier.
+		OptimizationLevel optimizationLevel;
+
+		// If non-null, the name of the CPU model to generate code for, using only the features that model implies. Otherwise, code is
+		// generated for the host CPU and all the features it supports.
+		const char* targetCPU;
+
+		// If non-null, a directory used to cache the machine code generated for modules, so it can be reused by later processes.
+		const char* objectCacheDirectory;
+
+		// If non-null, the path of a file written by compileModuleToFile that holds the module's machine code. The module is loaded
+		// from the file without generating any code, so it must have been compiled with the same optimization level and target CPU.
+		const char* precompiledObjectPath;
+
+		// If true, the module is quickly compiled with minimal optimization so it can run sooner, and then recompiled with
+		// full optimization on a background thread. The optimized code replaces the baseline code once it is ready.
+		bool enableTieredCompilation;
+
+		// If true, each of the module's functions is compiled the first time it is called, instead of when the module is loaded.
+		// The object cache and tiered compilation aren't used for lazily compiled modules.
+		bool enableLazyCompilation;
+
+		// If true, the module's code counts how often each function is called, each branch is taken, and each loop iterates.
+		// saveModuleProfile and recompileModuleWithProfile use the counts. Instrumented modules aren't compiled with tiered compilation.
+		bool enableProfileInstrumentation;
+
+		// If non-null, the path of a profile written by saveModuleProfile that guides the optimization of the module's code.
+		// It is ignored if the module is instrumented.
+		const char* profileFilePath;
+
+		// If true, the module's code is allocated from memory that is shared by all modules and backed by huge pages if the OS supports
+		// them, and the functions the profile shows are hot are placed together. The shared code memory is writable and executable.
+		bool enableHugePageCodeMemory;
+
+		// If true, on Linux, the address range and name of each of the module's functions is written to /tmp/perf-<pid>.map when it
+		// is loaded, so perf report can attribute samples to the WebAssembly functions.
+		bool enablePerfMap;
+
+		// If true, on Linux, each of the module's functions is written with a copy of its machine code to the jitdump file,
+		// /tmp/jit-<pid>.dump, so perf inject --jit can make it available to perf report and perf annotate.
+		bool enablePerfJITDump;
+
+		// If true, the module's code is generated with DWARF line info that maps it to the loci of the text file the module was parsed
+		// from, and is registered with GDB's JIT interface so debuggers and profilers can attribute it to lines of sourcePath.
+		bool enableDebugInfo;
+
+		// If true, the module's code compares each address it loads or stores against the number of bytes allocated in the instance memory,
+		// and traps with an access violation if any accessed byte is out of bounds, instead of masking the address. Checks implied by an
+		// earlier check of the same base address are omitted, and the checks of addresses relative to locals a loop doesn't change are made
+		// once before entering the loop. Out of bounds accesses trap even if they are within the committed pages of the instance memory.
+		bool enableBoundsChecks;
+
+		// If non-null, the path of the file the module was loaded from. The debug info refers to it as the module's source file.
+		const char* sourcePath;
+
+		CompileOptions(): optimizationLevel(OptimizationLevel::O2), targetCPU(nullptr), objectCacheDirectory(nullptr), precompiledObjectPath(nullptr), enableTieredCompilation(false), enableLazyCompilation(false), enableProfileInstrumentation(false), profileFilePath(nullptr), enableHugePageCodeMemory(false), enablePerfMap(false), enablePerfJITDump(false), enableDebugInfo(false), enableBoundsChecks(false), sourcePath(nullptr) {}
+	};
+
+	// Statistics about how a module was compiled.
+	struct CompileStats
+	{
+		// Where the module's machine code came from.
+		enum class CodeSource : uint8
+		{
+			Generated,
+			Precompiled,	// Loaded from CompileOptions::precompiledObjectPath.
+			ObjectCache,	// Loaded from CompileOptions::objectCacheDirectory.
+			LazyStubs		// Only the lazy compilation stubs were generated; the functions are compiled when they are first called.
+		};
+		CodeSource codeSource;
+
+		// The optimization level the code was generated at. With tiered compilation, this is the level of the baseline tier, since the
+		// optimized tier is compiled after loadModule returns.
+		OptimizationLevel optimizationLevel;
+
+		uintptr numFunctions;
+		uintptr numThreads;
+		uintptr numInlinedFunctions;
+		uintptr numInlinedCallSites;
+
+		// The number of call_indirect sites that call the targets the profile shows they usually call directly.
+		uintptr numSpeculatedCallSites;
+
+		// The number of LLVM IR instructions emitted for the module, and the number left after optimization.
+		uintptr numEmittedInstructions;
+		uintptr numOptimizedInstructions;
+
+		// The size of the module's object files, and of the machine code of the functions linked from them. compileModuleToFile doesn't
+		// link the module, so it leaves numCodeBytes zero. With tiered compilation, these are the sizes of the baseline code, which isn't
+		// freed when the optimized code replaces it, but only when the module is unloaded.
+		uintptr numObjectBytes;
+		uintptr numCodeBytes;
+
+		// The time spent in each phase of the compilation. The optimization and code generation times are summed over all threads, so they
+		// may add up to more than the total time. The runtime doesn't parse modules, so parseMilliseconds is only set by the caller.
+		float64 parseMilliseconds;
+		float64 emitMilliseconds;
+		float64 optimizeMilliseconds;
+		float64 codeGenMilliseconds;
+		float64 linkMilliseconds;
+		float64 totalMilliseconds;
+
+		// The peak physical memory used by the process when the compilation finished.
+		uint64 peakMemoryBytes;
+
+		CompileStats()
+		: codeSource(CodeSource::Generated), optimizationLevel(OptimizationLevel::O2), numFunctions(0), numThreads(0), numInlinedFunctions(0), numInlinedCallSites(0), numSpeculatedCallSites(0)
+		, numEmittedInstructions(0), numOptimizedInstructions(0), numObjectBytes(0), numCodeBytes(0)
+		, parseMilliseconds(0.0), emitMilliseconds(0.0), optimizeMilliseconds(0.0), codeGenMilliseconds(0.0), linkMilliseconds(0.0), totalMilliseconds(0.0)
+		, peakMemoryBytes(0) {}
+	};
+
+	// Statistics about the memory used for the code and data of the loaded modules.
+	struct CodeMemoryStats
+	{
+		// The number of bytes allocated for the code and data of the loaded modules. unloadModule frees a module's allocations.
+		uint64 numAllocatedBytes;
+
+		// The number of bytes of the memory shared by modules loaded with CompileOptions::enableHugePageCodeMemory that are below the end of
+		// its last allocation, including the freed blocks below it. Freed blocks are reused, so it doesn't grow when modules are reloaded.
+		uint64 numSharedMemoryBytes;
+
+		CodeMemoryStats(): numAllocatedBytes(0), numSharedMemoryBytes(0) {}
+	};
+
+	// Options that control how the runtime is initialized.
+	struct InitOptions
+	{
+		// The number of bytes of address-space to reserve for each instance memory, which must be a power of two. An instance memory can't
+		// grow beyond it, or beyond 4GB. If zero, 4TB is reserved on a 64-bit runtime, and 1GB on a 32-bit runtime. A smaller reservation
+		// allows more instance memories in the process, and with CompileOptions::enableBoundsChecks, out of bounds accesses still trap.
+		uint64 instanceAddressSpaceMaxBytes;
+
+		// Allows modules to import the wavmIntrinsics that expose runtime internals to tests, like callerOptimizationLevel.
+		bool enableTestIntrinsics;
+
+		InitOptions(): instanceAddressSpaceMaxBytes(0), enableTestIntrinsics(false) {}
+	};
+
 	// Initializes the runtime.
-	RUNTIME_API bool init();
+	RUNTIME_API bool init(const InitOptions& options = InitOptions());
+
+	// Waits for the background compilation of the modules loaded with CompileOptions::enableTieredCompilation to finish. init registers
+	// this to be called at exit, so the background compilation doesn't use the runtime while it's being destroyed.
+	RUNTIME_API void shutdown();
+
+	// Adds a module to the instance. If outStats is non-null, it receives statistics about how the module was compiled.
+	// Different modules may be loaded from multiple threads at once: their machine code is generated concurrently.
+	RUNTIME_API bool loadModule(const AST::Module* module,const CompileOptions& options = CompileOptions(),CompileStats* outStats = nullptr);
+
+	// Generates machine code for a module ahead-of-time, and writes it to a file that loadModule can load with CompileOptions::precompiledObjectPath.
+	RUNTIME_API bool compileModuleToFile(const AST::Module* module,const CompileOptions& options,const char* outputPath,CompileStats* outStats = nullptr);
+
+	// Writes the profile recorded by a module compiled with CompileOptions::enableProfileInstrumentation to a file.
+	RUNTIME_API bool saveModuleProfile(const AST::Module* module,const char* filePath);
+
+	// Recompiles a module compiled with CompileOptions::enableProfileInstrumentation using the profile it has recorded so far, and
+	// replaces its code with the recompiled code. The recompiled code isn't instrumented. If outStats is non-null, it receives statistics
+	// about how the module was recompiled.
+	RUNTIME_API bool recompileModuleWithProfile(const AST::Module* module,CompileStats* outStats = nullptr);
+
+	// Removes a module from the instance, and frees its machine code. None of the module's functions may be executing when this is called,
+	// and the module's functions may not be invoked afterward unless it is loaded again.
+	RUNTIME_API bool unloadModule(const AST::Module* module);
 
-	// Adds a module to the instance.
-	RUNTIME_API bool loadModule(const AST::Module* module);
+	// Returns statistics about the memory used for the code and data of the loaded modules.
+	RUNTIME_API CodeMemoryStats getCodeMemoryStats();
 
-	// Invokes a function with the provided boxed parameters.
+	// An instance of a loaded module with its own linear memory. All instances of a module execute the machine code loadModule generated for it,
+	// which is passed the memory of the instance it's invoked for. Each instance reserves 4TB of address-space for its memory on a 64-bit runtime.
+	struct Instance;
+
+	// Creates an instance of a module that was loaded by loadModule, and initializes its memory with the module's data segments. Intrinsics that
+	// keep their state in memory, like the Emscripten intrinsics, only initialize it in the memory loadModule initializes for the module.
+	// Returns null if the instance's memory couldn't be allocated.
+	RUNTIME_API Instance* instantiateModule(const AST::Module* module);
+
+	// Frees an instance and its memory. None of its functions may be executing when this is called.
+	RUNTIME_API void destroyInstance(Instance* instance);
+
+	// Invokes a function with the provided boxed parameters, using the memory loadModule initialized for the module.
 	RUNTIME_API Value invokeFunction(const AST::Module* module,uintptr functionIndex,const Value* parameters);
 
+	// Invokes a function of an instance's module with the provided boxed parameters, using the instance's memory.
+	RUNTIME_API Value invokeFunction(Instance* instance,uintptr functionIndex,const Value* parameters);
+
+	// Returns the name of an optimization level, as it is passed to the Run and Test programs.
+	RUNTIME_API const char* describeOptimizationLevel(OptimizationLevel level);
+
 	// Returns a string that describes the given exception cause.
 	RUNTIME_API const char* describeExceptionCause(Runtime::Exception::Cause cause);
+
+	// Returns a multi-line, human-readable description of a module's compile statistics.
+	RUNTIME_API std::string describeCompileStats(const CompileStats& stats);
+
+	// Returns a module's compile statistics as a single-line JSON object.
+	RUNTIME_API std::string describeCompileStatsAsJSON(const CompileStats& stats);
 }
@@ -7,6 +7,15 @@
 #include <setjmp.h>
 #include <sys/resource.h>
 
+#ifdef __linux__
+	#include <stdio.h>
+	#include <iostream>
+	#include <time.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/syscall.h>
+#endif
+
 namespace RuntimePlatform
 {
 	using namespace Runtime;
@@ -115,6 +124,125 @@ namespace RuntimePlatform
 	{
 		return Runtime::ExecutionContext();
 	}
+
+	#ifdef __linux__
+		Platform::Mutex perfMapMutex;
+		FILE* perfMapFile = nullptr;
+
+		void writePerfMapSymbol(uintptr baseAddress,size_t numBytes,const std::string& name)
+		{
+			Platform::Lock lock(perfMapMutex);
+			if(!perfMapFile)
+			{
+				const std::string perfMapPath = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+				perfMapFile = fopen(perfMapPath.c_str(),"w");
+				if(!perfMapFile) { std::cerr << "Couldn't open " << perfMapPath << std::endl; return; }
+			}
+
+			// Each line of the perf map gives the hexadecimal address and size of a function, and its name.
+			fprintf(perfMapFile,"%llx %llx %s\n",(unsigned long long)baseAddress,(unsigned long long)numBytes,name.c_str());
+			fflush(perfMapFile);
+		}
+
+		// The jitdump file header and records, as defined by tools/perf/Documentation/jitdump-specification.txt in the Linux source.
+		struct JITDumpFileHeader
+		{
+			uint32 magic;
+			uint32 version;
+			uint32 numBytes;
+			uint32 elfMachine;
+			uint32 padding;
+			uint32 pid;
+			uint64 timestamp;
+			uint64 flags;
+		};
+
+		struct JITDumpRecordHeader
+		{
+			uint32 id;
+			uint32 numBytes;
+			uint64 timestamp;
+		};
+
+		// A JIT_CODE_LOAD record. It is followed by the null-terminated function name and the function's machine code.
+		struct JITDumpCodeLoadRecord
+		{
+			JITDumpRecordHeader header;
+			uint32 pid;
+			uint32 tid;
+			uint64 virtualAddress;
+			uint64 codeAddress;
+			uint64 codeNumBytes;
+			uint64 codeIndex;
+		};
+
+		Platform::Mutex jitDumpMutex;
+		FILE* jitDumpFile = nullptr;
+		uint64 nextJITDumpCodeIndex = 0;
+
+		// perf record -k mono timestamps samples with the monotonic clock, so the jitdump records must use the same clock.
+		uint64 getJITDumpTimestamp()
+		{
+			struct timespec time;
+			clock_gettime(CLOCK_MONOTONIC,&time);
+			return (uint64)time.tv_sec * 1000000000 + time.tv_nsec;
+		}
+
+		bool openJITDumpFile()
+		{
+			const std::string jitDumpPath = "/tmp/jit-" + std::to_string(getpid()) + ".dump";
+			jitDumpFile = fopen(jitDumpPath.c_str(),"w+");
+			if(!jitDumpFile) { std::cerr << "Couldn't open " << jitDumpPath << std::endl; return false; }
+
+			// perf record finds the jitdump file by looking for an executable mapping of it, so map its first page and leave it mapped.
+			const size_t pageNumBytes = (size_t)1 << Platform::getPreferredVirtualPageSizeLog2();
+			if(mmap(nullptr,pageNumBytes,PROT_READ | PROT_EXEC,MAP_PRIVATE,fileno(jitDumpFile),0) == MAP_FAILED)
+			{ std::cerr << "Couldn't map " << jitDumpPath << ": perf record won't find it" << std::endl; }
+
+			JITDumpFileHeader fileHeader;
+			fileHeader.magic = 0x4A695444;
+			fileHeader.version = 1;
+			fileHeader.numBytes = sizeof(JITDumpFileHeader);
+			#if defined(__x86_64__)
+				fileHeader.elfMachine = 62;		// EM_X86_64
+			#elif defined(__i386__)
+				fileHeader.elfMachine = 3;		// EM_386
+			#elif defined(__aarch64__)
+				fileHeader.elfMachine = 183;	// EM_AARCH64
+			#elif defined(__arm__)
+				fileHeader.elfMachine = 40;		// EM_ARM
+			#else
+				fileHeader.elfMachine = 0;
+			#endif
+			fileHeader.padding = 0;
+			fileHeader.pid = (uint32)getpid();
+			fileHeader.timestamp = getJITDumpTimestamp();
+			fileHeader.flags = 0;
+			fwrite(&fileHeader,sizeof(fileHeader),1,jitDumpFile);
+			return true;
+		}
+
+		void writePerfJITDumpSymbol(uintptr baseAddress,size_t numBytes,const std::string& name)
+		{
+			Platform::Lock lock(jitDumpMutex);
+			if(!jitDumpFile && !openJITDumpFile()) { return; }
+
+			JITDumpCodeLoadRecord record;
+			record.header.id = 0;	// JIT_CODE_LOAD
+			record.header.numBytes = (uint32)(sizeof(record) + name.size() + 1 + numBytes);
+			record.header.timestamp = getJITDumpTimestamp();
+			record.pid = (uint32)getpid();
+			record.tid = (uint32)syscall(SYS_gettid);
+			record.virtualAddress = baseAddress;
+			record.codeAddress = baseAddress;
+			record.codeNumBytes = numBytes;
+			record.codeIndex = nextJITDumpCodeIndex++;
+			fwrite(&record,sizeof(record),1,jitDumpFile);
+			fwrite(name.c_str(),name.size() + 1,1,jitDumpFile);
+			fwrite((const void*)baseAddress,numBytes,1,jitDumpFile);
+			fflush(jitDumpFile);
+		}
+	#endif
 }
 
 #endif
\ No newline at end of file
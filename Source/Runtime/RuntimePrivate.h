@@ -19,31 +19,63 @@ namespace Runtime
 		std::vector<StackFrame> stackFrames;
 	};
 
-	// The base of the virtual address space allocated for the VM.
-	// This is never changed after it is initialized.
-	extern uint8* instanceMemoryBase;
-
-	// The number of bytes of address-space reserved (but not necessarily committed) for the VM.
+	// The number of bytes of address-space reserved (but not necessarily committed) for each instance memory.
 	// This should be a power of two, and is never changed after it is initialized.
 	extern size_t instanceAddressSpaceMaxBytes;
-	
-	// Commits or decommits memory in the VM virtual address space.
-	uint32 vmSbrk(int32 numBytes);
 
-	// Given an address as a byte index, returns a typed reference to that address of VM memory.
+	// The linear memory of a module instance. The generated code is passed a pointer to the memory of the instance it executes for,
+	// and reads base and numBytes from it, so their offsets are part of the generated code's ABI.
+	struct InstanceMemory
+	{
+		// The base of the virtual address space reserved for the memory. This is never changed after it is initialized.
+		uint8* base;
+
+		// The number of bytes of the memory that are allocated by growInstanceMemory.
+		uint32 numBytes;
+
+		uint8* unalignedBase;
+		size_t numCommittedVirtualPages;
+	};
+
+	// The memory that loadModule initializes for each module it loads, and that invokeFunction uses if it isn't given an instance.
+	extern InstanceMemory* defaultInstanceMemory;
+
+	// The memory of the instance the calling thread is executing, or null if it isn't executing one.
+	extern THREAD_LOCAL InstanceMemory* currentInstanceMemory;
+
+	// Returns the memory that intrinsics called by the generated code access.
+	inline InstanceMemory* getCurrentInstanceMemory() { return currentInstanceMemory ? currentInstanceMemory : defaultInstanceMemory; }
+
+	// Reserves the address-space for an instance memory, with no bytes allocated. Returns null if the address-space couldn't be reserved.
+	InstanceMemory* createInstanceMemory();
+
+	// Frees an instance memory and its address-space.
+	void destroyInstanceMemory(InstanceMemory* memory);
+
+	// Commits or decommits memory in an instance memory's virtual address space. Returns the previous number of bytes allocated, or -1 if
+	// the memory couldn't be committed.
+	uint32 growInstanceMemory(InstanceMemory* memory,int32 numBytes);
+
+	// Commits or decommits memory in the current instance memory.
+	inline uint32 vmSbrk(int32 numBytes) { return growInstanceMemory(getCurrentInstanceMemory(),numBytes); }
+
+	// Given an address as a byte index, returns a typed reference to that address of the current instance memory.
 	template<typename memoryType> memoryType& instanceMemoryRef(uintptr address)
 	{
-		return *(memoryType*)(instanceMemoryBase + address);
+		return *(memoryType*)(getCurrentInstanceMemory()->base + address);
 	}
 	
-	// Initializes the instance memory.
-	bool initInstanceMemory();
+	// Initializes the default instance memory, and the size of the address-space reserved for each instance memory (the default if zero).
+	bool initInstanceMemory(uint64 addressSpaceMaxBytes);
 	
 	// Initializes the various intrinsic modules.
 	void initEmscriptenIntrinsics();
 	void initWebAssemblyIntrinsics();
 	void initWAVMIntrinsics();
 
+	// Registers the intrinsics that expose runtime internals to tests.
+	void initTestIntrinsics();
+
 	// Describes a stack frame.
 	std::string describeStackFrame(const StackFrame& frame);
 
@@ -66,17 +98,38 @@ namespace RuntimePlatform
 	Runtime::ExecutionContext captureExecutionContext();
 
 	#ifdef _WIN32
-		// Registers the data used by Windows SEH to unwind stack frames.
-		void registerSEHUnwindInfo(uintptr textLoadAddress,uintptr xdataLoadAddress,uintptr pdataLoadAddress,size_t pdataNumBytes);
+		// Registers the data used by Windows SEH to unwind stack frames. Returns a handle that is passed to deregisterSEHUnwindInfo
+		// before the code is freed.
+		void* registerSEHUnwindInfo(uintptr textLoadAddress,uintptr xdataLoadAddress,uintptr pdataLoadAddress,size_t pdataNumBytes);
+		void deregisterSEHUnwindInfo(void* unwindInfo);
+	#endif
+
+	#ifdef __linux__
+		// Appends a JIT compiled function to the perf map file, /tmp/perf-<pid>.map, so perf report can attribute samples to it.
+		void writePerfMapSymbol(uintptr baseAddress,size_t numBytes,const std::string& name);
+
+		// Appends a JIT compiled function and a copy of its machine code to the jitdump file, /tmp/jit-<pid>.dump. perf inject --jit
+		// uses it to annotate the samples of a perf.data file recorded with perf record -k mono.
+		void writePerfJITDumpSymbol(uintptr baseAddress,size_t numBytes,const std::string& name);
 	#endif
 }
 
 namespace LLVMJIT
 {
 	void init();
+	void shutdown();
 
-	bool compileModule(const AST::Module* astModule);
+	bool compileModule(const AST::Module* astModule,const Runtime::CompileOptions& options,Runtime::CompileStats& outStats);
+	bool compileModuleToFile(const AST::Module* astModule,const Runtime::CompileOptions& options,const char* outputPath,Runtime::CompileStats& outStats);
+	bool saveModuleProfile(const AST::Module* astModule,const char* filePath);
+	bool recompileModuleWithProfile(const AST::Module* astModule,Runtime::CompileStats& outStats);
+	bool unloadModule(const AST::Module* astModule);
+	Runtime::CodeMemoryStats getCodeMemoryStats();
 	void* getFunctionPointer(const AST::Module* module,uintptr functionIndex);
 	
 	bool describeInstructionPointer(uintptr_t ip,std::string& outDescription);
+
+	// Finds the optimization level of the generated code containing an instruction pointer. With tiered compilation, this tells the
+	// baseline code from the optimized code.
+	bool getOptimizationLevelFromInstructionPointer(uintptr_t ip,Runtime::OptimizationLevel& outOptimizationLevel);
 }
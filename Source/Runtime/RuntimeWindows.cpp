@@ -141,7 +141,7 @@ namespace RuntimePlatform
 		RaiseException(EXCEPTION_WAVM_RUNTIME,0,1,reinterpret_cast<ULONG_PTR*>(&exception));
 	}
 
-	void registerSEHUnwindInfo(uintptr textLoadAddress,uintptr xdataLoadAddress,uintptr pdataLoadAddress,size_t pdataNumBytes)
+	void* registerSEHUnwindInfo(uintptr textLoadAddress,uintptr xdataLoadAddress,uintptr pdataLoadAddress,size_t pdataNumBytes)
 	{
 		// Use the smallest address of the 3 segments as the base address of the image.
 		// This assumes that the segments are all loaded less than 2GB away from each other!
@@ -176,6 +176,14 @@ namespace RuntimePlatform
 		{
 			throw;
 		}
+		return functionsCopy;
+	}
+
+	void deregisterSEHUnwindInfo(void* unwindInfo)
+	{
+		auto functions = reinterpret_cast<RUNTIME_FUNCTION*>(unwindInfo);
+		RtlDeleteFunctionTable(functions);
+		delete [] functions;
 	}
 	
 	bool describeInstructionPointer(uintptr_t ip,std::string& outDescription)
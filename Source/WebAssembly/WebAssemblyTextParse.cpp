@@ -877,6 +877,7 @@ namespace WebAssemblyText
 				{
 					// If successful, then advance to the next node, and coerce the expression to the expected type.
 					auto result = coerceExpression(Class(),type,nonParametricExpression,nodeIt,errorContext);
+					recordLocus(result,nodeIt);
 					++nodeIt;
 					return result;
 				}
@@ -885,7 +886,12 @@ namespace WebAssemblyText
 					// Try to parse a parametric expression.
 					auto parametricExpression = parseParametricExpression<Class>(type,nodeIt);
 					
-					if(parametricExpression) { ++nodeIt; return parametricExpression; }
+					if(parametricExpression)
+					{
+						recordLocus(parametricExpression,nodeIt);
+						++nodeIt;
+						return parametricExpression;
+					}
 					else
 					{
 						// Failed to parse an expression.
@@ -901,6 +907,12 @@ namespace WebAssemblyText
 			}
 		}
 
+		// Records the locus of the S-expression node an expression was parsed from, so the code generated for it can be mapped back to the text.
+		void recordLocus(UntypedExpression* expression,SNodeIt nodeIt)
+		{
+			if(nodeIt) { function->expressionLoci.push_back({expression,nodeIt->startLocus}); }
+		}
+
 		// Used to verify that after a SExpr was parsed into an AST node, that all children of the SExpr were consumed.
 		// If node is null, then returns result. Otherwise produces an error that there was unexpected input.
 		template<typename Class>
@@ -1092,6 +1104,7 @@ namespace WebAssemblyText
 			if(parseTaggedNode(nodeIt,Symbol::_func,childNodeIt))
 			{
 				auto function = new(module->arena) Function();
+				function->locus = nodeIt->startLocus;
 				auto functionIndex = module->functions.size();
 				module->functions.push_back(function);
 
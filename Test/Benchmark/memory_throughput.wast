@@ -0,0 +1,68 @@
+;; A load/store heavy benchmark for comparing the cost of sandboxing memory accesses, e.g.:
+;;   Run -text memory_throughput.wast main
+;;   Run -boundschecks -text memory_throughput.wast main
+;; Each pass makes a 16MB sweep over the memory with word loads and stores, and a byte sweep that reads and writes at
+;; data-dependent addresses like the hash chains and sliding window of a compressor.
+(module
+  (memory 16777216)
+
+  (func $wordPass (param $seed i32)
+    (local $i i32)
+    (set_local $i (i32.const 0))
+    (label $done
+      (loop
+        (if
+          (i32.eq (get_local $i) (i32.const 16777216))
+          (break $done)
+          (block
+            (i32.store (get_local $i) (i32.add (i32.mul (i32.load (get_local $i)) (i32.const 1103515245)) (get_local $seed)))
+            (set_local $i (i32.add (get_local $i) (i32.const 4)))
+          )
+        )
+      )
+    )
+  )
+
+  (func $bytePass (result i32)
+    (local $i i32)
+    (local $hash i32)
+    (set_local $i (i32.const 0))
+    (set_local $hash (i32.const 0))
+    (label $done
+      (loop
+        (if
+          (i32.eq (get_local $i) (i32.const 16777216))
+          (break $done)
+          (block
+            (set_local $hash (i32.and (i32.xor (i32.shl (get_local $hash) (i32.const 5)) (i32.load8_u (get_local $i))) (i32.const 0xffffff)))
+            (i32.store8 (get_local $hash) (i32.add (i32.load8_u (get_local $hash)) (i32.const 1)))
+            (set_local $i (i32.add (get_local $i) (i32.const 1)))
+          )
+        )
+      )
+    )
+    (return (get_local $hash))
+  )
+
+  (func $main
+    (local $pass i32)
+    (local $seed i32)
+    (set_local $pass (i32.const 0))
+    (set_local $seed (i32.const 12345))
+    (label $done
+      (loop
+        (if
+          (i32.eq (get_local $pass) (i32.const 32))
+          (break $done)
+          (block
+            (call $wordPass (get_local $seed))
+            (set_local $seed (call $bytePass))
+            (set_local $pass (i32.add (get_local $pass) (i32.const 1)))
+          )
+        )
+      )
+    )
+  )
+
+  (export "main" $main)
+)
@@ -0,0 +1,74 @@
+;; Accesses relative to a base address, both in straight-line code and in loops, must trap exactly when they are outside the allocated memory.
+;; With -boundschecks, checks of offsets from the same base are merged, and the checks in loops that don't set the base are made before the loop.
+(module
+    (memory 4096)
+
+    (export "sumRecord" $sumRecord)
+    (func $sumRecord (param $record i32) (param $n i32) (result i32)
+        (local $sum i32)
+        (set_local $sum (i32.const 0))
+        (label $done
+            (loop
+                (if
+                    (i32.eq (get_local $n) (i32.const 0))
+                    (break $done)
+                    (block
+                        (set_local $sum (i32.add (get_local $sum) (i32.load (get_local $record))))
+                        (set_local $sum (i32.add (get_local $sum) (i32.load (i32.add (get_local $record) (i32.const 4)))))
+                        (set_local $sum (i32.add (get_local $sum) (i32.load (i32.add (get_local $record) (i32.const 8)))))
+                        (set_local $n (i32.sub (get_local $n) (i32.const 1)))
+                    )
+                )
+            )
+        )
+        (return (get_local $sum))
+    )
+
+    (export "sumRecordIf" $sumRecordIf)
+    (func $sumRecordIf (param $record i32) (param $n i32) (param $readFar i32) (result i32)
+        (local $sum i32)
+        (set_local $sum (i32.const 0))
+        (label $done
+            (loop
+                (if
+                    (i32.eq (get_local $n) (i32.const 0))
+                    (break $done)
+                    (block
+                        (set_local $sum (i32.add (get_local $sum) (i32.load (get_local $record))))
+                        (if (i32.ne (get_local $readFar) (i32.const 0))
+                            (set_local $sum (i32.add (get_local $sum) (i32.load (i32.add (get_local $record) (i32.const 100)))))
+                        )
+                        (set_local $n (i32.sub (get_local $n) (i32.const 1)))
+                    )
+                )
+            )
+        )
+        (return (get_local $sum))
+    )
+
+    (export "storePair" $storePair)
+    (func $storePair (param $p i32) (param $v i32)
+        (i64.store (get_local $p) (i64.const 0))
+        (i32.store (i32.add (get_local $p) (i32.const 4)) (get_local $v))
+        (i32.store (get_local $p) (get_local $v))
+        (i32.store (i32.add (get_local $p) (i32.const 8)) (get_local $v))
+    )
+
+    (export "load" $load)
+    (func $load (param $i i32) (result i32) (i32.load (get_local $i)))
+)
+
+(invoke "storePair" (i32.const 4080) (i32.const 7))
+(assert_return (invoke "load" (i32.const 4080)) (i32.const 7))
+(assert_return (invoke "load" (i32.const 4084)) (i32.const 7))
+(assert_return (invoke "load" (i32.const 4088)) (i32.const 7))
+(assert_return (invoke "sumRecord" (i32.const 4080) (i32.const 3)) (i32.const 63))
+(assert_return (invoke "sumRecord" (i32.const 4084) (i32.const 1)) (i32.const 14))
+(assert_trap (invoke "sumRecord" (i32.const 4088) (i32.const 1)) "runtime: out of bounds memory access")
+(assert_trap (invoke "sumRecord" (i32.const -4) (i32.const 1)) "runtime: out of bounds memory access")
+(assert_return (invoke "sumRecord" (i32.const 4088) (i32.const 0)) (i32.const 0))
+(assert_return (invoke "sumRecordIf" (i32.const 4080) (i32.const 2) (i32.const 0)) (i32.const 14))
+(assert_trap (invoke "sumRecordIf" (i32.const 4080) (i32.const 2) (i32.const 1)) "runtime: out of bounds memory access")
+(assert_trap (invoke "storePair" (i32.const 4088) (i32.const 13)) "runtime: out of bounds memory access")
+(assert_return (invoke "load" (i32.const 4088)) (i32.const 13))
+(assert_trap (invoke "storePair" (i32.const -8) (i32.const 13)) "runtime: out of bounds memory access")
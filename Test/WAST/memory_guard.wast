@@ -0,0 +1,31 @@
+;; Accesses outside the allocated memory must trap whether addresses are masked or checked against the memory size (-boundschecks).
+;; The addresses with the high bit set would reach below the memory base if they were sign-extended instead of zero-extended.
+(module
+    (memory 4096)
+
+    (export "store" $store)
+    (func $store (param $i i32) (param $v i32) (i32.store (get_local $i) (get_local $v)))
+
+    (export "load" $load)
+    (func $load (param $i i32) (result i32) (i32.load (get_local $i)))
+
+    (export "load8" $load8)
+    (func $load8 (param $i i32) (result i32) (i32.load8_u (get_local $i)))
+
+    (export "load64" $load64)
+    (func $load64 (param $i i32) (result i64) (i64.load (get_local $i)))
+)
+
+(invoke "store" (i32.const 4092) (i32.const 42))
+(assert_return (invoke "load" (i32.const 4092)) (i32.const 42))
+(assert_trap (invoke "store" (i32.const 0x10000) (i32.const 13)) "runtime: out of bounds memory access")
+(assert_trap (invoke "load" (i32.const 0x10000)) "runtime: out of bounds memory access")
+(assert_trap (invoke "store" (i32.const 0x7ffffffc) (i32.const 13)) "runtime: out of bounds memory access")
+(assert_trap (invoke "load" (i32.const 0x7ffffffc)) "runtime: out of bounds memory access")
+(assert_trap (invoke "store" (i32.const 0x80000000) (i32.const 13)) "runtime: out of bounds memory access")
+(assert_trap (invoke "load" (i32.const 0x80000000)) "runtime: out of bounds memory access")
+(assert_trap (invoke "store" (i32.const -4) (i32.const 13)) "runtime: out of bounds memory access")
+(assert_trap (invoke "load" (i32.const -4)) "runtime: out of bounds memory access")
+(assert_trap (invoke "load" (i32.const -1)) "runtime: out of bounds memory access")
+(assert_trap (invoke "load8" (i32.const -1)) "runtime: out of bounds memory access")
+(assert_trap (invoke "load64" (i32.const -1)) "runtime: out of bounds memory access")
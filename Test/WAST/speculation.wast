@@ -0,0 +1,33 @@
+;; With -instrument, the test records which functions the call_indirect in $sum calls, recompiles the module with the profile, and
+;; runs the assertions again. The recompiled code calls $square directly, and falls back to the indirect call for $negate.
+(module
+    (table $square $negate)
+
+    (func $square (param $x i32) (result i32)
+        (i32.mul (get_local $x) (get_local $x))
+    )
+
+    (func $negate (param $x i32) (result i32)
+        (i32.sub (i32.const 0) (get_local $x))
+    )
+
+    (export "sum" $sum)
+    (func $sum (param $n i32) (param $op i32) (result i32)
+        (local $total i32)
+        (label $done
+            (loop
+                (if
+                    (i32.eq (get_local $n) (i32.const 0))
+                    (break $done)
+                )
+                (set_local $total (i32.add (get_local $total) (call_indirect 0 (get_local $op) (get_local $n))))
+                (set_local $n (i32.sub (get_local $n) (i32.const 1)))
+            )
+        )
+        (return (get_local $total))
+    )
+)
+
+(assert_return (invoke "sum" (i32.const 1000) (i32.const 0)) (i32.const 333833500))
+(assert_return (invoke "sum" (i32.const 10) (i32.const 1)) (i32.const -55))
+(assert_return (invoke "sum" (i32.const 1) (i32.const 2)) (i32.const 1))
@@ -0,0 +1,32 @@
+;; With tiered compilation (-tiered), baseline code that is still running must call the optimized code once the background compilation
+;; replaces the module's code. $main loops in the baseline code until $getLevel reports that it was called from the optimized (-O2) code.
+(module
+    (import $callerOptimizationLevel "wavmIntrinsics" "callerOptimizationLevel" (result i32))
+
+    ;; The intrinsic's result is used, so the optimized code can't make the call a tail call that returns directly to $main.
+    (func $getLevel (param $mask i32) (result i32)
+        (i32.xor (call_import $callerOptimizationLevel) (get_local $mask))
+    )
+
+    (export "main" $main)
+    (func $main (param $maxIterations i32) (result i32)
+        (local $level i32)
+        (label $done
+            (loop
+                (set_local $level (call $getLevel (i32.const 0)))
+                (if
+                    (i32.ne (get_local $level) (i32.const 0))
+                    (break $done)
+                )
+                (set_local $maxIterations (i32.sub (get_local $maxIterations) (i32.const 1)))
+                (if
+                    (i32.eq (get_local $maxIterations) (i32.const 0))
+                    (break $done)
+                )
+            )
+        )
+        (return (get_local $level))
+    )
+)
+
+(assert_return (invoke "main" (i32.const 1000000000)) (i32.const 2))